@@ -0,0 +1,726 @@
+// Compares RBTMemoryAllocator with the system malloc. Every workload runs against every allocator able to handle it,
+// and every run prints one JSON object per line, so the output can be diffed or loaded by any tool.
+// See the Benchmarks section of README.md for how to build and run it.
+#include "RBTMemoryAllocator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <list>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define RBMEM_BENCHMARK_MALLINFO
+#endif
+
+using Clock = std::chrono::steady_clock;
+using SizeType = RBTMemoryAllocator::SizeType;
+
+struct Options
+{
+	unsigned long long seed = 1;
+	double scale = 1.0; // Multiplies all iteration counts.
+	unsigned int maxThreads = 0; // 0 means hardware concurrency.
+	std::string workload; // Empty runs all of them.
+};
+
+struct Result
+{
+	std::string workload, allocator;
+	unsigned int threads = 1;
+	unsigned long long operations = 0, failed = 0;
+	double seconds = 0;
+	std::vector<uint32_t> latencies; // Nanoseconds, sampled every latencySamplingPeriod operations.
+	long long peakUsed = -1, footprintAtPeak = -1; // -1 if the allocator can't tell.
+};
+
+static constexpr unsigned int latencySamplingPeriod = 8;
+static constexpr unsigned int usageSamplingPeriod = 4096;
+
+static void printResult(Result& result)
+{
+	std::sort(result.latencies.begin(), result.latencies.end());
+	auto percentile = [&result](const double fraction) -> unsigned long long
+	{
+		if (result.latencies.empty())
+		{
+			return 0;
+		}
+		return result.latencies[std::min(result.latencies.size() - 1, (size_t)(fraction * result.latencies.size()))];
+	};
+
+	std::cout << "{\"workload\":\"" << result.workload << "\",\"allocator\":\"" << result.allocator << "\",\"threads\":" << result.threads
+		<< ",\"operations\":" << result.operations << ",\"failed\":" << result.failed << ",\"seconds\":" << result.seconds
+		<< ",\"opsPerSecond\":" << (result.seconds > 0 ? result.operations / result.seconds : 0)
+		<< ",\"p50Ns\":" << percentile(0.5) << ",\"p99Ns\":" << percentile(0.99) << ",\"p999Ns\":" << percentile(0.999);
+	if (result.peakUsed >= 0 && result.footprintAtPeak > 0)
+	{
+		std::cout << ",\"peakUsedBytes\":" << result.peakUsed << ",\"footprintBytes\":" << result.footprintAtPeak
+			<< ",\"fragmentation\":" << 1.0 - (double)result.peakUsed / result.footprintAtPeak;
+	}
+	else
+	{
+		std::cout << ",\"peakUsedBytes\":null,\"footprintBytes\":null,\"fragmentation\":null";
+	}
+	std::cout << "}" << std::endl;
+}
+
+// Allocators. Each one hands out a Worker per thread; only thread-safe ones run the multithreaded workloads.
+class MallocBackend
+{
+private:
+	long long baseUsed = 0;
+public:
+	static constexpr const char* name = "malloc";
+	static constexpr bool isThreadSafe = true;
+
+	class Worker
+	{
+	public:
+		explicit Worker(MallocBackend&)
+		{
+		}
+		void* allocate(const SizeType size)
+		{
+			return std::malloc(size);
+		}
+		void deallocate(void* ptr)
+		{
+			std::free(ptr);
+		}
+	};
+
+	// The whole process shares malloc, so what's used before the run (including the result buffers) doesn't count. Free memory left by earlier runs is trimmed.
+	MallocBackend()
+	{
+#ifdef RBMEM_BENCHMARK_MALLINFO
+		malloc_trim(0);
+		const struct mallinfo2 info = mallinfo2();
+		baseUsed = (long long)(info.uordblks + info.hblkhd);
+#endif
+	}
+
+	bool getUsage(long long& used, long long& footprint) const
+	{
+#ifdef RBMEM_BENCHMARK_MALLINFO
+		const struct mallinfo2 info = mallinfo2();
+		used = (long long)(info.uordblks + info.hblkhd) - baseUsed;
+		footprint = (long long)(info.arena + info.hblkhd) - baseUsed;
+		return true;
+#else
+		(void)used;
+		(void)footprint;
+		return false;
+#endif
+	}
+};
+
+class RBTBackend
+{
+private:
+	RBTMemoryAllocator allocator;
+public:
+	static constexpr const char* name = "rbt";
+	static constexpr bool isThreadSafe = false;
+
+	class Worker
+	{
+	private:
+		RBTMemoryAllocator& allocator;
+	public:
+		explicit Worker(RBTBackend& backend)
+			: allocator(backend.allocator)
+		{
+		}
+		void* allocate(const SizeType size)
+		{
+			return allocator.allocate(size);
+		}
+		void deallocate(void* ptr)
+		{
+			allocator.deallocate(ptr);
+		}
+	};
+
+	RBTBackend()
+		: allocator(RBTMemoryAllocator::getMappedRegionSource(), 8 * RBTMemoryAllocator::MegaByte)
+	{
+	}
+
+	bool getUsage(long long& used, long long& footprint) const
+	{
+		used = allocator.getUsedMemory();
+		footprint = allocator.getTotalMemory();
+		return true;
+	}
+
+	RBTMemoryAllocator& getAllocator()
+	{
+		return allocator;
+	}
+};
+
+class RBTShardedBackend
+{
+private:
+	RBTShardedMemoryAllocator allocator;
+public:
+	static constexpr const char* name = "rbt-sharded";
+	static constexpr bool isThreadSafe = true;
+
+	class Worker
+	{
+	private:
+		RBTShardedMemoryAllocator& allocator;
+	public:
+		explicit Worker(RBTShardedBackend& backend)
+			: allocator(backend.allocator)
+		{
+		}
+		void* allocate(const SizeType size)
+		{
+			return allocator.allocate(size);
+		}
+		void deallocate(void* ptr)
+		{
+			allocator.deallocate(ptr);
+		}
+	};
+
+	// Arenas don't grow, so each one gets plenty. Untouched pages cost nothing.
+	RBTShardedBackend()
+		: allocator(64 * RBTMemoryAllocator::MegaByte * std::max(1u, std::thread::hardware_concurrency()))
+	{
+	}
+
+	bool getUsage(long long&, long long&) const
+	{
+		return false;
+	}
+};
+
+class RBTThreadCacheBackend
+{
+private:
+	RBTMemoryAllocator allocator;
+public:
+	static constexpr const char* name = "rbt-threadcache";
+	static constexpr bool isThreadSafe = true;
+
+	class Worker
+	{
+	private:
+		RBTMemoryAllocator::ThreadCache cache;
+	public:
+		explicit Worker(RBTThreadCacheBackend& backend)
+			: cache(backend.allocator)
+		{
+		}
+		void* allocate(const SizeType size)
+		{
+			return cache.allocate(size);
+		}
+		void deallocate(void* ptr)
+		{
+			cache.deallocate(ptr);
+		}
+	};
+
+	RBTThreadCacheBackend()
+		: allocator(RBTMemoryAllocator::getMappedRegionSource(), 8 * RBTMemoryAllocator::MegaByte)
+	{
+	}
+
+	bool getUsage(long long&, long long&) const
+	{
+		return false;
+	}
+};
+
+// Measures one operation, but only every latencySamplingPeriod-th one, so the clock doesn't dominate.
+class Sampler
+{
+private:
+	Result& result;
+	unsigned long long counter = 0;
+	Clock::time_point start;
+public:
+	explicit Sampler(Result& resultToFill)
+		: result(resultToFill)
+	{
+	}
+	inline void begin()
+	{
+		if (counter % latencySamplingPeriod == 0)
+		{
+			start = Clock::now();
+		}
+	}
+	inline void end()
+	{
+		if (counter++ % latencySamplingPeriod == 0)
+		{
+			result.latencies.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+		}
+	}
+};
+
+template<class Backend>
+static void sampleUsage(const Backend& backend, Result& result)
+{
+	long long used, footprint;
+	if (backend.getUsage(used, footprint) && used > result.peakUsed)
+	{
+		result.peakUsed = used;
+		result.footprintAtPeak = footprint;
+	}
+}
+
+static SizeType getRandomSize(std::mt19937_64& random, const SizeType minSize, const SizeType maxSize)
+{
+	// Log-uniform, small sizes dominate like in real programs.
+	std::uniform_real_distribution<double> distribution(std::log((double)minSize), std::log((double)maxSize + 1));
+	return std::min(maxSize, (SizeType)std::exp(distribution(random)));
+}
+
+// Workloads.
+template<class Backend>
+static Result runFixedSize(const Options& options, const SizeType size)
+{
+	Result result;
+	result.workload = "fixed-" + std::to_string(size);
+	result.allocator = Backend::name;
+
+	const unsigned int batch = 1000, rounds = (unsigned int)(2000 * options.scale) + 1;
+	std::vector<void*> ptrs(batch);
+	result.latencies.reserve(2 * batch * rounds / latencySamplingPeriod + 1);
+	Sampler sampler(result);
+
+	Backend backend;
+	typename Backend::Worker worker(backend);
+
+	const Clock::time_point start = Clock::now();
+	for (unsigned int round = 0; round < rounds; ++round)
+	{
+		for (unsigned int i = 0; i < batch; ++i)
+		{
+			sampler.begin();
+			ptrs[i] = worker.allocate(size);
+			sampler.end();
+			result.failed += ptrs[i] ? 0 : 1;
+		}
+		if (round == 0)
+		{
+			sampleUsage(backend, result);
+		}
+		for (unsigned int i = 0; i < batch; ++i)
+		{
+			sampler.begin();
+			worker.deallocate(ptrs[i]);
+			sampler.end();
+		}
+	}
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	result.operations = 2ull * batch * rounds;
+
+	return result;
+}
+
+template<class Backend>
+static Result runRandomSize(const Options& options)
+{
+	Result result;
+	result.workload = "random";
+	result.allocator = Backend::name;
+
+	std::mt19937_64 random(options.seed);
+	const unsigned long long steps = (unsigned long long)(2000000 * options.scale) + 1;
+	const size_t targetLive = 10000;
+	std::vector<void*> live;
+	live.reserve(2 * targetLive);
+	result.latencies.reserve(steps / latencySamplingPeriod + 1);
+	Sampler sampler(result);
+
+	Backend backend;
+	typename Backend::Worker worker(backend);
+
+	const Clock::time_point start = Clock::now();
+	for (unsigned long long step = 0; step < steps; ++step)
+	{
+		// Hovers around targetLive objects, replacing random ones.
+		if (live.size() < targetLive / 2 || (live.size() < 2 * targetLive && random() % 2 == 0))
+		{
+			const SizeType size = getRandomSize(random, 8, 32 * 1024);
+			sampler.begin();
+			void* const ptr = worker.allocate(size);
+			sampler.end();
+			if (ptr)
+			{
+				*(char*)ptr = 1;
+				live.push_back(ptr);
+			}
+			else
+			{
+				++result.failed;
+			}
+		}
+		else
+		{
+			const size_t index = random() % live.size();
+			sampler.begin();
+			worker.deallocate(live[index]);
+			sampler.end();
+			live[index] = live.back();
+			live.pop_back();
+		}
+		if (step % usageSamplingPeriod == 0)
+		{
+			sampleUsage(backend, result);
+		}
+	}
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	result.operations = steps;
+
+	for (void* ptr : live)
+	{
+		worker.deallocate(ptr);
+	}
+
+	return result;
+}
+
+template<class Backend>
+static Result runProducerConsumer(const Options& options)
+{
+	Backend backend;
+	Result result;
+	result.workload = "producer-consumer";
+	result.allocator = Backend::name;
+	result.threads = 2;
+
+	// Single producer, single consumer ring. Every block is freed by the other thread.
+	static constexpr size_t ringSize = 4096;
+	std::vector<std::atomic<void*>> ring(ringSize);
+	for (auto& slot : ring)
+	{
+		slot.store(nullptr, std::memory_order_relaxed);
+	}
+	const unsigned long long count = (unsigned long long)(1000000 * options.scale) + 1;
+	std::atomic<unsigned long long> failed(0);
+	Result consumerResult;
+	result.latencies.reserve(count / latencySamplingPeriod + 1);
+	consumerResult.latencies.reserve(count / latencySamplingPeriod + 1);
+
+	const Clock::time_point start = Clock::now();
+	std::thread consumer([&]()
+	{
+		typename Backend::Worker worker(backend);
+		Sampler sampler(consumerResult);
+		for (unsigned long long i = 0; i < count; ++i)
+		{
+			std::atomic<void*>& slot = ring[i % ringSize];
+			void* ptr;
+			while ((ptr = slot.load(std::memory_order_acquire)) == nullptr)
+			{
+				std::this_thread::yield();
+			}
+			slot.store(nullptr, std::memory_order_release);
+			if (ptr != (void*)&ring)
+			{
+				sampler.begin();
+				worker.deallocate(ptr);
+				sampler.end();
+			}
+		}
+	});
+
+	{
+		typename Backend::Worker worker(backend);
+		Sampler sampler(result);
+		std::mt19937_64 random(options.seed);
+		for (unsigned long long i = 0; i < count; ++i)
+		{
+			const SizeType size = getRandomSize(random, 16, 1024);
+			sampler.begin();
+			void* ptr = worker.allocate(size);
+			sampler.end();
+			if (ptr)
+			{
+				*(char*)ptr = 1;
+			}
+			else
+			{
+				failed.fetch_add(1, std::memory_order_relaxed);
+				ptr = (void*)&ring; // Marks a failed allocation, the consumer still has to advance.
+			}
+
+			std::atomic<void*>& slot = ring[i % ringSize];
+			while (slot.load(std::memory_order_acquire) != nullptr)
+			{
+				std::this_thread::yield();
+			}
+			slot.store(ptr, std::memory_order_release);
+		}
+		consumer.join();
+	}
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	result.operations = 2 * count;
+	result.failed = failed.load();
+	result.latencies.insert(result.latencies.end(), consumerResult.latencies.begin(), consumerResult.latencies.end());
+
+	return result;
+}
+
+template<class CharAllocator>
+static void churnContainers(const CharAllocator& allocator, std::mt19937_64& random)
+{
+	using Traits = std::allocator_traits<CharAllocator>;
+	using StringType = std::basic_string<char, std::char_traits<char>, CharAllocator>;
+	using MapType = std::map<int, StringType, std::less<int>, typename Traits::template rebind_alloc<std::pair<const int, StringType>>>;
+	using VectorType = std::vector<int, typename Traits::template rebind_alloc<int>>;
+	using ListType = std::list<StringType, typename Traits::template rebind_alloc<StringType>>;
+
+	MapType map(std::less<int>(), allocator);
+	VectorType vector(allocator);
+	ListType list(allocator);
+
+	for (int i = 0; i < 500; ++i)
+	{
+		map.emplace((int)(random() % 10000), StringType(32 + random() % 64, 'x', allocator));
+		vector.push_back(i);
+		list.emplace_back(StringType(16 + random() % 128, 'y', allocator));
+		if (i % 3 == 0 && !list.empty())
+		{
+			list.pop_front();
+		}
+	}
+}
+
+static std::allocator<char> makeCharAllocator(MallocBackend&)
+{
+	return std::allocator<char>();
+}
+
+static StdAllocator<char> makeCharAllocator(RBTBackend& backend)
+{
+	return StdAllocator<char>(backend.getAllocator());
+}
+
+template<class Backend>
+static Result runContainers(const Options& options)
+{
+	Backend backend;
+	Result result;
+	result.workload = "containers";
+	result.allocator = Backend::name;
+
+	std::mt19937_64 random(options.seed);
+	const unsigned int cycles = (unsigned int)(2000 * options.scale) + 1;
+	result.latencies.reserve(cycles);
+
+	// Latencies are per cycle here: build all the containers, then tear them down.
+	const Clock::time_point start = Clock::now();
+	for (unsigned int cycle = 0; cycle < cycles; ++cycle)
+	{
+		const Clock::time_point cycleStart = Clock::now();
+		churnContainers(makeCharAllocator(backend), random);
+		result.latencies.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - cycleStart).count());
+	}
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	result.operations = cycles;
+
+	return result;
+}
+
+template<class Backend>
+static Result runScaling(const Options& options, const unsigned int threadsCount)
+{
+	Backend backend;
+	Result result;
+	result.workload = "scaling";
+	result.allocator = Backend::name;
+	result.threads = threadsCount;
+
+	const unsigned long long steps = (unsigned long long)(1000000 * options.scale) + 1;
+	std::vector<Result> partial(threadsCount);
+	std::vector<std::thread> threads;
+	std::atomic<unsigned int> ready(0);
+
+	const Clock::time_point start = Clock::now();
+	for (unsigned int t = 0; t < threadsCount; ++t)
+	{
+		threads.emplace_back([&, t]()
+		{
+			typename Backend::Worker worker(backend);
+			std::mt19937_64 random(options.seed + t);
+			std::vector<void*> live(1000, nullptr);
+			Result& mine = partial[t];
+			mine.latencies.reserve(2 * steps / latencySamplingPeriod + 1);
+			Sampler sampler(mine);
+
+			ready.fetch_add(1);
+			while (ready.load() < threadsCount)
+			{
+				std::this_thread::yield();
+			}
+
+			// Every step replaces one random slot of the thread's live set.
+			for (unsigned long long step = 0; step < steps; ++step)
+			{
+				void*& slot = live[random() % live.size()];
+				if (slot)
+				{
+					sampler.begin();
+					worker.deallocate(slot);
+					sampler.end();
+				}
+				sampler.begin();
+				slot = worker.allocate(getRandomSize(random, 8, 512));
+				sampler.end();
+				mine.failed += slot ? 0 : 1;
+			}
+			for (void* ptr : live)
+			{
+				if (ptr)
+				{
+					worker.deallocate(ptr);
+				}
+			}
+		});
+	}
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	result.operations = 2 * steps * threadsCount;
+
+	for (const Result& mine : partial)
+	{
+		result.failed += mine.failed;
+		result.latencies.insert(result.latencies.end(), mine.latencies.begin(), mine.latencies.end());
+	}
+
+	return result;
+}
+
+template<class Backend>
+static void runSingleThreaded(const Options& options, const std::string& workload)
+{
+	if (workload == "fixed")
+	{
+		for (SizeType size : { (SizeType)64, (SizeType)1024 })
+		{
+			Result result = runFixedSize<Backend>(options, size);
+			printResult(result);
+		}
+	}
+	else
+		if (workload == "random")
+		{
+			Result result = runRandomSize<Backend>(options);
+			printResult(result);
+		}
+}
+
+template<class Backend>
+static void runMultiThreaded(const Options& options, const std::string& workload)
+{
+	static_assert(Backend::isThreadSafe, "Only thread-safe allocators can run multithreaded workloads.");
+
+	if (workload == "producer-consumer")
+	{
+		Result result = runProducerConsumer<Backend>(options);
+		printResult(result);
+	}
+	else
+		if (workload == "scaling")
+		{
+			const unsigned int maxThreads = options.maxThreads ? options.maxThreads : std::max(1u, std::thread::hardware_concurrency());
+			for (unsigned int threads = 1; ; threads *= 2)
+			{
+				threads = std::min(threads, maxThreads);
+				Result result = runScaling<Backend>(options, threads);
+				printResult(result);
+				if (threads == maxThreads)
+				{
+					break;
+				}
+			}
+		}
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string argument = argv[i];
+		if (i + 1 < argc && argument == "--seed")
+		{
+			options.seed = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else
+			if (i + 1 < argc && argument == "--scale")
+			{
+				options.scale = std::atof(argv[++i]);
+			}
+			else
+				if (i + 1 < argc && argument == "--threads")
+				{
+					options.maxThreads = (unsigned int)std::atoi(argv[++i]);
+				}
+				else
+					if (i + 1 < argc && argument == "--workload")
+					{
+						options.workload = argv[++i];
+					}
+					else
+					{
+						std::cerr << "Usage: " << argv[0] << " [--seed n] [--scale factor] [--threads max] [--workload fixed|random|containers|producer-consumer|scaling]" << std::endl;
+						return 1;
+					}
+	}
+
+	auto isSelected = [&options](const char* workload)
+	{
+		return options.workload.empty() || options.workload == workload;
+	};
+
+	for (const char* workload : { "fixed", "random" })
+	{
+		if (isSelected(workload))
+		{
+			runSingleThreaded<MallocBackend>(options, workload);
+			runSingleThreaded<RBTBackend>(options, workload);
+		}
+	}
+	if (isSelected("containers"))
+	{
+		Result result = runContainers<MallocBackend>(options);
+		printResult(result);
+		result = runContainers<RBTBackend>(options);
+		printResult(result);
+	}
+	for (const char* workload : { "producer-consumer", "scaling" })
+	{
+		if (isSelected(workload))
+		{
+			runMultiThreaded<MallocBackend>(options, workload);
+			runMultiThreaded<RBTShardedBackend>(options, workload);
+			runMultiThreaded<RBTThreadCacheBackend>(options, workload);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,395 @@
+// Replays a trace written by RBTMemoryAllocator::TraceRecorder against an allocator configuration and prints one JSON object
+// with the time spent, the peak usage and the number of failed allocations. Layout options (RBMEM_BOUNDARY_TAGS, RBMEM_COMPACT_LINKS)
+// are chosen at compile time, the rest on the command line. See the Benchmarks section of README.md.
+#include "RBTMemoryAllocator.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define RBMEM_REPLAY_MALLINFO
+#endif
+
+using Clock = std::chrono::steady_clock;
+using SizeType = RBTMemoryAllocator::SizeType;
+using TraceRecorder = RBTMemoryAllocator::TraceRecorder;
+
+struct Options
+{
+	std::string path;
+	std::string allocator = "rbt";
+	std::string index = RBTMemoryAllocator::defaultFreeIndex == RBTMemoryAllocator::FreeIndex::Tlsf ? "tlsf" : "rbtree";
+	SizeType regionSize = 8 * RBTMemoryAllocator::MegaByte;
+	bool isMapped = false;
+	bool isHuge = false, prefault = false;
+	SizeType purgeThreshold = 0;
+	unsigned int deferredFrees = 0;
+};
+
+struct Result
+{
+	unsigned long long operations = 0, failed = 0, unknownFrees = 0;
+	double seconds = 0;
+	long long peakRequested = 0, peakUsed = -1, peakFootprint = -1; // -1 if the allocator can't tell.
+};
+
+static constexpr unsigned int usageSamplingPeriod = 4096;
+
+// Allocators. usage is cheap for RBTMemoryAllocator, so it's checked after every operation; malloc is only sampled.
+class MallocBackend
+{
+private:
+	long long baseUsed = 0;
+public:
+	static constexpr bool isUsageCheap = false;
+
+	MallocBackend(const Options&)
+	{
+#ifdef RBMEM_REPLAY_MALLINFO
+		malloc_trim(0);
+		const struct mallinfo2 info = mallinfo2();
+		baseUsed = (long long)(info.uordblks + info.hblkhd);
+#endif
+	}
+
+#ifdef _WIN32
+	void* allocate(const SizeType size, const SizeType alignment)
+	{
+		return _aligned_malloc(size, alignment);
+	}
+	void deallocate(void* ptr)
+	{
+		_aligned_free(ptr);
+	}
+	void* reallocate(void* ptr, const SizeType size, const SizeType alignment)
+	{
+		return _aligned_realloc(ptr, size, alignment);
+	}
+#else
+	void* allocate(const SizeType size, const SizeType alignment)
+	{
+		if (alignment <= alignof(std::max_align_t))
+		{
+			return std::malloc(size);
+		}
+		void* result = nullptr;
+		return posix_memalign(&result, alignment, size) == 0 ? result : nullptr;
+	}
+	void deallocate(void* ptr)
+	{
+		std::free(ptr);
+	}
+	void* reallocate(void* ptr, const SizeType size, const SizeType)
+	{
+		return std::realloc(ptr, size); // Keeps only the default alignment, there's no aligned realloc.
+	}
+#endif
+
+	bool getUsage(long long& used, long long& footprint) const
+	{
+#ifdef RBMEM_REPLAY_MALLINFO
+		const struct mallinfo2 info = mallinfo2();
+		used = (long long)(info.uordblks + info.hblkhd) - baseUsed;
+		footprint = (long long)(info.arena + info.hblkhd) - baseUsed;
+		return true;
+#else
+		(void)used;
+		(void)footprint;
+		return false;
+#endif
+	}
+};
+
+// The free block index is part of the allocator's type, so each one has its own configuration.
+template<RBTMemoryAllocator::FreeIndex index>
+struct RBTReplayConfig
+	: public RBTMemoryAllocatorConfig
+{
+	static constexpr RBTMemoryAllocator::FreeIndex freeIndex = index;
+};
+
+template<RBTMemoryAllocator::FreeIndex index>
+class RBTBackend
+{
+private:
+	BasicRBTMemoryAllocator<RBTReplayConfig<index>> allocator;
+public:
+	static constexpr bool isUsageCheap = true;
+
+	RBTBackend(const Options& options)
+		: allocator(options.isHuge ? RBTMemoryAllocator::getHugePageRegionSource(options.prefault)
+			: options.isMapped ? RBTMemoryAllocator::getMappedRegionSource() : RBTMemoryAllocator::getDefaultRegionSource(), options.regionSize)
+	{
+		allocator.setPurgeThreshold(options.purgeThreshold);
+		allocator.setDeferredFreesCapacity(options.deferredFrees);
+	}
+
+	void* allocate(const SizeType size, const SizeType alignment)
+	{
+		return allocator.allocate(size, alignment);
+	}
+	void deallocate(void* ptr)
+	{
+		allocator.deallocate(ptr);
+	}
+	void* reallocate(void* ptr, const SizeType size, const SizeType alignment)
+	{
+		return allocator.reallocate(ptr, size, alignment);
+	}
+
+	bool getUsage(long long& used, long long& footprint) const
+	{
+		used = allocator.getUsedMemory();
+		footprint = allocator.getTotalMemory();
+		return true;
+	}
+};
+
+static bool loadTrace(const std::string& path, std::vector<TraceRecorder::Record>& records)
+{
+	std::FILE* input = std::fopen(path.c_str(), "rb");
+	if (!input)
+	{
+		return false;
+	}
+	if (!TraceRecorder::readHeader(input))
+	{
+		std::fclose(input);
+		return false;
+	}
+
+	TraceRecorder::Record chunk[TraceRecorder::bufferedRecords];
+	size_t count;
+	while ((count = std::fread(chunk, sizeof(TraceRecorder::Record), TraceRecorder::bufferedRecords, input)) > 0)
+	{
+		records.insert(records.end(), chunk, chunk + count);
+	}
+	std::fclose(input);
+	return true;
+}
+
+// Trace objects are mapped to the blocks the replayed allocator returned for them. An allocation that fails here (or failed when
+// recorded) has no block, so its deallocation is skipped. Allocations that failed when recorded are attempted again and freed at once,
+// since the trace never frees them. The first byte of every block is written, like a program would.
+template<class Backend>
+static Result replay(const Options& options, const std::vector<TraceRecorder::Record>& records)
+{
+	Result result;
+	std::unordered_map<uint64_t, std::pair<void*, SizeType>> live; // Block and requested size.
+	live.reserve(records.size() / 2 + 1);
+	long long requested = 0;
+
+	Backend backend(options);
+	auto sampleUsage = [&backend, &result]()
+	{
+		long long used, footprint;
+		if (backend.getUsage(used, footprint))
+		{
+			result.peakUsed = used > result.peakUsed ? used : result.peakUsed;
+			result.peakFootprint = footprint > result.peakFootprint ? footprint : result.peakFootprint;
+		}
+	};
+
+	const Clock::time_point start = Clock::now();
+	for (const TraceRecorder::Record& record : records)
+	{
+		++result.operations;
+		switch (record.operation)
+		{
+		case TraceRecorder::Operation::Allocate:
+		{
+			void* const ptr = backend.allocate((SizeType)record.size, record.alignment);
+			if (!ptr)
+			{
+				++result.failed;
+			}
+			else
+				if (!record.object)
+				{
+					backend.deallocate(ptr);
+				}
+				else
+				{
+					*(char*)ptr = 0;
+					live[record.object] = std::make_pair(ptr, (SizeType)record.size);
+					requested += (long long)record.size;
+				}
+			break;
+		}
+		case TraceRecorder::Operation::Deallocate:
+		{
+			auto it = live.find(record.object);
+			if (it == live.end())
+			{
+				++result.unknownFrees;
+				break;
+			}
+			backend.deallocate(it->second.first);
+			requested -= (long long)it->second.second;
+			live.erase(it);
+			break;
+		}
+		case TraceRecorder::Operation::Reallocate:
+		{
+			void* oldPtr = nullptr;
+			SizeType oldSize = 0;
+			auto it = live.find(record.previous);
+			if (it != live.end())
+			{
+				oldPtr = it->second.first;
+				oldSize = it->second.second;
+			}
+			else
+				if (record.previous)
+				{
+					++result.unknownFrees;
+				}
+
+			if (!record.object && record.size != 0)
+			{
+				// Failed when recorded, so the old block stays where it was.
+				break;
+			}
+
+			void* const ptr = backend.reallocate(oldPtr, (SizeType)record.size, record.alignment);
+			if (!ptr && record.size != 0)
+			{
+				// The old block is still valid, keep using it under the new id.
+				++result.failed;
+				if (it != live.end())
+				{
+					live.erase(it);
+					live[record.object] = std::make_pair(oldPtr, oldSize);
+				}
+				break;
+			}
+
+			if (it != live.end())
+			{
+				live.erase(it);
+				requested -= (long long)oldSize;
+			}
+			if (ptr)
+			{
+				*(char*)ptr = 0;
+				live[record.object] = std::make_pair(ptr, (SizeType)record.size);
+				requested += (long long)record.size;
+			}
+			break;
+		}
+		}
+
+		result.peakRequested = requested > result.peakRequested ? requested : result.peakRequested;
+		if (Backend::isUsageCheap || result.operations % usageSamplingPeriod == 0)
+		{
+			sampleUsage();
+		}
+	}
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	sampleUsage();
+
+	// Blocks the trace never freed.
+	for (auto& entry : live)
+	{
+		backend.deallocate(entry.second.first);
+	}
+
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string argument = argv[i];
+		if (i + 1 < argc && argument == "--allocator")
+		{
+			options.allocator = argv[++i];
+		}
+		else
+			if (i + 1 < argc && argument == "--index")
+			{
+				options.index = argv[++i];
+			}
+			else
+				if (i + 1 < argc && argument == "--region-size")
+				{
+					options.regionSize = (SizeType)std::strtoull(argv[++i], nullptr, 10);
+				}
+				else
+					if (argument == "--mapped")
+					{
+						options.isMapped = true;
+					}
+					else
+						if (argument == "--huge-pages")
+						{
+							options.isHuge = true;
+						}
+						else
+							if (argument == "--prefault")
+							{
+								options.prefault = true;
+							}
+							else
+								if (i + 1 < argc && argument == "--purge-threshold")
+								{
+									options.purgeThreshold = (SizeType)std::strtoull(argv[++i], nullptr, 10);
+								}
+								else
+									if (i + 1 < argc && argument == "--deferred-frees")
+									{
+										options.deferredFrees = (unsigned int)std::atoi(argv[++i]);
+									}
+									else
+										if (options.path.empty() && argument[0] != '-')
+										{
+											options.path = argument;
+										}
+										else
+										{
+											options.path.clear();
+											break;
+										}
+	}
+	if (options.path.empty() || (options.allocator != "rbt" && options.allocator != "malloc") || (options.index != "rbtree" && options.index != "tlsf"))
+	{
+		std::cerr << "Usage: " << argv[0] << " trace [--allocator rbt|malloc] [--index rbtree|tlsf] [--region-size bytes] [--mapped | --huge-pages [--prefault]] [--purge-threshold bytes] [--deferred-frees n]" << std::endl;
+		return 1;
+	}
+
+	std::vector<TraceRecorder::Record> records;
+	if (!loadTrace(options.path, records))
+	{
+		std::cerr << "Can't read the trace " << options.path << std::endl;
+		return 1;
+	}
+
+	const Result result = options.allocator == "malloc" ? replay<MallocBackend>(options, records)
+		: options.index == "tlsf" ? replay<RBTBackend<RBTMemoryAllocator::FreeIndex::Tlsf>>(options, records) : replay<RBTBackend<RBTMemoryAllocator::FreeIndex::RedBlackTree>>(options, records);
+
+	std::cout << "{\"trace\":\"" << options.path << "\",\"allocator\":\"" << options.allocator << "\",\"index\":" << (options.allocator == "rbt" ? "\"" + options.index + "\"" : std::string("null")) << ",\"operations\":" << result.operations
+		<< ",\"failed\":" << result.failed << ",\"unknownFrees\":" << result.unknownFrees << ",\"seconds\":" << result.seconds
+		<< ",\"peakRequestedBytes\":" << result.peakRequested;
+	if (result.peakUsed >= 0)
+	{
+		std::cout << ",\"peakUsedBytes\":" << result.peakUsed << ",\"peakFootprintBytes\":" << result.peakFootprint;
+	}
+	else
+	{
+		std::cout << ",\"peakUsedBytes\":null,\"peakFootprintBytes\":null";
+	}
+	std::cout << "}" << std::endl;
+
+	return 0;
+}
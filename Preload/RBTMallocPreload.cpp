@@ -0,0 +1,261 @@
+// Replaces malloc and the related C functions with RBTMemoryAllocator::getProcessHeap(), so existing binaries can run on it
+// through LD_PRELOAD without being rebuilt. See the Replacing malloc section of README.md for how to build and use it.
+// Small unaligned requests go through a per-thread cache, like in RBTOperatorNew.cpp. Everything else locks the heap's mutex, which is
+// also held across fork, so the child gets it unlocked and consistent. Only getProcessHeap() is used, so RBTMemoryAllocator::instance
+// is never instantiated and the library reserves no memory until the first call.
+#include "RBTMemoryAllocator.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+
+using SizeType = RBTMemoryAllocator::SizeType;
+
+static inline bool isPowerOfTwo(const SizeType value)
+{
+	return value != 0 && (value & (value - 1)) == 0;
+}
+
+// The cache is destroyed before the thread's remaining destructors run, and these may still free, so after that everything goes to the heap.
+static thread_local bool isCacheDestroyed = false;
+
+struct LocalCache
+{
+	RBTMemoryAllocator::ThreadCache cache{RBTMemoryAllocator::getProcessHeap()};
+
+	~LocalCache()
+	{
+		isCacheDestroyed = true; // The cache flushes right after.
+	}
+};
+
+static RBTMemoryAllocator::ThreadCache* getLocalCache()
+{
+	if (isCacheDestroyed)
+	{
+		return nullptr;
+	}
+	static thread_local LocalCache local;
+	return &local.cache;
+}
+
+static void* allocateFromHeap(const SizeType size, const SizeType alignment)
+{
+	const SizeType usedSize = size > 0 ? size : 1;
+	RBTMemoryAllocator::ThreadCache* cache = alignment <= RBTMemoryAllocator::usedAlignment ? getLocalCache() : nullptr;
+	void* result;
+	if (cache)
+	{
+		result = cache->allocate(usedSize); // Takes the heap's lock itself for anything it doesn't cache.
+	}
+	else
+	{
+		RBTMemoryAllocator& heap = RBTMemoryAllocator::getProcessHeap();
+		std::lock_guard<std::mutex> lock(heap.getMutex());
+		result = heap.allocate(usedSize, alignment > RBTMemoryAllocator::usedAlignment ? alignment : RBTMemoryAllocator::usedAlignment);
+	}
+	if (!result)
+	{
+		errno = ENOMEM;
+	}
+	return result;
+}
+
+static void deallocateToHeap(void* ptr)
+{
+	RBTMemoryAllocator::ThreadCache* cache = getLocalCache();
+	if (cache)
+	{
+		cache->deallocate(ptr);
+		return;
+	}
+
+	RBTMemoryAllocator& heap = RBTMemoryAllocator::getProcessHeap();
+	std::lock_guard<std::mutex> lock(heap.getMutex());
+	heap.deallocate(ptr);
+}
+
+// Memory handed out before the library was in place is resized by the allocator it displaced, since only that one knows its size.
+static void* reallocateForeign(void* ptr, const size_t size)
+{
+	using Realloc = void* (*)(void*, size_t);
+	static const Realloc nextRealloc = (Realloc)dlsym(RTLD_NEXT, "realloc");
+	if (!nextRealloc)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+	return nextRealloc(ptr, size);
+}
+
+static void freeForeign(void* ptr)
+{
+	using Free = void (*)(void*);
+	static const Free nextFree = (Free)dlsym(RTLD_NEXT, "free");
+	if (nextFree)
+	{
+		nextFree(ptr);
+	}
+}
+
+static void lockBeforeFork()
+{
+	RBTMemoryAllocator::getProcessHeap().getMutex().lock();
+}
+
+static void unlockAfterFork()
+{
+	RBTMemoryAllocator::getProcessHeap().getMutex().unlock();
+}
+
+// Registered when the library is loaded. Allocations made before that don't need it, the heap is set up on first use.
+static const int forkHandlersRegistered = pthread_atfork(lockBeforeFork, unlockAfterFork, unlockAfterFork);
+
+extern "C"
+{
+	void* malloc(size_t size) noexcept
+	{
+		return allocateFromHeap(size, RBTMemoryAllocator::usedAlignment);
+	}
+
+	void free(void* ptr) noexcept
+	{
+		if (!ptr)
+		{
+			return;
+		}
+
+		// Memory allocated before the library was in place goes back to the allocator it came from.
+		if (!RBTMemoryAllocator::getProcessHeap().isPointerInMemoryRange(ptr))
+		{
+			freeForeign(ptr);
+			return;
+		}
+
+		deallocateToHeap(ptr);
+	}
+
+	void* calloc(size_t count, size_t size) noexcept
+	{
+		if (size != 0 && count > ((size_t)-1) / size)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+
+		void* result = allocateFromHeap(count * size, RBTMemoryAllocator::usedAlignment);
+		if (result)
+		{
+			std::memset(result, 0, count * size);
+		}
+		return result;
+	}
+
+	void* realloc(void* ptr, size_t size) noexcept
+	{
+		if (!ptr)
+		{
+			return allocateFromHeap(size, RBTMemoryAllocator::usedAlignment);
+		}
+
+		RBTMemoryAllocator& heap = RBTMemoryAllocator::getProcessHeap();
+		if (!heap.isPointerInMemoryRange(ptr))
+		{
+			return reallocateForeign(ptr, size);
+		}
+
+		void* result;
+		{
+			std::lock_guard<std::mutex> lock(heap.getMutex());
+			result = heap.reallocate(ptr, size); // Frees ptr and returns nullptr for 0, like glibc.
+		}
+		if (!result && size != 0)
+		{
+			errno = ENOMEM;
+		}
+		return result;
+	}
+
+	void* reallocarray(void* ptr, size_t count, size_t size) noexcept
+	{
+		if (size != 0 && count > ((size_t)-1) / size)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+		return realloc(ptr, count * size);
+	}
+
+	int posix_memalign(void** output, size_t alignment, size_t size) noexcept
+	{
+		if (!isPowerOfTwo(alignment) || alignment % sizeof(void*) != 0)
+		{
+			return EINVAL;
+		}
+
+		void* result = allocateFromHeap(size, alignment);
+		if (!result)
+		{
+			return ENOMEM;
+		}
+		*output = result;
+		return 0;
+	}
+
+	void* aligned_alloc(size_t alignment, size_t size) noexcept
+	{
+		if (!isPowerOfTwo(alignment))
+		{
+			errno = EINVAL;
+			return nullptr;
+		}
+		return allocateFromHeap(size, alignment);
+	}
+
+	void* memalign(size_t alignment, size_t size) noexcept
+	{
+		// glibc rounds other alignments up to a power of two, and refuses those past the highest one.
+		if (alignment > ((SizeType)-1) / 2 + 1)
+		{
+			errno = EINVAL;
+			return nullptr;
+		}
+		SizeType powerOfTwo = 1;
+		while (powerOfTwo < alignment)
+		{
+			powerOfTwo *= 2;
+		}
+		return allocateFromHeap(size, powerOfTwo);
+	}
+
+	void* valloc(size_t size) noexcept
+	{
+		return allocateFromHeap(size, RBTMemoryAllocator::getPageSize());
+	}
+
+	void* pvalloc(size_t size) noexcept
+	{
+		const SizeType pageSize = RBTMemoryAllocator::getPageSize();
+		if (size > ((SizeType)-1) - pageSize)
+		{
+			errno = ENOMEM;
+			return nullptr;
+		}
+		return allocateFromHeap((size + pageSize - 1) & ~(pageSize - 1), pageSize);
+	}
+
+	size_t malloc_usable_size(void* ptr) noexcept
+	{
+		RBTMemoryAllocator& heap = RBTMemoryAllocator::getProcessHeap();
+		if (!ptr || !heap.isPointerInMemoryRange(ptr))
+		{
+			return 0;
+		}
+
+		std::lock_guard<std::mutex> lock(heap.getMutex());
+		return heap.getUsableSize(ptr);
+	}
+}
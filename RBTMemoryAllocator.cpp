@@ -1,985 +1,687 @@
 #include "RBTMemoryAllocator.h"
-#include <iostream>
+#include <cstdio>
+#include <cstring>
 #include <memory>
+#include <thread>
 
-using std::swap;
-
-RBTMemoryAllocator RBTMemoryAllocator::instance;
-
-template<class T, class Y>
-inline constexpr T* addPointers(T* const arg, const Y byHowMany)
-{
-	return (T*)(((uintptr_t)arg) + ((uintptr_t)byHowMany));
-}
-
-template<class T, class Y>
-inline constexpr T* subPointers(T* const arg, const Y byHowMany)
-{
-	return (T*)(((uintptr_t)arg) - ((uintptr_t)byHowMany));
-}
-
-RBTMemoryAllocator::SizeType RBTMemoryAllocator::getUsedMemory() const
-{
-	return usedMemory;
-}
-
-RBTMemoryAllocator::SizeType RBTMemoryAllocator::getTotalMemory() const
-{
-	return totalMemory;
-}
-
-unsigned int RBTMemoryAllocator::getAllocationsCount() const
-{
-	return allocations;
-}
-
-bool RBTMemoryAllocator::isPointerInMemoryRange(_In_ const void * ptr) const
-{
-	return (ptr > trueMemoryBegin) && (ptr < endOfMemory);
-}
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 
-unsigned int RBTMemoryAllocator::dbgCalcTreeNodesCount() const
+RBTMemoryAllocatorBase::RegionSource RBTMemoryAllocatorBase::getDefaultRegionSource()
 {
-	static Function<void(FreeHeader*, const Function<void(FreeHeader*)>&)> traverseBlock = [](FreeHeader* block, const Function<void(FreeHeader*)>& func)
+	RegionSource result;
+	result.acquire = [](SizeType size) -> void*
 	{
-		if (!block)
-		{
-			return;
-		}
-
-		traverseBlock(block->left, func);
-		func(block);
-		traverseBlock(block->right, func);
+		return operator new(size, std::nothrow);
 	};
-
-	unsigned int count = 0;
-
-	traverseBlock(freeMemory, [&count](FreeHeader*)
+	result.release = [](void* memory, SizeType)
 	{
-		++count;
-	});
-
-	return count;
+		operator delete(memory);
+	};
+	return result;
 }
 
-void RBTMemoryAllocator::dbgCheckSanity() const
+RBTMemoryAllocatorBase::RegionSource RBTMemoryAllocatorBase::getMappedRegionSource(_In_opt_ const bool lazyPurge)
 {
-	auto temp = dbgCheckFreeTreeSanity();
-	if (temp)
+	RegionSource result;
+#ifdef _WIN32
+	(void)lazyPurge;
+	result.acquire = [](SizeType size) -> void*
+	{
+		return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	};
+	result.release = [](void* memory, SizeType)
 	{
-		throw temp;
+		VirtualFree(memory, 0, MEM_RELEASE);
+	};
+	result.purge = [](void* memory, SizeType size)
+	{
+		VirtualAlloc(memory, size, MEM_RESET, PAGE_READWRITE);
+	};
+#else
+	result.acquire = [](SizeType size) -> void*
+	{
+		void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return memory == MAP_FAILED ? nullptr : memory;
+	};
+	result.release = [](void* memory, SizeType size)
+	{
+		munmap(memory, size);
+	};
+#ifdef MADV_FREE
+	if (lazyPurge)
+	{
+		result.purge = [](void* memory, SizeType size)
+		{
+			// Older kernels don't know MADV_FREE.
+			if (madvise(memory, size, MADV_FREE) != 0)
+			{
+				madvise(memory, size, MADV_DONTNEED);
+			}
+		};
+		return result;
 	}
+#else
+	(void)lazyPurge;
+#endif
+	result.purge = [](void* memory, SizeType size)
+	{
+		madvise(memory, size, MADV_DONTNEED);
+	};
+#endif
+	return result;
 }
 
-void RBTMemoryAllocator::removeFromRBTree(FreeHeader * block)
+#ifdef __linux__
+// Page size of the mapping containing memory, from /proc/self/smaps: hugetlbfs mappings have a bigger KernelPageSize,
+// transparent huge pages show up as AnonHugePages. 0 if it can't be read.
+static RBTMemoryAllocator::SizeType readMappingPageSize(void* memory)
 {
-	if (!block)
+	std::FILE* smaps = std::fopen("/proc/self/smaps", "r");
+	if (!smaps)
 	{
-		return;
+		return 0;
 	}
 
-	bool childRed = true, toRemoveRed = checkRedness(block->parent);
-	FreeHeader* replacement = nullptr, *replaceParent = nullptr;
-
-	if (block->left && block->right)
+	char line[256];
+	bool isInside = false;
+	unsigned long long kernelPageSize = 0, anonHugePages = 0;
+	while (std::fgets(line, sizeof(line), smaps))
 	{
-		// Two children.
-		FreeHeader* succ = block->right;
-
-		while (succ->left)
+		unsigned long long begin, end, value;
+		if (std::sscanf(line, "%llx-%llx ", &begin, &end) == 2) // A mapping's header, the fields that follow start with a name.
 		{
-			succ = succ->left;
-		}
-
-		FreeHeader* tempGarbage = nullptr;
-		FreeHeader*& toRemoveInParent = cleanAddress(block->parent) ? (((FreeHeader*)cleanAddress(block->parent))->left == block ? ((FreeHeader*)cleanAddress(block->parent))->left : ((FreeHeader*)cleanAddress(block->parent))->right) : tempGarbage;
-
-		if (succ == block->right)
-		{
-			succ->left = block->left;
-			block->left->parent = setRedness(succ, checkRedness(block->left->parent));
-			block->left = nullptr;
-
-			const bool tempRed = checkRedness(succ->parent);
-			succ->parent = block->parent;
-			toRemoveInParent = succ;
-			block->parent = setRedness(succ, tempRed);
-
-			block->right = succ->right;
-			succ->right = block;
-			if (block->right)
+			if (isInside)
 			{
-				block->right->parent = setRedness(block, checkRedness(block->right->parent));
+				break;
 			}
+			isInside = ((uintptr_t)memory) >= begin && ((uintptr_t)memory) < end;
 		}
 		else
-		{
-			FreeHeader*& succInParent = ((FreeHeader*)cleanAddress(succ->parent))->left == succ ? ((FreeHeader*)cleanAddress(succ->parent))->left : ((FreeHeader*)cleanAddress(succ->parent))->right;
-
-			block->left->parent = setRedness(succ, checkRedness(block->left->parent));
-			block->right->parent = setRedness(succ, checkRedness(block->right->parent));
-			if (succ->right)
+			if (isInside && std::sscanf(line, "KernelPageSize: %llu kB", &value) == 1)
 			{
-				succ->right->parent = setRedness(block, checkRedness(succ->right->parent));
+				kernelPageSize = value * 1024;
 			}
+			else
+				if (isInside && std::sscanf(line, "AnonHugePages: %llu kB", &value) == 1)
+				{
+					anonHugePages = value * 1024;
+				}
+	}
+	std::fclose(smaps);
 
-			swap(block->left, succ->left);
-			swap(block->right, succ->right);
-			swap(block->parent, succ->parent); // Also the reddness is swaped.
+	if (kernelPageSize > RBTMemoryAllocator::getPageSize())
+	{
+		return (RBTMemoryAllocator::SizeType)kernelPageSize;
+	}
+	return anonHugePages > 0 ? RBTMemoryAllocator::hugePageSize : (RBTMemoryAllocator::SizeType)kernelPageSize;
+}
+#endif
 
-			toRemoveInParent = succ;
-			succInParent = block;
+RBTMemoryAllocatorBase::RegionSource RBTMemoryAllocatorBase::getHugePageRegionSource(_In_opt_ const bool prefault)
+{
+#ifdef _WIN32
+	// Large pages need a privilege most processes don't have, so Windows gets regular pages.
+	(void)prefault;
+	return getMappedRegionSource();
+#else
+	RegionSource result;
+	result.acquire = [prefault](SizeType size) -> void*
+	{
+		// Whole huge pages only. The release rounds the same way.
+		size = (size + hugePageSize - 1) & ~(hugePageSize - 1);
+
+#ifdef MAP_HUGETLB
+		// Fails right away if the hugetlbfs pool can't reserve enough pages.
+		void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (prefault ? MAP_POPULATE : 0), -1, 0);
+		if (memory != MAP_FAILED)
+		{
+			return memory;
 		}
+#endif
 
-		if (block == freeMemory)
+		// Transparent huge pages need the range aligned to their size, so map more and cut the ends off.
+		char* const mapped = (char*)mmap(nullptr, size + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapped == (char*)MAP_FAILED)
 		{
-			freeMemory = succ;
+			return nullptr;
 		}
-
-		removeFromRBTree(block);
-		return;
-	}
-	else
-		if (block->left || block->right)
+		char* const aligned = (char*)((((uintptr_t)mapped) + hugePageSize - 1) & ~((uintptr_t)hugePageSize - 1));
+		if (aligned != mapped)
 		{
-			// One child.
-			FreeHeader* child = block->left ? block->left : block->right;
-			replacement = child;
-
-			if (block == freeMemory)
-			{
-				// No parent.
-				freeMemory = child;
-			}
-			else
-			{
-				FreeHeader*& toRemoveInParent = ((FreeHeader*)cleanAddress(block->parent))->left == block ? ((FreeHeader*)cleanAddress(block->parent))->left : ((FreeHeader*)cleanAddress(block->parent))->right;
-				toRemoveInParent = child;
-			}
-
-			child->parent = setRedness(block->parent, checkRedness(child->parent));
+			munmap(mapped, aligned - mapped);
 		}
-		else
+		munmap(aligned + size, mapped + hugePageSize - aligned);
+#ifdef MADV_HUGEPAGE
+		madvise(aligned, size, MADV_HUGEPAGE); // If it fails, the pages are simply regular ones.
+#endif
+		if (prefault)
 		{
-			// An orphan.
-			if (block == freeMemory)
-			{
-				freeMemory = nullptr;
-				return;
-			}
-			else
+			const SizeType pageSize = getPageSize();
+			for (SizeType offset = 0; offset < size; offset += pageSize)
 			{
-				FreeHeader*& toRemoveInParent = ((FreeHeader*)cleanAddress(block->parent))->left == block ? ((FreeHeader*)cleanAddress(block->parent))->left : ((FreeHeader*)cleanAddress(block->parent))->right;
-				toRemoveInParent = nullptr;
+				((volatile char*)aligned)[offset] = 0;
 			}
 		}
-
-	replaceParent = (FreeHeader*)cleanAddress(block->parent);
-	childRed = replacement ? checkRedness(replacement->parent) : false;
-
-	if (childRed || toRemoveRed)
+		return aligned;
+	};
+	result.release = [](void* memory, SizeType size)
 	{
-		if (replacement)
-		{
-			replacement->parent = setRedness(replacement->parent, false);
-		}
-	}
-	else
+		munmap(memory, (size + hugePageSize - 1) & ~(hugePageSize - 1));
+	};
+	result.purge = [](void* memory, SizeType size)
 	{
-		// Double black.
-		FreeHeader* doubleBlack = replacement, *dbParent = replaceParent, *sibling = doubleBlack, *tempGarbage = nullptr;
-
-		while (doubleBlack != freeMemory)
-		{
-			sibling = dbParent->left == doubleBlack ? dbParent->right : dbParent->left;
-
-			if (!getRed(sibling))
-			{
-				if (sibling && (getRed(sibling->left) || getRed(sibling->right)))
-				{
-					FreeHeader* redNode = getRed(sibling->left) ? sibling->left : sibling->right;
-					FreeHeader*& dbParentInParent = cleanAddress(dbParent->parent) ? (((FreeHeader*)cleanAddress(dbParent->parent))->left == dbParent ? ((FreeHeader*)cleanAddress(dbParent->parent))->left : ((FreeHeader*)cleanAddress(dbParent->parent))->right) : tempGarbage;
-
-					// https://www.geeksforgeeks.org/red-black-tree-set-3-delete-2/
-					if (dbParent->left == sibling)
-					{
-						if (sibling->left == redNode)
-						{
-							// Left left.
-							// Mirror of right right.
-							dbParent->left = sibling->right;
-							if (sibling->right)
-							{
-								sibling->right->parent = setRedness(dbParent, checkRedness(sibling->right->parent));
-							}
-							sibling->right = dbParent;
-							const bool tempRed = checkRedness(sibling->parent);
-							sibling->parent = dbParent->parent;
-							dbParent->parent = setRedness(sibling, tempRed);
-							dbParentInParent = sibling;
-							sibling->left->parent = setRedness(sibling, false);
-
-							if (sibling->parent == nullptr)
-							{
-								freeMemory = sibling;
-							}
-						}
-						else
-						{
-							// Left right.
-							// First rotation.
-							FreeHeader* thing = sibling->right;
-							sibling->right = thing->left;
-							if (sibling->right)
-							{
-								sibling->right->parent = setRedness(sibling, checkRedness(sibling->right->parent));
-							}
-							thing->left = sibling;
-							thing->parent = setRedness(dbParent, false);
-							(dbParent->left == sibling ? dbParent->left : dbParent->right) = thing;
-							sibling->parent = setRedness(thing, false);
-
-							// Second rotation.
-							thing->parent = dbParent->parent;
-							dbParentInParent = thing;
-							dbParent->parent = setRedness(thing, false);
-							dbParent->left = thing->right;
-							if (dbParent->left)
-							{
-								dbParent->left->parent = setRedness(dbParent, checkRedness(dbParent->left->parent));
-							}
-							thing->right = dbParent;
-
-							if (thing->parent == nullptr)
-							{
-								freeMemory = thing;
-							}
-						}
-					}
-					else
-					{
-						if (sibling->right == redNode || getRed(sibling->right))
-						{
-							// Right right.
-							dbParent->right = sibling->left;
-							if (sibling->left)
-							{
-								sibling->left->parent = setRedness(dbParent, checkRedness(sibling->left->parent));
-							}
-							sibling->left = dbParent;
-							const bool tempRed = checkRedness(sibling->parent);
-							sibling->parent = dbParent->parent;
-							dbParent->parent = setRedness(sibling, tempRed);
-							dbParentInParent = sibling;
-							sibling->right->parent = setRedness(sibling, false);
-
-							if (sibling->parent == nullptr)
-							{
-								freeMemory = sibling;
-							}
-						}
-						else
-						{
-							// Right left.
-							// First rotation.
-							FreeHeader* thing = sibling->left;
-							sibling->left = thing->right;
-							if (sibling->left)
-							{
-								sibling->left->parent = setRedness(sibling, checkRedness(sibling->left->parent));
-							}
-							thing->right = sibling;
-							thing->parent = setRedness(dbParent, false);
-							(dbParent->left == sibling ? dbParent->left : dbParent->right) = thing;
-							sibling->parent = setRedness(thing, false);
-
-							// Second rotation.
-							thing->parent = dbParent->parent;
-							dbParentInParent = thing;
-							dbParent->parent = setRedness(thing, false);
-							dbParent->right = thing->left;
-							if (dbParent->right)
-							{
-								dbParent->right->parent = setRedness(dbParent, checkRedness(dbParent->right->parent));
-							}
-							thing->left = dbParent;
-
-							if (thing->parent == nullptr)
-							{
-								freeMemory = thing;
-							}
-						}
-					}
-
-					// Restructurization done, no two consecutive reds principle restored.
-					break;
-				}
-				else
-				{
-					// Both are black.
-					if (sibling)
-					{
-						sibling->parent = setRedness(sibling->parent, true);
-					}
-					if (checkRedness(dbParent->parent))
-					{
-						// We can color red parent to black, and therefore, stop the recursion.
-						dbParent->parent = setRedness(dbParent->parent, false);
-						break;
-					}
-					doubleBlack = dbParent;
-					dbParent = (FreeHeader*)cleanAddress(doubleBlack->parent);
-				}
-			}
-			else
-			{
-				FreeHeader*& dbParentInParent = cleanAddress(dbParent->parent) ? ((FreeHeader*)cleanAddress(dbParent->parent))->left == dbParent ? ((FreeHeader*)cleanAddress(dbParent->parent))->left : ((FreeHeader*)cleanAddress(dbParent->parent))->right : tempGarbage;
-
-				// Sibling is red.
-				if (((FreeHeader*)cleanAddress(sibling->parent))->right == sibling)
-				{
-					// Right rotate.
-					dbParent->right = sibling->left;
-					if (sibling->left)
-					{
-						sibling->left->parent = setRedness(dbParent, checkRedness(sibling->left->parent));
-					}
-					sibling->left = dbParent;
-					const bool tempRed = checkRedness(sibling->parent);
-					sibling->parent = dbParent->parent;
-					dbParent->parent = setRedness(sibling, tempRed);
-					dbParentInParent = sibling;
-					sibling->right->parent = setRedness(sibling, false);
-				}
-				else
-				{
-					// Left rotate.
-					dbParent->left = sibling->right;
-					if (sibling->right)
-					{
-						sibling->right->parent = setRedness(dbParent, checkRedness(sibling->right->parent));
-					}
-					sibling->right = dbParent;
-					const bool tempRed = checkRedness(sibling->parent);
-					sibling->parent = dbParent->parent;
-					dbParent->parent = setRedness(sibling, tempRed);
-					dbParentInParent = sibling;
-					sibling->left->parent = setRedness(sibling, false);
-				}
+		madvise(memory, size, MADV_DONTNEED);
+	};
+	result.purgeGranularity = hugePageSize; // hugetlbfs pages can only go as a whole, and splitting transparent ones would cost more than it saves.
+#ifdef __linux__
+	result.pageSize = [](void* memory, SizeType) -> SizeType
+	{
+		const SizeType pageSize = readMappingPageSize(memory);
+		return pageSize ? pageSize : getPageSize();
+	};
+#endif
+	return result;
+#endif
+}
 
-				if (sibling->parent == nullptr)
-				{
-					freeMemory = sibling;
-				}
-			}
-		}
-	}
+RBTMemoryAllocatorBase::SizeType RBTMemoryAllocatorBase::getPageSize()
+{
+#ifdef _WIN32
+	static const SizeType pageSize = []()
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return (SizeType)info.dwPageSize;
+	}();
+#else
+	static const SizeType pageSize = (SizeType)sysconf(_SC_PAGESIZE);
+#endif
+	return pageSize;
 }
 
-void RBTMemoryAllocator::insertToRBTree(FreeHeader * block)
+RBTMemoryAllocatorBase::TraceRecorder::TraceRecorder(_In_ const char * path)
+	: file(std::fopen(path, "wb")), bufferedCount(0), recordsCount(0)
 {
-	if (freeMemory == nullptr)
+	if (!file)
 	{
-		freeMemory = block;
-		freeMemory->parent = setRedness(nullptr, false);
 		return;
 	}
 
-	FreeHeader* ptr = freeMemory;
-	const SizeType blockSize = calcSize(block);
-
-	while (true)
+	FileHeader header;
+	std::memcpy(header.magic, "RBTTRACE", sizeof(header.magic));
+	header.version = version;
+	header.recordSize = sizeof(Record);
+	if (std::fwrite(&header, sizeof(header), 1, file) != 1)
 	{
-		if (blockSize < calcSize(ptr))
-		{
-			if (ptr->left)
-			{
-				ptr = ptr->left;
-			}
-			else
-			{
-				ptr->left = block;
-				block->parent = setRedness(ptr, true);
-				ptr = block;
-				break;
-			}
-		}
-		else
-		{
-			if (ptr->right)
-			{
-				ptr = ptr->right;
-			}
-			else
-			{
-				ptr->right = block;
-				block->parent = setRedness(ptr, true);
-				ptr = block;
-				break;
-			}
-		}
+		std::fclose(file);
+		file = nullptr;
 	}
+}
 
-	while (true)
+RBTMemoryAllocatorBase::TraceRecorder::~TraceRecorder()
+{
+	if (file)
 	{
-		if (ptr == freeMemory)
-		{
-			ptr->parent = setRedness(ptr->parent, false);
-		}
-		else
-			if (getRed((FreeHeader*)cleanAddress(ptr->parent)))
-			{
-				// Recolor the tree.
-				FreeHeader* parent = (FreeHeader*)cleanAddress(ptr->parent), *grandparent = (FreeHeader*)cleanAddress(parent->parent);
-
-				if (!grandparent)
-				{
-					break;;
-				}
-
-				FreeHeader* uncle = grandparent->left == parent ? grandparent->right : grandparent->left;
-
-				if (getRed(uncle))
-				{
-					parent->parent = setRedness(parent->parent, false);
-					uncle->parent = setRedness(uncle->parent, false);
-					grandparent->parent = setRedness(grandparent->parent, true);
-
-					ptr = grandparent;
-					continue;
-				}
-				else
-				{
-					static auto leftLeft = [this](FreeHeader* ptr, FreeHeader* parent, FreeHeader* grandparent)
-					{
-						grandparent->left = parent->right;
-						if (grandparent->left)
-						{
-							grandparent->left->parent = setRedness(grandparent, checkRedness(grandparent->left->parent));
-						}
-
-						const bool tempRed = checkRedness(parent->parent);
-						parent->parent = grandparent->parent;
-						if (cleanAddress(parent->parent))
-						{
-							(((FreeHeader*)cleanAddress(parent->parent))->left == grandparent ? ((FreeHeader*)cleanAddress(parent->parent))->left : ((FreeHeader*)cleanAddress(parent->parent))->right) = parent;
-						}
-						else
-						{
-							freeMemory = parent;
-						}
-						grandparent->parent = setRedness(parent, tempRed);
-
-						parent->right = grandparent;
-					};
-					static auto rightRight = [this](FreeHeader* ptr, FreeHeader* parent, FreeHeader* grandparent)
-					{
-						grandparent->right = parent->left;
-						if (grandparent->right)
-						{
-							grandparent->right->parent = setRedness(grandparent, checkRedness(grandparent->right->parent));
-						}
-
-						const bool tempRed = checkRedness(parent->parent);
-						parent->parent = grandparent->parent;
-						if (cleanAddress(parent->parent))
-						{
-							(((FreeHeader*)cleanAddress(parent->parent))->left == grandparent ? ((FreeHeader*)cleanAddress(parent->parent))->left : ((FreeHeader*)cleanAddress(parent->parent))->right) = parent;
-						}
-						else
-						{
-							freeMemory = parent;
-						}
-						grandparent->parent = setRedness(parent, tempRed);
-
-						parent->left = grandparent;
-					};
-
-					if (grandparent && parent == grandparent->left)
-					{
-						if (ptr == parent->left)
-						{
-							// Left left.
-							leftLeft(ptr, parent, grandparent);
-						}
-						else
-						{
-							// Left right.
-							parent->right = ptr->left;
-							if (parent->right)
-							{
-								parent->right->parent = setRedness(parent, checkRedness(parent->right->parent));
-							}
-							ptr->left = parent;
-							ptr->parent = setRedness(grandparent, checkRedness(ptr->parent));
-							parent->parent = setRedness(ptr, checkRedness(parent->parent));
-							(grandparent->left == parent ? grandparent->left : grandparent->right) = ptr;
-							leftLeft(parent, ptr, grandparent);
-						}
-					}
-					else
-					{
-						if (ptr == parent->left)
-						{
-							// Right left.
-							parent->left = ptr->right;
-							if (parent->left)
-							{
-								parent->left->parent = setRedness(parent, checkRedness(parent->left->parent));
-							}
-							ptr->right = parent;
-							ptr->parent = setRedness(grandparent, checkRedness(ptr->parent));
-							parent->parent = setRedness(ptr, checkRedness(parent->parent));
-							if (grandparent)
-							{
-								(grandparent->left == parent ? grandparent->left : grandparent->right) = ptr;
-							}
-							rightRight(parent, ptr, grandparent);
-						}
-						else
-						{
-							// Right right.
-							rightRight(ptr, parent, grandparent);
-						}
-					}
-
-					// Restructurization complete.
-				}
-			}
-		break;
+		flush();
+		std::fclose(file);
 	}
 }
 
-inline bool RBTMemoryAllocator::isBlockFitting(FreeHeader * block, const SizeType reqSize, const SizeType alignment, FittingBlockData& outputData) const
+bool RBTMemoryAllocatorBase::TraceRecorder::isOpen() const
 {
-	// Assumption: two free blocks cannot be next to each other.
-	if (!block)
+	return file != nullptr;
+}
+
+void RBTMemoryAllocatorBase::TraceRecorder::record(_In_ const Operation operation, _In_opt_ const void * object, _In_opt_ const void * previous, _In_ const SizeType size, _In_ const SizeType alignment)
+{
+	if (!file)
 	{
-		return false;
+		return;
 	}
-	void* ptr = addPointers(block, sizeof(ClaimedHeader));
-	SizeType space = calcSize(block) - sizeof(ClaimedHeader);
-	const SizeType startingSpace = space;
-	FittingBlockData& result = outputData;
 
-	const SizeType requiredSize = ((reqSize % usedAlignment) == 0) ? reqSize : reqSize + (usedAlignment - (reqSize % usedAlignment));
+	Record& entry = buffer[bufferedCount];
+	entry.object = (uint64_t)(uintptr_t)object;
+	entry.previous = (uint64_t)(uintptr_t)previous;
+	entry.size = (uint64_t)size;
+	entry.alignment = (uint32_t)alignment;
+	entry.operation = operation;
+	++recordsCount;
 
-	// We don't check if it's possible to attach any remaining memory to existing block. Also we don't check if it's possible to create new free block out of remaining memory.
-	// That's because remaining memory, assuming we're unable to allocate new free blocks out of it, is attached to already existing claimed blocks.
-	// There is only one case to check - whether prev is nullptr.
-	if (block->prev == nullptr)
+	if (++bufferedCount == bufferedRecords)
 	{
-		if (space >= sizeof(FreeHeader))
-		{
-			space -= sizeof(FreeHeader);
-			ptr = addPointers(ptr, sizeof(FreeHeader));
-		}
-		else
-		{
-			return false;
-		}
+		flush();
 	}
+}
 
-	if (!std::align(alignment, requiredSize, ptr, space))
+bool RBTMemoryAllocatorBase::TraceRecorder::flush()
+{
+	if (!file)
 	{
 		return false;
 	}
 
-	result.adjustment = ((SizeType)subPointers(ptr, block)) - sizeof(ClaimedHeader);
-	result.usableMemory = (ClaimedHeader*)subPointers(ptr, sizeof(ClaimedHeader));
-	result.remainingMemory = startingSpace - result.adjustment - requiredSize;
-	result.usedMemory = requiredSize;
+	const bool result = std::fwrite(buffer, sizeof(Record), bufferedCount, file) == bufferedCount && std::fflush(file) == 0;
+	bufferedCount = 0;
+	return result;
+}
 
-	return true;
+uint64_t RBTMemoryAllocatorBase::TraceRecorder::getRecordsCount() const
+{
+	return recordsCount;
 }
 
-RBTMemoryAllocator::FreeHeader * RBTMemoryAllocator::findFittingBlock(const SizeType size, const SizeType alignment, FittingBlockData& outputFittingBlock) const
+bool RBTMemoryAllocatorBase::TraceRecorder::readHeader(_In_ std::FILE * input)
 {
-	FreeHeader* searchNode = freeMemory, *chosenBlock = nullptr;
-	FittingBlockData isFittingData, &chosenData = outputFittingBlock;
-	chosenData.remainingMemory = (~0ULL);
+	FileHeader header;
+	return std::fread(&header, sizeof(header), 1, input) == 1 && std::memcmp(header.magic, "RBTTRACE", sizeof(header.magic)) == 0
+		&& header.version == version && header.recordSize == sizeof(Record);
+}
 
-	if (isBlockFitting(freeMemory, size, alignment, isFittingData))
+unsigned int RBTShardedMemoryAllocator::getThreadNumber()
+{
+	static std::atomic<unsigned int> threadsCount(0);
+	thread_local const unsigned int threadNumber = threadsCount.fetch_add(1, std::memory_order_relaxed);
+	return threadNumber;
+}
+
+#ifdef __linux__
+// Reads a sysfs list of ids, like "0-3,8,10-11".
+static std::vector<unsigned int> readIdsList(const char* path)
+{
+	std::vector<unsigned int> result;
+	std::FILE* file = std::fopen(path, "r");
+	if (!file)
 	{
-		chosenBlock = freeMemory;
-		chosenData = isFittingData;
+		return result;
 	}
 
-	while (searchNode && (searchNode->left || searchNode->right))
+	unsigned int first, last;
+	int separator;
+	while (std::fscanf(file, "%u", &first) == 1)
 	{
-		if (isBlockFitting(searchNode->left, size, alignment, isFittingData))
+		last = first;
+		separator = std::fgetc(file);
+		if (separator == '-' && std::fscanf(file, "%u", &last) == 1)
 		{
-			chosenData = isFittingData;
-			searchNode = chosenBlock = searchNode->left;
+			separator = std::fgetc(file);
 		}
-		else
-		if (isBlockFitting(searchNode->right, size, alignment, isFittingData))
+		for (unsigned int id = first; id <= last; ++id)
 		{
-			chosenData = isFittingData;
-			searchNode = chosenBlock = searchNode->right;
+			result.push_back(id);
 		}
-		else
+		if (separator != ',')
 		{
-			searchNode = searchNode->right;
+			break;
 		}
 	}
+	std::fclose(file);
 
-	return chosenBlock;
+	return result;
 }
+#endif
 
-unsigned int RBTMemoryAllocator::dbgCheckFreeTreeSanity() const
+unsigned int RBTShardedMemoryAllocator::getSystemNodesCount()
 {
-	unsigned int e = 0, count = 0;
+#ifdef __linux__
+	const std::vector<unsigned int> nodes = readIdsList("/sys/devices/system/node/has_memory");
+	return nodes.empty() ? 1 : (unsigned int)nodes.size();
+#else
+	return 1;
+#endif
+}
 
-	static Function<void(FreeHeader*, const Function<void(FreeHeader*)>&)> traverseBlock = [&e](FreeHeader* block, const Function<void(FreeHeader*)>& func)
+RBTShardedMemoryAllocator::RBTShardedMemoryAllocator(_In_opt_ const SizeType memorySize, _In_opt_ const unsigned int arenasCount, _In_opt_ const bool bindToNumaNodes)
+	: memory(nullptr), arenaSize(0), isMapped(false), nodesCount(1), arenasPerNode(0)
+{
+	unsigned int count = arenasCount;
+	if (count == 0)
 	{
-		if (!block)
+		count = std::thread::hardware_concurrency();
+		if (count == 0)
 		{
-			return;
+			count = 1;
 		}
+	}
 
-		if (block->left == block)
+	std::vector<unsigned int> nodeIds;
+#ifdef __linux__
+	if (bindToNumaNodes)
+	{
+		// Nodes without memory (CPU only) have nothing to bind to, their CPUs use the first node's arenas.
+		nodeIds = readIdsList("/sys/devices/system/node/has_memory");
+		for (unsigned int node = 0; node < nodeIds.size(); ++node)
+		{
+			const std::string path = "/sys/devices/system/node/node" + std::to_string(nodeIds[node]) + "/cpulist";
+			for (unsigned int cpu : readIdsList(path.c_str()))
+			{
+				if (cpu >= cpuNodes.size())
+				{
+					cpuNodes.resize(cpu + 1, 0);
+				}
+				cpuNodes[cpu] = node;
+			}
+		}
+		if (nodeIds.size() > 1)
 		{
-			e = 1;
-			throw 0;
+			nodesCount = (unsigned int)nodeIds.size();
 		}
-		if (block->right == block)
+		else
 		{
-			e = 2;
-			throw 0;
+			cpuNodes.clear();
 		}
-		traverseBlock(block->left, func);
-		func(block);
-		traverseBlock(block->right, func);
-	};
+	}
+#else
+	(void)bindToNumaNodes;
+#endif
+	arenasPerNode = count / nodesCount > 0 ? count / nodesCount : 1;
+	count = arenasPerNode * nodesCount;
 
-	if (getRed(freeMemory))
+	// Every arena gets an aligned slice with the same slack the owning RBTMemoryAllocator constructor uses.
+	arenaSize = (memorySize / count) + usedAlignment;
+	if (arenaSize % usedAlignment)
 	{
-		return 7;
+		arenaSize += usedAlignment - (arenaSize % usedAlignment);
 	}
 
-	if (freeMemory && (freeMemory->parent != nullptr))
+	if (nodesCount > 1)
 	{
-		return 8;
+		// Policies apply to whole pages, so the slices must not share any. They're bound before the arenas touch them.
+		const SizeType pageSize = RBTMemoryAllocator::getPageSize();
+		arenaSize = (arenaSize + pageSize - 1) & ~(pageSize - 1);
+		memory = RBTMemoryAllocator::getMappedRegionSource().acquire(arenaSize * count);
+		if (!memory)
+		{
+			throw std::bad_alloc();
+		}
+		isMapped = true;
+#ifdef __linux__
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			// MPOL_PREFERRED: memory comes from the arena's node as long as it has some, and from the others after that.
+			const unsigned int node = nodeIds[i / arenasPerNode];
+			std::vector<unsigned long> mask(node / (8 * sizeof(unsigned long)) + 1, 0);
+			mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+			syscall(SYS_mbind, addPointers(memory, arenaSize * i), arenaSize, 1 /* MPOL_PREFERRED */, mask.data(), mask.size() * 8 * sizeof(unsigned long) + 1, 0);
+		}
+#endif
+	}
+	else
+	{
+		memory = operator new(arenaSize * count);
 	}
 
 	try
 	{
-		traverseBlock(freeMemory, [this, &e, &count](FreeHeader* block)
+		arenas.reserve(count);
+		for (unsigned int i = 0; i < count; ++i)
 		{
-			if (block->left)
-			{
-				if (cleanAddress(block->left->parent) != block)
-				{
-					e = 3;
-					throw 0;
-				}
-			}
-
-			if (block->right)
-			{
-				if (cleanAddress(block->right->parent) != block)
-				{
-					e = 4;
-					throw 0;
-				}
-			}
-
-			if (checkRedness(block->parent))
-			{
-				if (getRed(block->left) || getRed(block->right))
-				{
-					e = 5;
-					throw 0;
-				}
-			}
-
-			if ((block->left && !(block->right)) || (block->right && !(block->left)) || (!(block->left) && !(block->right)))
-			{
-				if (count != 0)
-				{
-					if (dbgGetBlackHeight(block) != count)
-					{
-						std::cout << "block's height: " << dbgGetBlackHeight(block) << " count: " << count << std::endl;
-						e = 6;
-						throw 0;
-					}
-				}
-				else
-				{
-					count = dbgGetBlackHeight(block);
-				}
-			}
-		});
+			arenas.emplace_back(new RBTMemoryAllocator(addPointers(memory, arenaSize * i), arenaSize));
+		}
 	}
 	catch (...)
 	{
+		arenas.clear();
+		if (isMapped)
+		{
+			RBTMemoryAllocator::getMappedRegionSource().release(memory, arenaSize * count);
+		}
+		else
+		{
+			operator delete(memory);
+		}
+		throw;
 	}
-
-	return e;
 }
 
-unsigned int RBTMemoryAllocator::dbgGetBlackHeight(FreeHeader * const head) const
+RBTShardedMemoryAllocator::~RBTShardedMemoryAllocator()
 {
-	FreeHeader* search = head;
-	unsigned int counter = 1;
-
-	while (search->parent)
+	const SizeType size = arenaSize * arenas.size();
+	arenas.clear();
+	if (isMapped)
 	{
-		if (!checkRedness(search->parent))
-		{
-			++counter;
-		}
-		search = (FreeHeader*)cleanAddress(search->parent);
+		RBTMemoryAllocator::getMappedRegionSource().release(memory, size);
+	}
+	else
+	{
+		operator delete(memory);
 	}
-
-	return counter;
 }
 
-void RBTMemoryAllocator::dbgWriteAllBlocks() const
+void * RBTShardedMemoryAllocator::allocate(_In_ const SizeType howMany, _In_opt_ const SizeType alignment)
 {
-	ClaimedHeader* search = trueMemoryBegin;
+	const unsigned int count = getArenasCount(), first = getLocalArenaIndex();
 
-	std::cout << "Blocks dump:" << std::endl;
-	std::cout << "FreeHeader: " << calcSize(search) << std::endl;
-	search = cleanAddress(search->next);
-
-	for (; search != cleanAddress(endOfMemory); search = cleanAddress(search->next))
+	for (unsigned int i = 0; i < count; ++i)
 	{
-		if (isFreeHeader(cleanAddress(search->prev)->next))
-		{
-			std::cout << "FreeHeader: ";
-		}
-		else
+		RBTMemoryAllocator& arena = *arenas[(first + i) % count];
+		std::lock_guard<std::mutex> lock(arena.getMutex());
+		void* result = arena.allocate(howMany, alignment);
+		if (result)
 		{
-			std::cout << "ClaimedHeader: ";
+			return result;
 		}
-		std::cout << calcSize(search) << std::endl;
 	}
 
-	std::cout << std::endl;
+	return nullptr;
 }
 
-bool RBTMemoryAllocator::dbgCheckListIntegrity() const
+void * RBTShardedMemoryAllocator::reallocate(_In_opt_ void * ptr, _In_ const SizeType newSize, _In_opt_ const SizeType alignment)
 {
-	ClaimedHeader* search = cleanAddress(trueMemoryBegin);
+	if (!ptr)
+	{
+		return allocate(newSize, alignment);
+	}
 
-	while (search->next != endOfMemory)
+	SizeType oldSize = 0;
 	{
-		if (cleanAddress(cleanAddress(search->next)->prev) != search)
+		RBTMemoryAllocator& arena = *arenas[getArenaIndex(ptr)];
+		std::lock_guard<std::mutex> lock(arena.getMutex());
+		void* result = arena.reallocate(ptr, newSize, alignment);
+		if (result || newSize == 0)
 		{
-			return false;
+			return result;
 		}
-		search = cleanAddress(search->next);
+		oldSize = arena.getUsableSize(ptr);
 	}
 
-	return true;
-}
+	// The owning arena is full, move to any other.
+	void* result = allocate(newSize, alignment);
+	if (!result)
+	{
+		return nullptr;
+	}
 
-RBTMemoryAllocator::RBTMemoryAllocator(_In_ const SizeType memorySize)
-	: RBTMemoryAllocator(operator new(memorySize + usedAlignment), memorySize + usedAlignment, true)
-{
+	std::memcpy(result, ptr, oldSize < newSize ? oldSize : newSize);
+	deallocate(ptr);
+
+	return result;
 }
 
-RBTMemoryAllocator::RBTMemoryAllocator(_In_ void* memoryToUse, _In_ const SizeType memorySize, _In_opt_ const bool isOwning)
-	: memory(memoryToUse), endOfMemory((ClaimedHeader*)addPointers(memoryToUse, memorySize)), totalMemory(0), freeMemory(nullptr), usedMemory(0), allocations(0), isOwningMemory(isOwning), trueMemoryBegin(nullptr)
+void RBTShardedMemoryAllocator::deallocate(_In_ void * ptr)
 {
-	SizeType tempSize = memorySize;
-	void* temp = memoryToUse;
-	if (std::align(usedAlignment, memorySize - usedAlignment, temp, tempSize))
+	if (!ptr)
+	{
+		return;
+	}
+
+	// The owner of a busy arena frees the block on its next allocate, so the calling thread never waits.
+	RBTMemoryAllocator& arena = *arenas[getArenaIndex(ptr)];
+	std::unique_lock<std::mutex> lock(arena.getMutex(), std::try_to_lock);
+	if (lock.owns_lock())
 	{
-		freeMemory = new (temp) FreeHeader;
-		freeMemory->left = nullptr;
-		freeMemory->right = nullptr;
-		freeMemory->parent = nullptr;
-		freeMemory->next = endOfMemory;
-		freeMemory->prev = nullptr;
-		trueMemoryBegin = freeMemory;
-		totalMemory = calcSize(freeMemory);
+		arena.deallocate(ptr);
+		arena.drainRemoteFrees(); // An arena only freed into, e.g. one of an exited thread, allocates no more.
 	}
 	else
 	{
-		throw std::bad_alloc();
+		arena.deallocateRemote(ptr);
 	}
 }
 
-RBTMemoryAllocator::~RBTMemoryAllocator()
+void RBTShardedMemoryAllocator::deallocate(_In_ void * ptr, _In_ const SizeType size, _In_opt_ const SizeType alignment)
 {
-	if (allocations > 0)
+	if (!ptr)
 	{
-		std::exit(1);
+		return;
 	}
 
-	if (isOwningMemory)
+	RBTMemoryAllocator& arena = *arenas[getArenaIndex(ptr)];
+	std::unique_lock<std::mutex> lock(arena.getMutex(), std::try_to_lock);
+	if (lock.owns_lock())
 	{
-		operator delete(memory);
+		arena.deallocate(ptr, size, alignment);
+		arena.drainRemoteFrees();
+	}
+	else
+	{
+		arena.deallocateRemote(ptr);
 	}
 }
 
-void * RBTMemoryAllocator::allocate(_In_ const SizeType howMany, _In_opt_ const SizeType alignment)
+RBTShardedMemoryAllocator::SizeType RBTShardedMemoryAllocator::getUsedMemory() const
 {
-	// Assumption: two free blocks cannot be next to each other.
+	SizeType result = 0;
 
-#ifdef RBMEM_CHECKSANITY
-	if (!dbgCheckListIntegrity())
+	for (const auto& arena : arenas)
 	{
-		throw 8;
+		std::lock_guard<std::mutex> lock(arena->getMutex());
+		result += arena->getUsedMemory();
 	}
-#endif
 
-	FittingBlockData fittingBlockData;
-	FreeHeader* fittingBlock = findFittingBlock((howMany >= sizeof(FreeHeader) - sizeof(ClaimedHeader) ? howMany : sizeof(FreeHeader) - sizeof(ClaimedHeader)), alignment, fittingBlockData);
+	return result;
+}
+
+RBTShardedMemoryAllocator::SizeType RBTShardedMemoryAllocator::getTotalMemory() const
+{
+	SizeType result = 0;
 
-	if (!fittingBlock)
+	for (const auto& arena : arenas)
 	{
-		return nullptr;
+		result += arena->getTotalMemory();
 	}
 
-	removeFromRBTree(fittingBlock);
-#ifdef RBMEM_CHECKSANITY
-	dbgCheckSanity();
-#endif
-
-	ClaimedHeader headInfo = *fittingBlock;
-	ClaimedHeader* const claimedBlock = new (fittingBlockData.usableMemory) ClaimedHeader;
+	return result;
+}
 
-	// Check the adjustment and remaining memory size.
-	const SizeType adjustment = fittingBlockData.adjustment, remainingMemory = fittingBlockData.remainingMemory;
+uint64_t RBTShardedMemoryAllocator::getAllocationsCount() const
+{
+	uint64_t result = 0;
 
-	// First we take care of back memory.
-	if (remainingMemory >= sizeof(FreeHeader))
+	for (const auto& arena : arenas)
 	{
-		// Create new free block.
-		//FreeHeader* newBlock = new (subPointers(cleanAddress(headInfo.next), remainingMemory)) FreeHeader;
-		FreeHeader* newBlock = new (addPointers(claimedBlock, sizeof(ClaimedHeader) + fittingBlockData.usedMemory)) FreeHeader;
-		newBlock->next = headInfo.next;
-		if (headInfo.next != endOfMemory)
-		{
-			cleanAddress(headInfo.next)->prev = setIsFreeHeader(newBlock, true);
-		}
-		newBlock->prev = setIsFreeHeader(claimedBlock, false);
-		claimedBlock->next = setIsFreeHeader(newBlock, true);
-		insertToRBTree(newBlock);
-#ifdef RBMEM_CHECKSANITY
-		dbgCheckSanity();
-#endif
-	}
-	else
-	{
-		// Add the remaining memory to the claimed block.
-		claimedBlock->next = headInfo.next;
-		if (headInfo.next != endOfMemory)
-		{
-			cleanAddress(headInfo.next)->prev = setIsFreeHeader(claimedBlock, false);
-		}
+		std::lock_guard<std::mutex> lock(arena->getMutex());
+		result += arena->getAllocationsCount();
 	}
 
-	// Take care of forward memory.
-	if (adjustment >= sizeof(FreeHeader))
-	{
-		// Create new free block.
-		FreeHeader* newBlock = new (fittingBlock) FreeHeader;
-		newBlock->next = setIsFreeHeader(claimedBlock, false);
-		newBlock->prev = headInfo.prev;
-		claimedBlock->prev = setIsFreeHeader(newBlock, true);
-		if (headInfo.prev)
-		{
-			cleanAddress(headInfo.prev)->next = setIsFreeHeader(newBlock, true);
-		}
-		insertToRBTree(newBlock);
-#ifdef RBMEM_CHECKSANITY
-		dbgCheckSanity();
-#endif
-	}
-	else
-	{
-		// Add the remaining memory to previous block.
-		claimedBlock->prev = headInfo.prev;
-		if (headInfo.prev)
-		{
-			cleanAddress(headInfo.prev)->next = setIsFreeHeader(claimedBlock, false);
-		}
-	}
+	return result;
+}
+
+// Adds the counters of one arena. Fragmentation is recomputed from the sums by the caller.
+static void addStats(RBTMemoryAllocator::Stats& result, const RBTMemoryAllocator::Stats& arena)
+{
+	result.totalMemory += arena.totalMemory;
+	result.usedMemory += arena.usedMemory;
+	result.allocations += arena.allocations;
+	result.failedAllocations += arena.failedAllocations;
+	result.splits += arena.splits;
+	result.coalesces += arena.coalesces;
+	result.freeBlocks += arena.freeBlocks;
+	result.freeMemory += arena.freeMemory;
+	result.largestFreeBlock = arena.largestFreeBlock > result.largestFreeBlock ? arena.largestFreeBlock : result.largestFreeBlock;
+}
 
-	++allocations;
-	usedMemory += calcSize(claimedBlock);
+RBTMemoryAllocator::Stats RBTShardedMemoryAllocator::getStats() const
+{
+	RBTMemoryAllocator::Stats result;
 
-#ifdef RBMEM_CHECKSANITY
-	if (!dbgCheckListIntegrity())
+	for (const auto& arena : arenas)
 	{
-		throw 8;
+		addStats(result, arena->getStats());
 	}
-#endif
+	result.fragmentation = result.freeMemory > 0 && result.largestFreeBlock <= result.freeMemory ? 1.0 - (double)result.largestFreeBlock / result.freeMemory : 0.0;
 
-	//dbgWriteAllBlocks();
-	return addPointers(claimedBlock, sizeof(ClaimedHeader));
-	}
+	return result;
+}
 
-void RBTMemoryAllocator::deallocate(_In_ void* ptr)
+RBTMemoryAllocator::HeapStats RBTShardedMemoryAllocator::getHeapStats() const
 {
-	if (!ptr)
-	{
-		return;
-	}
+	RBTMemoryAllocator::HeapStats result;
 
-#ifdef RBMEM_CHECKSANITY
-	if (!dbgCheckListIntegrity())
+	for (const auto& arena : arenas)
 	{
-		throw 8;
+		std::lock_guard<std::mutex> lock(arena->getMutex());
+		const RBTMemoryAllocator::HeapStats arenaStats = arena->getHeapStats();
+		addStats(result, arenaStats);
+		result.treeHeight = arenaStats.treeHeight > result.treeHeight ? arenaStats.treeHeight : result.treeHeight;
+		for (unsigned int i = 0; i < RBTMemoryAllocator::histogramClassesCount; ++i)
+		{
+			result.liveHistogram[i] += arenaStats.liveHistogram[i];
+			result.freeHistogram[i] += arenaStats.freeHistogram[i];
+		}
 	}
-#endif
+	result.fragmentation = result.freeMemory > 0 && result.largestFreeBlock <= result.freeMemory ? 1.0 - (double)result.largestFreeBlock / result.freeMemory : 0.0;
 
-	ClaimedHeader* claimedBlock = (ClaimedHeader*)subPointers(ptr, sizeof(ClaimedHeader));
-	ClaimedHeader headInfo = *claimedBlock;
-	usedMemory -= calcSize(claimedBlock);
+	return result;
+}
 
-	FreeHeader* newBlock = (FreeHeader*)claimedBlock;
+bool RBTShardedMemoryAllocator::isPointerInMemoryRange(_In_ const void * ptr) const
+{
+	return (ptr >= memory) && (ptr < addPointers(memory, arenaSize * arenas.size()));
+}
 
-	// Merge adjacent blocks if possible and add the new block to the RB tree.
-	// Prevoius block (the one on left).
-	if (isFreeHeader(headInfo.prev)) // If it doesn't work then try adding "&& cleanAddress(headInfo.prev) != nullptr".
-	{
-		newBlock = (FreeHeader*)cleanAddress(headInfo.prev);
-		removeFromRBTree(newBlock);
-#ifdef RBMEM_CHECKSANITY
-		dbgCheckSanity();
-#endif
-		newBlock->next = headInfo.next;
-	}
+unsigned int RBTShardedMemoryAllocator::getArenasCount() const
+{
+	return (unsigned int)arenas.size();
+}
 
-	// Next block (the one on right).
-	if (isFreeHeader(headInfo.next) && headInfo.next != endOfMemory)
-	{
-		FreeHeader* tempHead = (FreeHeader*)cleanAddress(headInfo.next);
-		removeFromRBTree(tempHead);
-#ifdef RBMEM_CHECKSANITY
-		dbgCheckSanity();
-#endif
-		newBlock->next = cleanAddress(headInfo.next)->next;
-	}
+unsigned int RBTShardedMemoryAllocator::getArenaIndex(_In_ const void * ptr) const
+{
+	return (unsigned int)(((uintptr_t)ptr - (uintptr_t)memory) / arenaSize);
+}
 
-	if (newBlock->prev)
-	{
-		cleanAddress(newBlock->prev)->next = setIsFreeHeader(newBlock, true);
-	}
-	if (newBlock->next != endOfMemory)
+unsigned int RBTShardedMemoryAllocator::getLocalArenaIndex() const
+{
+	if (nodesCount > 1)
 	{
-		cleanAddress(newBlock->next)->prev = setIsFreeHeader(newBlock, true);
+		return getCurrentNode() * arenasPerNode + getThreadNumber() % arenasPerNode;
 	}
-	// Merging complete.
+	return getThreadNumber() % getArenasCount();
+}
 
-	newBlock->left = newBlock->right = newBlock->parent = nullptr;
-	insertToRBTree(newBlock);
-#ifdef RBMEM_CHECKSANITY
-	dbgCheckSanity();
+unsigned int RBTShardedMemoryAllocator::getCurrentNode() const
+{
+#ifdef __linux__
+	// Threads may migrate, so it's checked every time. sched_getcpu doesn't enter the kernel.
+	const int cpu = sched_getcpu();
+	return cpu >= 0 && (unsigned int)cpu < cpuNodes.size() ? cpuNodes[cpu] : 0;
+#else
+	return 0;
 #endif
+}
 
-#ifdef RBMEM_CHECKSANITY
-	if (!dbgCheckListIntegrity())
-	{
-		throw 8;
-	}
-#endif
+unsigned int RBTShardedMemoryAllocator::getNodesCount() const
+{
+	return nodesCount;
+}
 
-	--allocations;
+unsigned int RBTShardedMemoryAllocator::getArenaNode(_In_ const unsigned int index) const
+{
+	return index / arenasPerNode;
+}
+
+RBTMemoryAllocator & RBTShardedMemoryAllocator::getArena(_In_ const unsigned int index)
+{
+	return *arenas[index];
 }
@@ -1,46 +1,439 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <map>
 #include <vector>
 #include <string>
+#include <type_traits>
 #include <set>
+#include <stdexcept>
 #include <queue>
 #include <stack>
 #include <list>
 
+#if defined(__has_include)
+#if __has_include(<memory_resource>) && ((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+#include <memory_resource>
+#define RBMEM_HAS_MEMORY_RESOURCE
+#endif
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #ifndef _In_
 #define _In_
 #endif
 #ifndef _In_opt_
 #define _In_opt_
 #endif
+#ifndef _Out_
+#define _Out_
+#endif
 
-class RBTMemoryAllocator
+// What every BasicRBTMemoryAllocator has in common, whatever its Config: the basic definitions, the types of its interface and the region sources.
+class RBTMemoryAllocatorBase
 {
 public:
 	// Some basic definitions.
 	static constexpr unsigned long long KiloByte = (1024);
 	static constexpr unsigned long long MegaByte = (1024 * KiloByte);
-	static constexpr auto usedAlignment = alignof(std::max_align_t) >= 4 ? alignof(std::max_align_t) : 4;
 
 	using SizeType = std::size_t;
-private:
+
+	static constexpr SizeType hugePageSize = 2 * MegaByte; // What getHugePageRegionSource asks for.
+
+	static constexpr unsigned int maxDeferredFrees = 64; // Upper bound of setDeferredFreesCapacity.
+	static constexpr unsigned int remoteFreesBatchSize = 64; // Blocks drainRemoteFrees sorts and merges at once.
+
+	static constexpr unsigned int histogramClassesCount = sizeof(SizeType) * 8; // Class i counts blocks of 2^i to 2^(i+1) - 1 bytes.
+
+	// How free blocks are found, see RBTMemoryAllocatorConfig::freeIndex.
+	enum class FreeIndex
+	{
+		RedBlackTree, // Best fit in O(log n), plus a check per block that fits only at some addresses.
+		Tlsf // Good fit in O(1): two-level segregated fit lists.
+	};
+#ifdef RBMEM_TLSF_INDEX
+	static constexpr FreeIndex defaultFreeIndex = FreeIndex::Tlsf;
+#else
+	static constexpr FreeIndex defaultFreeIndex = FreeIndex::RedBlackTree;
+#endif
+
+	// Counters kept up to date on every operation. Reading them doesn't need the lock, but they may be a few operations apart from each other.
+	// Without Config::stats, only totalMemory, usedMemory and allocations are kept, the rest stays 0.
+	struct Stats
+	{
+		SizeType totalMemory = 0, usedMemory = 0; // Slab pages count while they have a live slot. The empty one kept per class doesn't.
+		uint64_t allocations = 0; // Live ones.
+		uint64_t failedAllocations = 0; // Requests that returned nullptr, even after trying to grow.
+		uint64_t splits = 0; // Free blocks cut in two, one part staying free.
+		uint64_t coalesces = 0; // Neighbouring blocks merged into one.
+		uint64_t freeBlocks = 0; // In the tree. Deferred frees and free slab slots aren't counted.
+		SizeType freeMemory = 0, largestFreeBlock = 0; // The same. With the TLSF index, largestFreeBlock is an upper bound, up to 1/16 above the real size, see findLargestFreeBlockSize.
+		double fragmentation = 0; // External: 1 - largestFreeBlock / freeMemory. 0 if all free memory is one block.
+	};
+	// Everything that needs a walk over the heap.
+	struct HeapStats
+		: public Stats
+	{
+		unsigned int treeHeight = 0; // Nodes on the longest path of the free tree. Same size blocks share one node. Always 0 with the TLSF index.
+		uint64_t liveHistogram[histogramClassesCount] = {}; // Claimed blocks by their size. Slab slots by their slot size.
+		uint64_t freeHistogram[histogramClassesCount] = {}; // Free blocks in the tree and deferred frees.
+	};
+
+	// Where additional regions come from when the existing ones can't satisfy a request.
+	struct RegionSource
+	{
+		std::function<void*(SizeType size)> acquire; // Should return nullptr on failure. Leave empty to disable growing.
+		std::function<void(void* memory, SizeType size)> release;
+		std::function<void(void* memory, SizeType size)> purge; // Gives the physical pages of a page-aligned range back to the system, keeping the range usable. Optional.
+		std::function<SizeType(void* memory, SizeType size)> pageSize; // Size of the pages actually backing an acquired region. Optional, getPageSize() is assumed without it.
+		SizeType purgeGranularity = 0; // Ranges passed to purge are multiples of it. 0 means getPageSize().
+	};
+
+	// One block of the heap, as reported by HeapWalker and FreeTreeWalker.
+	struct BlockInfo
+	{
+		const void* address; // Where the block starts, header included.
+		const void* memory; // What allocate returned for it, if it's claimed.
+		SizeType size; // Header included.
+		bool isFree; // In the tree.
+		bool isDeferred; // Freed, but kept claimed until deferred frees are merged.
+		bool isSlabPage; // Claimed and split into slab slots.
+		bool isFirstInRegion;
+	};
+
+	class TraceRecorder;
+
+	static RegionSource getDefaultRegionSource(); // operator new and operator delete.
+	static RegionSource getMappedRegionSource(_In_opt_ const bool lazyPurge = false); // Pages mapped directly from the system, which can be purged. lazyPurge uses MADV_FREE where available.
+	static RegionSource getHugePageRegionSource(_In_opt_ const bool prefault = false); // hugePageSize pages: from hugetlbfs if any are free, transparent ones otherwise, regular ones if neither works. prefault touches every page up front.
+	static SizeType getPageSize();
+protected:
 	template<class T>
 	using Function = std::function<T>;
 
+	// Written only by whoever holds the allocator at the moment, but read from any thread, so a relaxed load and store is enough.
+	template<class T>
+	class StatCounter
+	{
+	private:
+		std::atomic<T> value;
+	public:
+		inline StatCounter(const T initial = 0)
+			: value(initial)
+		{
+		}
+		inline operator T() const
+		{
+			return value.load(std::memory_order_relaxed);
+		}
+		inline StatCounter& operator=(const T newValue)
+		{
+			value.store(newValue, std::memory_order_relaxed);
+			return *this;
+		}
+		inline StatCounter& operator+=(const T by)
+		{
+			return *this = (T)*this + by;
+		}
+		inline StatCounter& operator-=(const T by)
+		{
+			return *this = (T)*this - by;
+		}
+		inline StatCounter& operator++()
+		{
+			return *this += 1;
+		}
+		inline StatCounter& operator--()
+		{
+			return *this -= 1;
+		}
+	};
+	// Counters that only feed getStats, when Config::stats is off. Writes compile to nothing and reads give 0.
+	template<class T>
+	class NoStatCounter
+	{
+	public:
+		inline NoStatCounter(const T = 0)
+		{
+		}
+		inline operator T() const
+		{
+			return 0;
+		}
+		inline NoStatCounter& operator=(const T)
+		{
+			return *this;
+		}
+		inline NoStatCounter& operator+=(const T)
+		{
+			return *this;
+		}
+		inline NoStatCounter& operator-=(const T)
+		{
+			return *this;
+		}
+		inline NoStatCounter& operator++()
+		{
+			return *this;
+		}
+		inline NoStatCounter& operator--()
+		{
+			return *this;
+		}
+	};
+
+	static inline unsigned int findFirstSet(const SizeType mask) // Index of the lowest set bit. mask can't be 0.
+	{
+#if defined(_MSC_VER) && defined(_WIN64)
+		unsigned long index;
+		_BitScanForward64(&index, mask);
+		return index;
+#elif defined(_MSC_VER)
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return index;
+#else
+		return (unsigned int)__builtin_ctzll((unsigned long long)mask);
+#endif
+	}
+	static inline unsigned int findLastSet(const SizeType mask) // Index of the highest set bit. mask can't be 0.
+	{
+#if defined(_MSC_VER) && defined(_WIN64)
+		unsigned long index;
+		_BitScanReverse64(&index, mask);
+		return index;
+#elif defined(_MSC_VER)
+		unsigned long index;
+		_BitScanReverse(&index, mask);
+		return index;
+#else
+		return (unsigned int)(sizeof(unsigned long long) * 8 - 1 - __builtin_clzll((unsigned long long)mask));
+#endif
+	}
+	static inline unsigned int getHistogramClass(SizeType size) // Index of the power of two class of size.
+	{
+		unsigned int result = 0;
+		while (size >>= 1)
+		{
+			++result;
+		}
+		return result;
+	}
+};
+
+// Thrown by the checks of allocators whose Config::checkSanity is set. getError() is a number from BasicRBTMemoryAllocator's error list.
+class RBTMemoryAllocatorError
+	: public std::logic_error
+{
+private:
+	unsigned int error;
+public:
+	explicit RBTMemoryAllocatorError(_In_ const unsigned int errorNumber)
+		: std::logic_error("RBTMemoryAllocator check failed with error " + std::to_string(errorNumber)), error(errorNumber)
+	{
+	}
+
+	unsigned int getError() const
+	{
+		return error;
+	}
+};
+
+// Lock policy for allocators used by one thread at a time.
+struct RBTNoLock
+{
+	inline void lock()
+	{
+	}
+	inline void unlock()
+	{
+	}
+};
+
+// The defaults, which make RBTMemoryAllocator. Derive from it and override what should differ. The RBMEM_ macros only change these defaults.
+struct RBTMemoryAllocatorConfig
+{
+	using Lock = RBTNoLock; // Taken by every public call that changes or walks the heap. std::mutex or any type with lock and unlock.
+	static constexpr std::size_t alignment = alignof(std::max_align_t) >= 4 ? alignof(std::max_align_t) : 4; // Of every block, the allocator's usedAlignment. A power of two, up to 256.
+	static constexpr std::size_t memorySize = 8 * RBTMemoryAllocatorBase::MegaByte; // Of the first region, and the least the next ones get.
+	static constexpr RBTMemoryAllocatorBase::FreeIndex freeIndex = RBTMemoryAllocatorBase::defaultFreeIndex; // Fixed for the allocator's lifetime, so only its code is compiled in.
+#ifdef RBMEM_BOUNDARY_TAGS
+	static constexpr bool boundaryTags = true; // Blocks keep a size word instead of two links, see the Smaller block headers section of README.md.
+#else
+	static constexpr bool boundaryTags = false;
+#endif
+#ifdef RBMEM_COMPACT_LINKS
+	static constexpr bool compactLinks = true; // Links between blocks and in the tree are 32-bit distances. All regions then have to fit in 4 GiB.
+#else
+	static constexpr bool compactLinks = false;
+#endif
+#ifdef RBMEM_NO_STATS
+	static constexpr bool stats = false; // Keeps the counters getStats reports beyond the memory totals.
+#else
+	static constexpr bool stats = true;
+#endif
+#ifdef RBMEM_CHECKSANITY
+	static constexpr bool checkSanity = true; // Checks the heap after every change, and the size passed to deallocate. Throws RBTMemoryAllocatorError.
+#else
+	static constexpr bool checkSanity = false;
+#endif
+};
+
+// Locked and checked, for tests.
+struct RBTCheckedMemoryAllocatorConfig
+	: public RBTMemoryAllocatorConfig
+{
+	using Lock = std::mutex;
+	static constexpr bool checkSanity = true;
+};
+
+// The allocator, set up at compile time by Config: see RBTMemoryAllocatorConfig for what it holds. Whatever Config leaves out costs nothing:
+// layouts, counters, checks and the lock are picked by type, so the code of the others is never instantiated. RBTMemoryAllocator uses the defaults.
+template<class Config = RBTMemoryAllocatorConfig>
+class BasicRBTMemoryAllocator
+	: public RBTMemoryAllocatorBase
+{
+public:
+	using Lock = typename Config::Lock;
+	static constexpr SizeType usedAlignment = Config::alignment;
+	static constexpr FreeIndex freeIndex = Config::freeIndex; // Every index call tests it, so the other index's code is compiled away.
+	// How many blocks of one size the tree search checks before it moves on to the next size. Only over-aligned requests need more than one.
+	static constexpr unsigned int rbtreeChainCandidates = 8;
+
+	// Requests up to slabMaxSize bytes (with no extra alignment) are served from slab pages: pages claimed from the tree and split into headerless slots of one size class.
+	static constexpr SizeType slabPageSize = 8 * KiloByte;
+	static constexpr SizeType slabMaxSize = 256;
+	static constexpr SizeType slabClassesCount = slabMaxSize / usedAlignment;
+
+	static_assert(usedAlignment >= 4 && (usedAlignment & (usedAlignment - 1)) == 0, "The alignment must be a power of two, at least 4.");
+	static_assert(!Config::compactLinks || usedAlignment >= 8, "Compact links need both ends 8 bytes aligned.");
+
+	class ThreadCache;
+	class HeapWalker;
+	class FreeTreeWalker;
+private:
 	struct FreeHeader;
 	struct ClaimedHeader;
 
-	struct alignas(usedAlignment) ClaimedHeader
+	// Layout tags. Code that differs between the block layouts is overloaded on them, so only the configured layout's code is instantiated.
+	struct LinkedBlocks
 	{
-		ClaimedHeader* prev, *next;
 	};
-	struct alignas(usedAlignment) FreeHeader
+	struct TaggedBlocks
+	{
+	};
+	using Layout = typename std::conditional<Config::boundaryTags, TaggedBlocks, LinkedBlocks>::type;
+
+	// A link stored as a 32-bit distance from its own address, so no base has to be known to follow it. Keeps the 2 tag bits of the pointer.
+	// Both ends are at least 8 bytes aligned, so the halved distance leaves room for the tags and still reaches 4 GiB either way.
+	template<class T>
+	class CompactLink
+	{
+	private:
+		static constexpr uint32_t nullValue = 0x80000000u;
+		uint32_t value;
+
+		inline uintptr_t getAnchor() const
+		{
+			return ((uintptr_t)this) & ~(uintptr_t)7;
+		}
+	public:
+		inline CompactLink(T* const ptr = nullptr)
+		{
+			*this = ptr;
+		}
+		inline CompactLink(const CompactLink& other)
+		{
+			*this = (T*)other;
+		}
+		inline CompactLink& operator=(const CompactLink& other)
+		{
+			return *this = (T*)other;
+		}
+		inline CompactLink& operator=(T* const ptr)
+		{
+			const uintptr_t address = ((uintptr_t)ptr) & ~(uintptr_t)3;
+			value = (address ? (uint32_t)(((intptr_t)(address - getAnchor())) / 2) : nullValue) | (uint32_t)(((uintptr_t)ptr) & 3);
+			return *this;
+		}
+		inline operator T*() const
+		{
+			const uint32_t distance = value & ~3u;
+			const uintptr_t address = distance == nullValue ? 0 : getAnchor() + (uintptr_t)(((intptr_t)(int32_t)distance) * 2);
+			return (T*)(address | (value & 3));
+		}
+		inline T* operator->() const
+		{
+			return *this;
+		}
+		friend inline void swap(CompactLink& first, CompactLink& second) // std::swap would go through a temporary far away from the heap.
+		{
+			T* const temp = first;
+			first = (T*)second;
+			second = temp;
+		}
+	};
+
+	template<class T>
+	using Link = typename std::conditional<Config::compactLinks, CompactLink<T>, T*>::type;
+
+	static constexpr unsigned long long compactLinksRange = 4 * 1024 * MegaByte - 64; // With compact links, all regions have to fit in such a window.
+
+	// With the TLSF index, left and right link a free block into its size list instead of the tree, and parent and sameSize stay null.
+	// Linked blocks: a block keeps links to both neighbours. Their least significant bit tells if the block they point to is free.
+	struct alignas(usedAlignment) LinkedClaimedHeader
+	{
+		Link<ClaimedHeader> prev, next;
+	};
+	// Boundary tags: a claimed block keeps only its size, with flags in the low bits. Free blocks repeat the size in their last word,
+	// so the block before a free one can reach it. Blocks start one word before a usedAlignment boundary, so payloads stay aligned.
+	struct TaggedClaimedHeader
+	{
+		SizeType sizeAndFlags; // See blockFreeFlag and prevBlockFreeFlag.
+	};
+	struct ClaimedHeader
+		: public std::conditional<Config::boundaryTags, TaggedClaimedHeader, LinkedClaimedHeader>::type
+	{
+	};
+	struct alignas(Config::boundaryTags ? alignof(ClaimedHeader) : usedAlignment) FreeHeader
 		: public ClaimedHeader
 	{
-		FreeHeader* left = nullptr, *right = nullptr, *parent = nullptr; // RB data. Red/black bit is stored in the least significant bit of parent.
-		// These addresses should be perfectly aligned to usedAlignment, so at least 2 least significant bits can be used to store data. In our case: most right tells us if the block is free or claimed and the one on the left is a red black bit.
+		Link<FreeHeader> left = nullptr, right = nullptr, parent = nullptr; // RB data. Red/black bit is stored in the second least significant bit of parent.
+		Link<FreeHeader> sameSize = nullptr; // Chain of the other free blocks of the same size. Only the first one is a tree node, the others keep the previous block of the chain in parent, with the least significant bit set.
+	};
+	struct BlockLinks // A copy of a linked header's links, which stays valid when the header is overwritten.
+	{
+		ClaimedHeader* prev, *next;
+	};
+	struct alignas(usedAlignment) SlabPage
+	{
+		SlabPage* prev, *next; // Pages of the same size class with at least one free slot.
+		void* freeSlots; // Intrusive list of released slots.
+		void* untouchedSlots; // Slots past this address were never used.
+		SizeType sizeClass;
+		SizeType usedSlots;
+	};
+	struct alignas(usedAlignment) Region
+	{
+		Region* next; // Immutable once the region is published.
+		void* memory; // What the region was created from.
+		SizeType size;
+		bool isOwning; // Released through regionSource if true.
+		ClaimedHeader* begin; // The first block. Nothing precedes it.
+		ClaimedHeader* end; // The sentinel closing the block list. It's always claimed and never freed.
+		unsigned char* slabPageMap; // One byte per slabPageSize-aligned page of the region: 0 if it's not a slab page.
+		uintptr_t slabPageMapBegin;
+		SizeType slabPageMapSize;
 	};
 	struct FittingBlockData
 	{
@@ -50,16 +443,56 @@ private:
 		SizeType usedMemory = 0;
 	};
 
-	static_assert(alignof(FreeHeader) == usedAlignment, "Alignments must match.");
-	static_assert(alignof(ClaimedHeader) == usedAlignment, "Alignments must match.");
+	static constexpr SizeType blockFreeFlag = 1, prevBlockFreeFlag = 2, blockFlagsMask = usedAlignment - 1; // Boundary tags only.
+	// With boundary tags: the header, the tree links and the footer, rounded up so block sizes stay multiples of usedAlignment.
+	static constexpr SizeType minFreeBlockSize = Config::boundaryTags ? (sizeof(FreeHeader) + sizeof(SizeType) + usedAlignment - 1) & ~(usedAlignment - 1) : sizeof(FreeHeader);
+
+	static_assert(!Config::boundaryTags || (usedAlignment % sizeof(SizeType) == 0 && usedAlignment > sizeof(SizeType)), "Boundary tags need the payload to start one word past the header.");
+	static_assert(Config::boundaryTags || (alignof(FreeHeader) == usedAlignment && alignof(ClaimedHeader) == usedAlignment), "Alignments must match.");
 	static_assert(sizeof(ClaimedHeader) < sizeof(FreeHeader), "It should not happen.");
+
+	template<class T>
+	using OptionalCounter = typename std::conditional<Config::stats, StatCounter<T>, NoStatCounter<T>>::type;
+
+	static constexpr SizeType maxRequestSize = ((SizeType)-1) / 2; // Bigger requests, alignment included, fail without searching.
+
+	// How many blocks of the request's own list the TLSF search checks, before it takes the first block of a higher list.
+	static constexpr unsigned int tlsfListCandidates = 8;
+
+	// Two-level segregated fit: first level lists split sizes by powers of two, and every one of them is split again into tlsfSecondLevelsCount
+	// lists of equal ranges. Sizes below tlsfLinearSize all belong to the first level 0, with one list per usedAlignment step.
+	static constexpr unsigned int tlsfSecondLevelLog2 = 4;
+	static constexpr unsigned int tlsfSecondLevelsCount = 1u << tlsfSecondLevelLog2;
+	static constexpr SizeType tlsfLinearSize = tlsfSecondLevelsCount * usedAlignment;
+	static constexpr unsigned int tlsfFirstLevelsCount = sizeof(SizeType) * 8 - tlsfSecondLevelLog2 - 1; // A few too many, usedAlignment is at least 4.
+	static_assert(slabClassesCount > 0 && slabMaxSize + sizeof(SlabPage) <= slabPageSize, "Slab pages must hold at least one slot of every class.");
 private:
-	void* memory;
-	FreeHeader* freeMemory;
-	ClaimedHeader* trueMemoryBegin, *endOfMemory;
-	SizeType totalMemory, usedMemory;
-	unsigned int allocations;
-	bool isOwningMemory;
+	std::atomic<Region*> regions; // Newest first. Atomic, because thread caches look up regions without the lock.
+	// One index for the free blocks of all regions. Only the one freeIndex names is used, the other stays empty.
+	FreeHeader* freeMemory = nullptr; // Root of the tree.
+	SizeType tlsfFirstLevelBitmap = 0; // Bit i is set if any list of the first level i holds a block.
+	uint32_t tlsfSecondLevelBitmaps[tlsfFirstLevelsCount] = {};
+	FreeHeader* tlsfLists[tlsfFirstLevelsCount][tlsfSecondLevelsCount] = {}; // Newest block first.
+	RegionSource regionSource;
+	SizeType growthSize; // Minimal size of a new region.
+	StatCounter<SizeType> totalMemory, usedMemory;
+	SizeType dirtyMemory, purgeThreshold; // Bytes freed since the last trim and how many of them trigger one.
+	StatCounter<uint64_t> allocations;
+	OptionalCounter<uint64_t> failedAllocations, splits, coalesces;
+	OptionalCounter<uint64_t> freeBlocksCount;
+	OptionalCounter<SizeType> freeBlocksMemory, largestFreeBlock; // Both kept by insertFreeBlock and removeFreeBlock.
+	std::mutex mutex; // Guards the tree when it's shared by thread caches.
+	mutable Lock callLock; // Config's lock, taken by the public calls that change or walk the heap.
+	SlabPage* slabPages[slabClassesCount];
+	ClaimedHeader* deferredFrees[maxDeferredFrees]; // Freed blocks not merged yet. They stay claimed and out of the tree.
+	unsigned int deferredFreesCount, deferredFreesCapacity;
+	TraceRecorder* traceRecorder;
+	struct RemoteFree // Overlays the first word of a block queued by deallocateRemote, so every block can be queued, slab slots included.
+	{
+		RemoteFree* next;
+	};
+	std::atomic<RemoteFree*> remoteFrees{nullptr}; // Newest first. Pushed by any thread, taken whole by drainRemoteFrees.
+	bool isDrainingRemoteFrees = false; // Set while drainRemoteFrees runs, as the merges it does may trim, which drains again.
 private:
 	// Red-black tree methods.
 	// true for black, false for red.
@@ -68,10 +501,82 @@ private:
 		// We must clean two least significant bits.
 		return (ClaimedHeader*)(((uintptr_t)ptr) & (~3));
 	}
-	static constexpr inline SizeType calcSize(const ClaimedHeader* ptr)
+	static inline SizeType calcSize(const ClaimedHeader* ptr)
+	{
+		return calcSize(ptr, Layout());
+	}
+	static inline ClaimedHeader* getNextBlock(const ClaimedHeader* ptr)
+	{
+		return getNextBlock(ptr, Layout());
+	}
+	static inline bool isBlockFree(const ClaimedHeader* ptr) // With linked blocks, not for the end sentinel, which links to itself.
+	{
+		return isBlockFree(ptr, Layout());
+	}
+	static inline SizeType calcSize(const ClaimedHeader* ptr, TaggedBlocks)
+	{
+		return ptr->sizeAndFlags & ~blockFlagsMask;
+	}
+	static inline ClaimedHeader* getNextBlock(const ClaimedHeader* ptr, TaggedBlocks)
+	{
+		return (ClaimedHeader*)(((uintptr_t)ptr) + calcSize(ptr));
+	}
+	static inline bool isBlockFree(const ClaimedHeader* ptr, TaggedBlocks)
+	{
+		return ptr->sizeAndFlags & blockFreeFlag;
+	}
+	static inline bool isNextBlockFree(const ClaimedHeader* ptr, TaggedBlocks)
+	{
+		return isBlockFree(getNextBlock(ptr));
+	}
+	static inline bool isPrevBlockFree(const ClaimedHeader* ptr)
+	{
+		return ptr->sizeAndFlags & prevBlockFreeFlag;
+	}
+	static inline FreeHeader* getPrevFreeBlock(const ClaimedHeader* ptr) // Only valid if isPrevBlockFree.
+	{
+		return (FreeHeader*)(((uintptr_t)ptr) - ((const SizeType*)ptr)[-1]);
+	}
+	static inline void setFreeBlock(FreeHeader* const block, const SizeType size) // Writes the header and the footer. The block before a free one is always claimed.
+	{
+		block->sizeAndFlags = size | blockFreeFlag;
+		((SizeType*)(((uintptr_t)block) + size))[-1] = size;
+	}
+	static inline void setPrevBlockFree(ClaimedHeader* const ptr, const bool isFree)
+	{
+		ptr->sizeAndFlags = (ptr->sizeAndFlags & ~prevBlockFreeFlag) | (isFree ? prevBlockFreeFlag : 0);
+	}
+	static inline SizeType calcSize(const ClaimedHeader* ptr, LinkedBlocks)
 	{
 		return ((uintptr_t)cleanAddress(ptr->next)) - ((uintptr_t)ptr);
 	}
+	static inline ClaimedHeader* getNextBlock(const ClaimedHeader* ptr, LinkedBlocks)
+	{
+		return cleanAddress(ptr->next);
+	}
+	static inline bool isBlockFree(const ClaimedHeader* ptr, LinkedBlocks)
+	{
+		return isFreeHeader(cleanAddress(ptr->next)->prev);
+	}
+	static inline bool isNextBlockFree(const ClaimedHeader* ptr, LinkedBlocks)
+	{
+		return isFreeHeader(ptr->next);
+	}
+	static constexpr inline SizeType getRequiredBlockSize(const SizeType howMany) // Block size for howMany bytes, ignoring alignment.
+	{
+		return Config::boundaryTags ? (howMany + sizeof(ClaimedHeader) <= minFreeBlockSize ? minFreeBlockSize : (howMany + sizeof(ClaimedHeader) + usedAlignment - 1) & ~(usedAlignment - 1))
+			: sizeof(ClaimedHeader) + (howMany <= sizeof(FreeHeader) - sizeof(ClaimedHeader) ? sizeof(FreeHeader) - sizeof(ClaimedHeader) : (howMany + usedAlignment - 1) & ~(usedAlignment - 1));
+	}
+	static constexpr inline SizeType getGuaranteedFitSize(const SizeType howMany, const SizeType alignment) // Free blocks of at least this size fit the request wherever they are.
+	{
+		// The padding is below alignment and the first block of a region additionally keeps a free header in front.
+		return Config::boundaryTags ? getRequiredBlockSize(howMany) + (alignment > usedAlignment ? minFreeBlockSize + alignment : 0)
+			: getRequiredBlockSize(howMany) + sizeof(FreeHeader) + (alignment > usedAlignment ? alignment - usedAlignment : 0);
+	}
+	static constexpr inline bool isRequestTooBig(const SizeType howMany, const SizeType alignment) // The block sizes above would wrap. No region can hold half the address space anyway.
+	{
+		return alignment > maxRequestSize || howMany > maxRequestSize - alignment;
+	}
 	static constexpr inline bool checkRedness(FreeHeader* const ptr)
 	{
 		return ((uintptr_t)ptr) & 2;
@@ -88,16 +593,116 @@ private:
 	{
 		return (ClaimedHeader*)((((uintptr_t)ptr) & ~1) | ((uintptr_t)isFreeHeader));
 	}
-	static constexpr inline bool getRed(FreeHeader* const ptr)
+	static inline bool getRed(FreeHeader* const ptr)
 	{
 		return ptr && checkRedness(ptr->parent);
 	}
+	static inline bool isChained(FreeHeader* const block)
+	{
+		return ((uintptr_t)(FreeHeader*)block->parent) & 1;
+	}
+	static constexpr inline FreeHeader* setChained(FreeHeader* const prevInChain)
+	{
+		return (FreeHeader*)(((uintptr_t)prevInChain) | 1);
+	}
+
+	// Slab methods.
+	static constexpr inline SizeType getSlabClass(const SizeType size)
+	{
+		return size > 0 ? (size - 1) / usedAlignment : 0;
+	}
+	static constexpr inline SizeType getSlabClassSize(const SizeType sizeClass)
+	{
+		return (sizeClass + 1) * usedAlignment;
+	}
+
+	Region* addRegion(void* memoryToUse, const SizeType memorySize, const bool isOwning); // nullptr if the memory is too small.
+	void linkRegionBlocks(FreeHeader* block, ClaimedHeader* end, TaggedBlocks); // Makes block the only block of a new region, up to the end sentinel.
+	void linkRegionBlocks(FreeHeader* block, ClaimedHeader* end, LinkedBlocks);
+	bool grow(const SizeType howMany, const SizeType alignment); // Adds a region big enough for the request.
+	Region* findRegion(const void* ptr) const;
+	SizeType purgeFreeBlock(FreeHeader* const block); // Purges the pages inside the block. Returns purged bytes.
+	SizeType purgeFreeBlocks(FreeHeader* const head); // Purges the whole subtree. Returns purged bytes.
+	SizeType purgeRegions(); // What trim does.
+	void addDirtyMemory(const SizeType bytes); // Counts bytes given back to the free blocks, and trims once purgeThreshold of them add up.
 
-	void removeFromRBTree(FreeHeader* block);
+	SlabPage* findSlabPage(const void* ptr) const; // nullptr if ptr isn't a slot.
+	SlabPage* createSlabPage(const SizeType sizeClass);
+	SizeType getSlabPageBlockSize(const SlabPage* page) const; // Of the block the page was claimed as, header included.
+	void* allocateFromSlab(const SizeType sizeClass);
+	void deallocateToSlab(SlabPage* page, void* ptr);
+	void releaseSlabPage(SlabPage* page); // Gives an empty page back to the tree.
+
+	// Public methods take callLock, record the call and forward here, so the nested calls neither lock nor get recorded twice.
+	void* allocateBlock(const SizeType howMany, const SizeType alignment);
+	void deallocateBlock(void* ptr);
+	void deallocateSizedBlock(void* ptr, const SizeType size, const SizeType alignment);
+	void* reallocateBlock(void* ptr, const SizeType newSize, const SizeType alignment);
+	void deallocateBlocks(void** ptrs, const SizeType count);
+	SizeType drainRemoteBlocks();
+	SizeType calcUsableSize(const void* ptr) const;
+
+	void* allocateFromTree(const SizeType howMany, const SizeType alignment);
+	ClaimedHeader* claimFittingBlock(FreeHeader* fittingBlock, const FittingBlockData& fittingBlockData, TaggedBlocks); // Claims the part of the removed block that fittingBlockData tells, the rest becomes free blocks.
+	ClaimedHeader* claimFittingBlock(FreeHeader* fittingBlock, const FittingBlockData& fittingBlockData, LinkedBlocks);
+	SizeType allocateRunFromTree(const SizeType blockSize, const SizeType count, void** output); // Carves count neighbouring blocks out of one free block. Returns count, or 0 if there's no block big enough.
+	void splitRun(ClaimedHeader* first, const SizeType blockSize, const SizeType count, void** output, TaggedBlocks); // Splits a claimed block into count blocks of blockSize, the last one keeping the rest.
+	void splitRun(ClaimedHeader* first, const SizeType blockSize, const SizeType count, void** output, LinkedBlocks);
+	void deallocateToTree(void* ptr); // Defers the merge if deferred frees are enabled.
+	void mergeToTree(ClaimedHeader* claimedBlock); // Merges the block with its free neighbours and inserts the result.
+	FreeHeader* mergeWithNeighbours(ClaimedHeader* claimedBlock, TaggedBlocks); // Takes the free neighbours out of the index and joins them with the block. Returns the joined block, not inserted yet.
+	FreeHeader* mergeWithNeighbours(ClaimedHeader* claimedBlock, LinkedBlocks);
+	void* takeDeferredFree(const SizeType howMany, const SizeType alignment); // A deferred block of exactly the needed size, or nullptr.
+	bool flushDeferredFrees(); // Merges all deferred blocks. false if there were none.
+	void shrinkClaimedBlock(ClaimedHeader* block, const SizeType blockSize, TaggedBlocks); // Turns everything past blockSize into a free block, if it's big enough for one.
+	void shrinkClaimedBlock(ClaimedHeader* block, const SizeType blockSize, LinkedBlocks);
+	bool growClaimedBlock(ClaimedHeader* block, const SizeType blockSize); // Takes memory from the next block if it's free and big enough.
+	void joinBlocks(ClaimedHeader* first, ClaimedHeader* last, TaggedBlocks); // first spans up to the end of last. The blocks from first to last must be claimed or out of the index.
+	void joinBlocks(ClaimedHeader* first, ClaimedHeader* last, LinkedBlocks);
+
+	// Free block index methods. They go to the red-black tree or to the TLSF lists, as freeIndex says.
+	void insertFreeBlock(FreeHeader* block); // Updates the free block counters and adds the block to the index.
+	void removeFreeBlock(FreeHeader* block); // Updates the free block counters and takes the block out of the index.
+	SizeType findLargestFreeBlockSize() const; // Exact for the tree. For TLSF, the largest size the highest non-empty list may hold, as finding the block would take a walk. Exact if that list holds one block.
+	inline bool isBlockFitting(FreeHeader * block, const SizeType reqSize, const SizeType alignment, FittingBlockData& outputData) const
+	{
+		// Assumption: two free blocks cannot be next to each other.
+		return block && isBlockFitting(block, reqSize, alignment, outputData, Layout());
+	}
+	bool isBlockFitting(FreeHeader * block, const SizeType reqSize, const SizeType alignment, FittingBlockData& outputData, TaggedBlocks) const;
+	bool isBlockFitting(FreeHeader * block, const SizeType reqSize, const SizeType alignment, FittingBlockData& outputData, LinkedBlocks) const;
+	FreeHeader* findFittingBlock(const SizeType size, const SizeType alignment, FittingBlockData& outputFittingBlock) const; // Best fit for the tree. Good fit in O(1) for TLSF, see tlsfListCandidates.
+	static inline void mapToTlsfList(const SizeType size, unsigned int& firstLevel, unsigned int& secondLevel)
+	{
+		if (size < tlsfLinearSize)
+		{
+			firstLevel = 0;
+			secondLevel = (unsigned int)(size / usedAlignment);
+			return;
+		}
+
+		const unsigned int log2 = findLastSet(size);
+		firstLevel = log2 - findLastSet(tlsfLinearSize) + 1;
+		secondLevel = (unsigned int)(size >> (log2 - tlsfSecondLevelLog2)) - tlsfSecondLevelsCount;
+	}
+
+	void insertToTlsf(FreeHeader* block);
+	void unlinkFromTlsf(FreeHeader* block);
+	FreeHeader* findTlsfList(unsigned int firstLevel, unsigned int secondLevel) const; // Head of the first non-empty list from the given one on, nullptr if there's none.
+	FreeHeader* findFittingBlockInTlsf(const SizeType size, const SizeType alignment, FittingBlockData& outputFittingBlock) const;
+	unsigned int dbgCheckTlsfSanity() const;
+
+	void unlinkFromRBTree(FreeHeader* block);
 	void insertToRBTree(FreeHeader* block); // It also encodes parent to store the red-black bit.
-	bool isBlockFitting(FreeHeader * block, const SizeType reqSize, const SizeType alignment, FittingBlockData& outputData) const;
-	FreeHeader* findFittingBlock(const SizeType size, const SizeType alignment, FittingBlockData& outputFittingBlock) const;
-	unsigned int dbgCheckFreeTreeSanity() const;
+	FreeHeader* findLowerBound(const SizeType blockSize) const; // The smallest block of at least blockSize.
+	static FreeHeader* getSuccessor(FreeHeader* block); // Next block in size order.
+	FreeHeader* findFittingBlockInRBTree(const SizeType size, const SizeType alignment, FittingBlockData& outputFittingBlock) const;
+	unsigned int dbgCheckRBTreeSanity() const;
+
+	unsigned int dbgCheckFreeTreeSanity() const; // Of the index in use.
+	unsigned int dbgCheckFittingBlock(const FreeHeader* block, const SizeType size, const SizeType alignment) const; // Compares what findFittingBlock returned with a scan of every block.
+	bool dbgCheckBlockLinks(const ClaimedHeader* block, const Region* region, TaggedBlocks) const; // false if the block doesn't fit with its neighbours.
+	bool dbgCheckBlockLinks(const ClaimedHeader* block, const Region* region, LinkedBlocks) const;
 	// Error list:
 	// 1: left child looped.
 	// 2: right child looped.
@@ -107,17 +712,35 @@ private:
 	// 6: black node height is not the same in the whole tree.
 	// 7: root is red.
 	// 8: root's parent is not null.
+	// 9: same size chain is broken.
+	// 10: sized deallocation doesn't match the block.
+	// 11: a TLSF list is broken or holds a block of another size range.
+	// 12: TLSF bitmaps don't match the lists.
+	// 13: findFittingBlock returned a block that doesn't fit, one worse than the best fit with the tree, or one past the lists TLSF may take.
+	// 14: block list is broken: neighbouring blocks' links, sizes, free flags or footers don't match (see dbgCheckListIntegrity).
 
 	unsigned int dbgGetBlackHeight(FreeHeader* const head) const;
+	static unsigned int getTreeHeight(const FreeHeader* const head);
 public:
-	static RBTMemoryAllocator instance;
+	static BasicRBTMemoryAllocator instance;
+
+	// A heap over mapped memory, constructed on first use and never destroyed. It doesn't depend on operator new or malloc,
+	// so it can back them, and it's usable during static initialization and destruction. Lock getMutex() around it if threads share it.
+	static BasicRBTMemoryAllocator& getProcessHeap();
 public:
-	explicit RBTMemoryAllocator(_In_opt_ const SizeType memorySize = 8 * MegaByte);
-	RBTMemoryAllocator(_In_ void* memoryToUse, _In_ const SizeType memorySize, _In_opt_ const bool isOwning = false); // Ignore the third parameter.
-	~RBTMemoryAllocator();
+	explicit BasicRBTMemoryAllocator(_In_opt_ const SizeType memorySize = Config::memorySize); // Grows by memorySize using the default region source.
+	explicit BasicRBTMemoryAllocator(_In_ const RegionSource& source, _In_opt_ const SizeType memorySize = Config::memorySize); // Grows by memorySize using source.
+	BasicRBTMemoryAllocator(_In_ void* memoryToUse, _In_ const SizeType memorySize, _In_opt_ const bool isOwning = false); // Ignore the third parameter. Doesn't grow unless setRegionSource is called.
+	~BasicRBTMemoryAllocator();
 
 	void* allocate(_In_ const SizeType howMany, _In_opt_ const SizeType alignment = usedAlignment);
 	void deallocate(_In_ void* ptr);
+	void deallocate(_In_ void* ptr, _In_ const SizeType size, _In_opt_ const SizeType alignment = usedAlignment); // size and alignment must be those of the last allocate or reallocate of ptr. Blocks bigger than slab slots skip the slot lookup.
+	void* reallocate(_In_opt_ void* ptr, _In_ const SizeType newSize, _In_opt_ const SizeType alignment = usedAlignment); // Resizes in place if possible. Returns nullptr and leaves ptr intact on failure.
+	SizeType allocateBatch(_In_ const SizeType howMany, _In_ const SizeType count, _Out_ void** output, _In_opt_ const SizeType alignment = usedAlignment); // Fills output with count blocks of howMany bytes, carved from as few free blocks as possible. Returns how many were allocated, less than count only if memory ran out.
+	void deallocateBatch(_In_ void** ptrs, _In_ const SizeType count); // Sorts ptrs, so neighbouring blocks are merged before they reach the tree. nullptr entries are skipped.
+	void deallocateRemote(_In_ void* ptr); // Lock-free, any thread may call it without getMutex(). The block is only queued: the next allocate, allocateBatch or trim frees it.
+	SizeType drainRemoteFrees(); // Frees the blocks queued by deallocateRemote, like deallocate would. Returns how many there were. A nested call, from a trim the merges start, returns 0.
 
 	template<class T, class... Args>
 	T* allocate(Args&&... args);
@@ -127,20 +750,249 @@ public:
 	SizeType getUsedMemory() const;
 	SizeType getTotalMemory() const;
 
-	unsigned int getAllocationsCount() const;
+	uint64_t getAllocationsCount() const;
+
+	Stats getStats() const; // Cheap and safe to call from any thread, e.g. a metrics one.
+	HeapStats getHeapStats() const; // Walks every block, so the heap must be paused: lock getMutex() if other threads use the allocator. Its largestFreeBlock is always exact.
 
 	bool isPointerInMemoryRange(_In_ const void* ptr) const;
+	SizeType getUsableSize(_In_ const void* ptr) const; // How many bytes can be used starting at ptr. ptr must be a live allocation.
+
+	SizeType getRegionPageSize(_In_ const void* ptr) const; // Size of the pages backing the region that contains ptr, as obtained from the region source.
+	void setRegionSource(_In_ const RegionSource& source, _In_ const SizeType minRegionSize); // Call it before the allocator grows for the first time.
+	unsigned int getRegionsCount() const;
+
+	SizeType trim(); // Purges the pages inside free blocks of the regions acquired from the region source. Returns purged bytes.
+	void setPurgeThreshold(_In_ const SizeType dirtyBytes); // trim() runs on its own once that many bytes were freed since the last one. 0 disables it.
+	SizeType getPurgeThreshold() const;
 
-	unsigned int dbgCalcTreeNodesCount() const;
-	void dbgCheckSanity() const; // Will throw std::runtime_error if the error exists. It's empty if _DEBUG is not defined.
-	void dbgWriteAllBlocks() const;
+	void setDeferredFreesCapacity(_In_ const unsigned int capacity); // Up to maxDeferredFrees freed blocks wait unmerged for a request of the same size. 0 (the default) merges every block right away.
+	unsigned int getDeferredFreesCapacity() const;
+
+	void setTraceRecorder(_In_opt_ TraceRecorder* recorder); // Every allocate, deallocate and reallocate call is recorded until it's set back to nullptr. The allocator doesn't own the recorder.
+	TraceRecorder* getTraceRecorder() const;
+
+	std::mutex& getMutex(); // The lock used by thread caches to refill and flush. Lock it around direct allocate/deallocate calls if thread caches are in use.
+
+	unsigned int dbgCalcTreeNodesCount() const; // Same size blocks share one node. With the TLSF index, the number of non-empty lists.
+	SizeType dbgGetFittingBlockSize(_In_ const SizeType howMany, _In_opt_ const SizeType alignment = usedAlignment) const; // Size of the free block the tree search picks for the request. 0 if none.
+	SizeType dbgGetBestFittingBlockSize(_In_ const SizeType howMany, _In_opt_ const SizeType alignment = usedAlignment) const; // The same, found by scanning every block. Matches the red-black tree's unless more than rbtreeChainCandidates free blocks have the best size.
+	void dbgCheckSanity() const; // Throws RBTMemoryAllocatorError with the error of the index in use, if it has one.
+	void dbgWriteAllBlocks() const; // Prints what HeapWalker reports to std::cout.
 	bool dbgCheckListIntegrity() const; // Complexivity: 0(n)
 };
 
+// The allocator with the defaults of RBTMemoryAllocatorConfig.
+using RBTMemoryAllocator = BasicRBTMemoryAllocator<>;
+
+// Per-thread front end for small allocations. Keeps a free list per size class of blocks already claimed from the allocator,
+// so most small allocate/deallocate calls touch neither the tree nor the allocator's mutex. Lists are refilled and flushed in batches.
+// Meant to be declared thread_local; the destructor flushes everything back, so the thread's cache is released when the thread exits.
+template<class Config>
+class BasicRBTMemoryAllocator<Config>::ThreadCache
+{
+public:
+	static constexpr SizeType sizeClassGranularity = usedAlignment;
+	static constexpr SizeType maxCachedSize = 256;
+	static constexpr SizeType sizeClassesCount = maxCachedSize / sizeClassGranularity;
+	static constexpr unsigned int defaultCapacity = 64; // Blocks per size class.
+private:
+	struct CachedBlock
+	{
+		CachedBlock* next;
+	};
+	struct SizeClass
+	{
+		CachedBlock* head = nullptr;
+		unsigned int count = 0;
+	};
+
+	static_assert(sizeClassGranularity * sizeClassesCount == slabMaxSize && sizeClassGranularity == usedAlignment, "Cache size classes must match slab classes.");
+private:
+	BasicRBTMemoryAllocator& allocator;
+	SizeClass sizeClasses[sizeClassesCount];
+	unsigned int capacity;
+private:
+	static constexpr inline SizeType getSizeClassSize(const SizeType sizeClass)
+	{
+		return (sizeClass + 1) * sizeClassGranularity;
+	}
+
+	bool refill(const SizeType sizeClass);
+	void release(const SizeType sizeClass, unsigned int howMany); // Gives back howMany blocks from the front of the list.
+public:
+	explicit ThreadCache(_In_opt_ BasicRBTMemoryAllocator& allocatorToUse = BasicRBTMemoryAllocator::instance, _In_opt_ const unsigned int capacityPerClass = defaultCapacity);
+	ThreadCache(const ThreadCache&) = delete;
+	ThreadCache& operator=(const ThreadCache&) = delete;
+	~ThreadCache(); // Flushes.
+
+	void* allocate(_In_ const SizeType howMany, _In_opt_ const SizeType alignment = usedAlignment);
+	void deallocate(_In_ void* ptr);
+	void deallocate(_In_ void* ptr, _In_ const SizeType size, _In_opt_ const SizeType alignment = usedAlignment); // Takes the size class from size instead of the slab page header, and sends bigger blocks to the allocator without looking for a slot.
+
+	void flush(); // Returns all cached blocks to the allocator.
+
+	void setCapacity(_In_ const unsigned int capacityPerClass); // Trims the lists that exceed the new capacity.
+	unsigned int getCapacity() const;
+	unsigned int getCachedBlocksCount() const;
+
+	BasicRBTMemoryAllocator& getAllocator() const;
+
+	static ThreadCache& local(); // The calling thread's cache bound to instance.
+};
+
+// Writes allocator calls to a binary file, so a real workload can be captured once and replayed against other configurations (see Benchmarks/RBTTraceReplay.cpp).
+// The file starts with a FileHeader followed by Records. Records are buffered and written in chunks, so recording costs little more than a copy.
+// Not synchronized on its own; an allocator calls it under the same conditions as the rest of its methods.
+class RBTMemoryAllocatorBase::TraceRecorder
+{
+public:
+	enum class Operation : uint32_t
+	{
+		Allocate,
+		Deallocate,
+		Reallocate
+	};
+
+	struct FileHeader
+	{
+		char magic[8]; // "RBTTRACE"
+		uint32_t version;
+		uint32_t recordSize;
+	};
+
+	struct Record
+	{
+		uint64_t object; // Address of the block, which identifies it until it's freed. 0 for a failed allocation.
+		uint64_t previous; // The block passed to reallocate, 0 otherwise.
+		uint64_t size; // Requested bytes, 0 for deallocate.
+		uint32_t alignment; // 0 for deallocate.
+		Operation operation;
+	};
+
+	static constexpr uint32_t version = 1;
+	static constexpr unsigned int bufferedRecords = 1024;
+
+	static_assert(sizeof(Record) == 32, "Records are written as they are.");
+private:
+	std::FILE* file;
+	Record buffer[bufferedRecords];
+	unsigned int bufferedCount;
+	uint64_t recordsCount;
+public:
+	explicit TraceRecorder(_In_ const char* path); // Truncates the file. Check isOpen.
+	TraceRecorder(const TraceRecorder&) = delete;
+	TraceRecorder& operator=(const TraceRecorder&) = delete;
+	~TraceRecorder(); // Flushes and closes.
+
+	bool isOpen() const;
+	void record(_In_ const Operation operation, _In_opt_ const void* object, _In_opt_ const void* previous, _In_ const SizeType size, _In_ const SizeType alignment);
+	bool flush(); // Writes the buffered records. false if writing failed.
+	uint64_t getRecordsCount() const;
+
+	static bool readHeader(_In_ std::FILE* input); // Checks the header of a trace opened for reading.
+};
+
+// Visits every block of an allocator in address order, regions included, without allocating anything.
+// The heap must not change while walking: hold getMutex() if other threads use the allocator.
+template<class Config>
+class BasicRBTMemoryAllocator<Config>::HeapWalker
+{
+private:
+	const BasicRBTMemoryAllocator& allocator;
+	const Region* region;
+	const ClaimedHeader* block; // The next one to report.
+private:
+	const Region* findNextRegion(const Region* const after) const; // The lowest region above after, or the lowest of all for nullptr.
+public:
+	explicit HeapWalker(_In_ const BasicRBTMemoryAllocator& allocatorToWalk);
+
+	bool next(_Out_ BlockInfo& output); // false once every block was reported.
+	void reset(); // Starts over from the lowest address.
+};
+
+// Visits the free blocks of an allocator's tree from the smallest to the largest, without allocating anything.
+// Blocks of the same size come in the order they're chained. With the TLSF index, lists come in size order, but the blocks of one list
+// are in no particular order. The same rules as for HeapWalker apply.
+template<class Config>
+class BasicRBTMemoryAllocator<Config>::FreeTreeWalker
+{
+private:
+	const BasicRBTMemoryAllocator& allocator;
+	unsigned int list; // TLSF: first level * tlsfSecondLevelsCount + second level of the list block belongs to.
+	FreeHeader* node; // Tree: node of the current size.
+	FreeHeader* block; // The next one to report. In the tree, the node itself or one chained after it.
+public:
+	explicit FreeTreeWalker(_In_ const BasicRBTMemoryAllocator& allocatorToWalk);
+
+	bool next(_Out_ BlockInfo& output); // false once every free block was reported.
+	void reset();
+};
+
+// Thread-safe allocator. Splits its memory into independent arenas, each being a RBTMemoryAllocator with its own tree and lock.
+// Threads are assigned to arenas round-robin, and a pointer is always given back to the arena that owns it, whichever thread frees it.
+class RBTShardedMemoryAllocator
+{
+public:
+	using SizeType = RBTMemoryAllocator::SizeType;
+	static constexpr auto usedAlignment = RBTMemoryAllocator::usedAlignment;
+private:
+	void* memory;
+	SizeType arenaSize;
+	std::vector<std::unique_ptr<RBTMemoryAllocator>> arenas;
+	bool isMapped; // memory was mapped from the system instead of taken from operator new.
+	unsigned int nodesCount, arenasPerNode; // Arenas are grouped by node: the first arenasPerNode belong to node 0 and so on.
+	std::vector<unsigned int> cpuNodes; // Node of every CPU. Empty unless there's more than one node.
+private:
+	static unsigned int getThreadNumber(); // Assigned once per thread.
+	unsigned int getCurrentNode() const; // The node of the CPU the calling thread runs on.
+public:
+	// memorySize is reserved once and split into equal arenas, which never grow: that's what lets getArenaIndex find a pointer's arena by arithmetic.
+	// Once every arena is full, allocate returns nullptr, so size it for the peak. 0 arenas means one per hardware thread. With bindToNumaNodes,
+	// arenas are split evenly among the NUMA nodes (at least one each), their memory is bound to their node and threads use the arenas of the
+	// node they run on. With a single node it changes nothing.
+	explicit RBTShardedMemoryAllocator(_In_opt_ const SizeType memorySize = 8 * RBTMemoryAllocator::MegaByte, _In_opt_ const unsigned int arenasCount = 0, _In_opt_ const bool bindToNumaNodes = false);
+	RBTShardedMemoryAllocator(const RBTShardedMemoryAllocator&) = delete;
+	RBTShardedMemoryAllocator& operator=(const RBTShardedMemoryAllocator&) = delete;
+	~RBTShardedMemoryAllocator();
+
+	void* allocate(_In_ const SizeType howMany, _In_opt_ const SizeType alignment = usedAlignment); // Tries the calling thread's arena first, then the others.
+	void deallocate(_In_ void* ptr); // Never waits: if the owning arena is locked, the block goes to its deallocateRemote queue.
+	void deallocate(_In_ void* ptr, _In_ const SizeType size, _In_opt_ const SizeType alignment = usedAlignment);
+	void* reallocate(_In_opt_ void* ptr, _In_ const SizeType newSize, _In_opt_ const SizeType alignment = usedAlignment); // Resizes within the owning arena if possible.
+
+	template<class T, class... Args>
+	T* allocate(Args&&... args);
+	template<class T>
+	void deallocate(T* const arg);
+
+	SizeType getUsedMemory() const;
+	SizeType getTotalMemory() const;
+	uint64_t getAllocationsCount() const;
+
+	RBTMemoryAllocator::Stats getStats() const; // Sums the arenas' counters.
+	RBTMemoryAllocator::HeapStats getHeapStats() const; // Locks the arenas one at a time.
+
+	bool isPointerInMemoryRange(_In_ const void* ptr) const;
+
+	unsigned int getArenasCount() const;
+	unsigned int getArenaIndex(_In_ const void* ptr) const; // Index of the arena owning ptr. ptr must be in the memory range.
+	unsigned int getLocalArenaIndex() const; // Index of the calling thread's arena.
+	unsigned int getNodesCount() const; // NUMA nodes the arenas are spread over. 1 unless bound to nodes.
+	unsigned int getArenaNode(_In_ const unsigned int index) const; // Which of them the arena's memory is bound to.
+
+	static unsigned int getSystemNodesCount(); // NUMA nodes with memory the system reports. 1 where that can't be told.
+	RBTMemoryAllocator& getArena(_In_ const unsigned int index); // Lock its mutex before using it directly.
+};
+
 template<class T>
 class StdAllocator
 {
 private:
+	template<class U>
+	friend class StdAllocator;
+
+	RBTMemoryAllocator* allocator;
 public:
 	template<class U>
 	struct rebind
@@ -159,44 +1011,83 @@ public:
 	using size_type = std::size_t;
 	using difference_type = std::ptrdiff_t;
 
+	// The heap follows the contents, so memory is always given back to the allocator it came from.
+	using propagate_on_container_copy_assignment = std::true_type;
 	using propagate_on_container_move_assignment = std::true_type;
-	using is_always_equal = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+	using is_always_equal = std::false_type;
 public:
-	StdAllocator() = default;
+	StdAllocator(); // Uses RBTMemoryAllocator::instance.
+	StdAllocator(RBTMemoryAllocator& allocatorToUse);
 	StdAllocator(const StdAllocator& arg) = default;
 	~StdAllocator() = default;
 
 	template<class U>
-	StdAllocator(const StdAllocator<U>&) {};
+	StdAllocator(const StdAllocator<U>& arg);
 
 	value_type* allocate(size_type n);
 	void deallocate(pointer p, size_type n);
+	value_type* reallocate(pointer p, size_type oldN, size_type newN); // For trivially copyable types only. Standard containers don't call it, use it for your own buffers.
 
-	bool operator==(const StdAllocator& arg) const;
-	bool operator!=(const StdAllocator&) const;
+	RBTMemoryAllocator& getAllocator() const;
+
+	template<class U>
+	bool operator==(const StdAllocator<U>& arg) const;
+	template<class U>
+	bool operator!=(const StdAllocator<U>& arg) const;
 };
 
+template<class T>
+inline StdAllocator<T>::StdAllocator()
+	: allocator(&RBTMemoryAllocator::instance)
+{
+}
+template<class T>
+inline StdAllocator<T>::StdAllocator(RBTMemoryAllocator & allocatorToUse)
+	: allocator(&allocatorToUse)
+{
+}
+template<class T>
+template<class U>
+inline StdAllocator<T>::StdAllocator(const StdAllocator<U>& arg)
+	: allocator(arg.allocator)
+{
+}
 template<class T>
 inline T * StdAllocator<T>::allocate(size_type n)
 {
-	return (pointer)RBTMemoryAllocator::instance.allocate(sizeof(value_type)*n, alignof(T));
+	return (pointer)allocator->allocate(sizeof(value_type)*n, alignof(T));
+}
+template<class T>
+inline void StdAllocator<T>::deallocate(pointer p, size_type n)
+{
+	allocator->deallocate(static_cast<void*>(p), sizeof(value_type)*n, alignof(T));
 }
 template<class T>
-inline void StdAllocator<T>::deallocate(pointer p, size_type)
+inline T * StdAllocator<T>::reallocate(pointer p, size_type, size_type newN)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Reallocation moves bytes, so T must be trivially copyable.");
+	return (pointer)allocator->reallocate(static_cast<void*>(p), sizeof(value_type)*newN, alignof(T));
+}
+
+template<class T>
+inline RBTMemoryAllocator & StdAllocator<T>::getAllocator() const
 {
-	RBTMemoryAllocator::instance.deallocate(static_cast<void*>(p));
+	return *allocator;
 }
 
 template<class T>
-inline bool StdAllocator<T>::operator==(const StdAllocator &) const
+template<class U>
+inline bool StdAllocator<T>::operator==(const StdAllocator<U>& arg) const
 {
-	return true;
+	return allocator == arg.allocator;
 }
 
 template<class T>
-inline bool StdAllocator<T>::operator!=(const StdAllocator &) const
+template<class U>
+inline bool StdAllocator<T>::operator!=(const StdAllocator<U>& arg) const
 {
-	return false;
+	return allocator != arg.allocator;
 }
 
 template<class T>
@@ -209,10 +1100,10 @@ template<class T>
 using Deque = std::deque<T, StdAllocator<T>>;
 
 template<class Key, class Value, class Compare = std::template less<Key>>
-using Map = std::map<Key, Value, Compare, StdAllocator<std::template pair<Key, Value>>>;
+using Map = std::map<Key, Value, Compare, StdAllocator<std::template pair<const Key, Value>>>;
 
 template<class Key, class Value, class Compare = std::template less<Key>>
-using Multimap = std::multimap<Key, Value, Compare, StdAllocator<std::template pair<Key, Value>>>;
+using Multimap = std::multimap<Key, Value, Compare, StdAllocator<std::template pair<const Key, Value>>>;
 
 template<class Value, class Compare = std::template less<Value>>
 using Set = std::set<Value, Compare, StdAllocator<Value>>;
@@ -231,14 +1122,66 @@ using Stack = std::stack<T, Deque<T>>;
 
 using String = std::basic_string<char, std::char_traits<char>, StdAllocator<char>>;
 
+#ifdef RBMEM_HAS_MEMORY_RESOURCE
+// Lets std::pmr containers use a RBTMemoryAllocator. Like the allocator itself, it isn't synchronized.
+class RBTMemoryResource
+	: public std::pmr::memory_resource
+{
+private:
+	RBTMemoryAllocator* allocator;
+protected:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override; // Throws std::bad_alloc on failure.
+	void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+public:
+	explicit RBTMemoryResource(_In_opt_ RBTMemoryAllocator& allocatorToUse = RBTMemoryAllocator::instance);
+
+	RBTMemoryAllocator& getAllocator() const;
+};
+
+inline RBTMemoryResource::RBTMemoryResource(_In_opt_ RBTMemoryAllocator & allocatorToUse)
+	: allocator(&allocatorToUse)
+{
+}
+
+inline void * RBTMemoryResource::do_allocate(std::size_t bytes, std::size_t alignment)
+{
+	void* const result = allocator->allocate(bytes, alignment);
+	if (!result)
+	{
+		throw std::bad_alloc();
+	}
+	return result;
+}
+
+inline void RBTMemoryResource::do_deallocate(void * p, std::size_t bytes, std::size_t alignment)
+{
+	allocator->deallocate(p, bytes, alignment);
+}
+
+inline bool RBTMemoryResource::do_is_equal(const std::pmr::memory_resource & other) const noexcept
+{
+	const RBTMemoryResource* const resource = dynamic_cast<const RBTMemoryResource*>(&other);
+	return resource && resource->allocator == allocator;
+}
+
+inline RBTMemoryAllocator & RBTMemoryResource::getAllocator() const
+{
+	return *allocator;
+}
+#endif
+
+template<class Config>
 template<class T, class ...Args>
-inline T * RBTMemoryAllocator::allocate(Args && ...args)
+inline T * BasicRBTMemoryAllocator<Config>::allocate(Args && ...args)
 {
-	return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args...>(args...));
+	void* const memory = allocate(sizeof(T), alignof(T));
+	return memory ? new (memory) T(std::forward<Args>(args)...) : nullptr;
 }
 
+template<class Config>
 template<class T>
-inline void RBTMemoryAllocator::deallocate(T * const arg)
+inline void BasicRBTMemoryAllocator<Config>::deallocate(T * const arg)
 {
 	if (arg)
 	{
@@ -246,3 +1189,22 @@ inline void RBTMemoryAllocator::deallocate(T * const arg)
 		deallocate((void*)arg);
 	}
 }
+
+template<class T, class ...Args>
+inline T * RBTShardedMemoryAllocator::allocate(Args && ...args)
+{
+	void* const block = allocate(sizeof(T), alignof(T));
+	return block ? new (block) T(std::forward<Args>(args)...) : nullptr;
+}
+
+template<class T>
+inline void RBTShardedMemoryAllocator::deallocate(T * const arg)
+{
+	if (arg)
+	{
+		arg->~T();
+		deallocate((void*)arg);
+	}
+}
+
+#include "RBTMemoryAllocatorImpl.h"
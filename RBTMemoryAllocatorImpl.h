@@ -0,0 +1,3111 @@
+#pragma once
+
+// Member definitions of BasicRBTMemoryAllocator, which RBTMemoryAllocator.h includes at its end. Don't include this file on its own.
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+template<class T, class Y>
+inline constexpr T* addPointers(T* const arg, const Y byHowMany)
+{
+	return (T*)(((uintptr_t)arg) + ((uintptr_t)byHowMany));
+}
+
+template<class T, class Y>
+inline constexpr T* subPointers(T* const arg, const Y byHowMany)
+{
+	return (T*)(((uintptr_t)arg) - ((uintptr_t)byHowMany));
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::getUsedMemory() const
+{
+	return usedMemory;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::getTotalMemory() const
+{
+	return totalMemory;
+}
+
+template<class Config>
+inline uint64_t BasicRBTMemoryAllocator<Config>::getAllocationsCount() const
+{
+	return allocations;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::Stats BasicRBTMemoryAllocator<Config>::getStats() const
+{
+	Stats result;
+	result.totalMemory = totalMemory;
+	result.usedMemory = usedMemory;
+	result.allocations = allocations;
+	result.failedAllocations = failedAllocations;
+	result.splits = splits;
+	result.coalesces = coalesces;
+	result.freeBlocks = freeBlocksCount;
+	result.freeMemory = freeBlocksMemory;
+	result.largestFreeBlock = largestFreeBlock;
+	result.fragmentation = result.freeMemory > 0 && result.largestFreeBlock <= result.freeMemory ? 1.0 - (double)result.largestFreeBlock / result.freeMemory : 0.0;
+	return result;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::HeapStats BasicRBTMemoryAllocator<Config>::getHeapStats() const
+{
+	std::lock_guard<Lock> lock(callLock);
+	HeapStats result;
+	static_cast<Stats&>(result) = getStats();
+	result.treeHeight = getTreeHeight(freeMemory); // 0 with the TLSF index, the tree is empty.
+
+	// Counted again, since with the TLSF index the counter may only be a bound.
+	SizeType largestFreeBlockSize = 0;
+	HeapWalker walker(*this);
+	BlockInfo block;
+	while (walker.next(block))
+	{
+		if (block.isFree && block.size > largestFreeBlockSize)
+		{
+			largestFreeBlockSize = block.size;
+		}
+		if (block.isFree || block.isDeferred)
+		{
+			++result.freeHistogram[getHistogramClass(block.size)];
+		}
+		else
+			if (block.isSlabPage)
+			{
+				const SlabPage* const page = (const SlabPage*)block.memory;
+				result.liveHistogram[getHistogramClass(getSlabClassSize(page->sizeClass))] += page->usedSlots;
+			}
+			else
+			{
+				++result.liveHistogram[getHistogramClass(block.size)];
+			}
+	}
+	if (Config::stats)
+	{
+		result.largestFreeBlock = largestFreeBlockSize;
+		result.fragmentation = result.freeMemory > 0 && result.largestFreeBlock <= result.freeMemory ? 1.0 - (double)result.largestFreeBlock / result.freeMemory : 0.0;
+	}
+
+	return result;
+}
+
+template<class Config>
+inline bool BasicRBTMemoryAllocator<Config>::isPointerInMemoryRange(_In_ const void * ptr) const
+{
+	return findRegion(ptr) != nullptr;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::getUsableSize(_In_ const void * ptr) const
+{
+	std::lock_guard<Lock> lock(callLock);
+	return calcUsableSize(ptr);
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::calcUsableSize(const void * ptr) const
+{
+	const SlabPage* page = findSlabPage(ptr);
+	if (page)
+	{
+		return getSlabClassSize(page->sizeClass);
+	}
+
+	return calcSize((const ClaimedHeader*)subPointers(ptr, sizeof(ClaimedHeader))) - sizeof(ClaimedHeader);
+}
+
+template<class Config>
+inline std::mutex & BasicRBTMemoryAllocator<Config>::getMutex()
+{
+	return mutex;
+}
+
+template<class Config>
+inline unsigned int BasicRBTMemoryAllocator<Config>::dbgCalcTreeNodesCount() const
+{
+	unsigned int count = 0;
+	if (freeIndex == FreeIndex::Tlsf)
+	{
+		for (uint32_t bitmap : tlsfSecondLevelBitmaps)
+		{
+			for (; bitmap; bitmap &= bitmap - 1)
+			{
+				++count;
+			}
+		}
+
+		return count;
+	}
+
+	FreeHeader* node = freeMemory;
+	while (node && node->left)
+	{
+		node = node->left;
+	}
+
+	for (; node; node = getSuccessor(node))
+	{
+		++count;
+	}
+
+	return count;
+}
+
+template<class Config>
+inline unsigned int BasicRBTMemoryAllocator<Config>::dbgCheckFreeTreeSanity() const
+{
+	return freeIndex == FreeIndex::Tlsf ? dbgCheckTlsfSanity() : dbgCheckRBTreeSanity();
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::dbgCheckSanity() const
+{
+	const unsigned int error = dbgCheckFreeTreeSanity();
+	if (error)
+	{
+		throw RBTMemoryAllocatorError(error);
+	}
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::insertFreeBlock(FreeHeader * block)
+{
+	const SizeType size = calcSize(block);
+	++freeBlocksCount;
+	freeBlocksMemory += size;
+	if (size > largestFreeBlock)
+	{
+		largestFreeBlock = size;
+	}
+
+	if (freeIndex == FreeIndex::Tlsf)
+	{
+		insertToTlsf(block);
+		if (Config::stats)
+		{
+			// The highest list may now tell more than the old value, e.g. when it holds just this block.
+			const SizeType bound = findLargestFreeBlockSize();
+			if (bound < largestFreeBlock)
+			{
+				largestFreeBlock = bound;
+			}
+		}
+	}
+	else
+	{
+		insertToRBTree(block);
+	}
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::removeFreeBlock(FreeHeader * block)
+{
+	if (!block)
+	{
+		return;
+	}
+
+	const SizeType blockSize = calcSize(block);
+	--freeBlocksCount;
+	freeBlocksMemory -= blockSize;
+
+	if (freeIndex == FreeIndex::Tlsf)
+	{
+		unlinkFromTlsf(block);
+
+		if (Config::stats)
+		{
+			// Both the old value (unless this block was it) and the bound of the highest list hold, so the lower one is kept. Two bitmap scans, so always done.
+			const SizeType bound = findLargestFreeBlockSize();
+			if (blockSize >= largestFreeBlock || bound < largestFreeBlock)
+			{
+				largestFreeBlock = bound;
+			}
+		}
+		return;
+	}
+
+	const bool isLastOfSize = !isChained(block) && !block->sameSize;
+	unlinkFromRBTree(block);
+
+	if (isLastOfSize && blockSize == largestFreeBlock)
+	{
+		largestFreeBlock = findLargestFreeBlockSize();
+	}
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::findLargestFreeBlockSize() const
+{
+	if (freeIndex == FreeIndex::Tlsf)
+	{
+		if (!tlsfFirstLevelBitmap)
+		{
+			return 0;
+		}
+
+		// The highest non-empty list holds it, but lists aren't sorted, so only the end of the list's range is known in O(1).
+		// Unless the list holds a single block, or it's a linear one: sizes are multiples of usedAlignment, so all its blocks have the same size.
+		const unsigned int firstLevel = findLastSet(tlsfFirstLevelBitmap), secondLevel = findLastSet(tlsfSecondLevelBitmaps[firstLevel]);
+		const FreeHeader* const head = tlsfLists[firstLevel][secondLevel];
+		if (firstLevel == 0 || !head->right)
+		{
+			return calcSize(head);
+		}
+
+		const unsigned int log2 = firstLevel + findLastSet(tlsfLinearSize) - 1;
+		return (((SizeType)(tlsfSecondLevelsCount + secondLevel + 1)) << (log2 - tlsfSecondLevelLog2)) - usedAlignment;
+	}
+
+	// The rightmost node holds the largest size.
+	const FreeHeader* largest = freeMemory;
+	while (largest && largest->right)
+	{
+		largest = largest->right;
+	}
+
+	return largest ? calcSize(largest) : 0;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::insertToTlsf(FreeHeader * block)
+{
+	unsigned int firstLevel, secondLevel;
+	mapToTlsfList(calcSize(block), firstLevel, secondLevel);
+
+	FreeHeader*& head = tlsfLists[firstLevel][secondLevel];
+	block->left = block->parent = block->sameSize = nullptr;
+	block->right = head;
+	if (head)
+	{
+		head->left = block;
+	}
+	head = block;
+
+	tlsfFirstLevelBitmap |= (SizeType)1 << firstLevel;
+	tlsfSecondLevelBitmaps[firstLevel] |= 1u << secondLevel;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::unlinkFromTlsf(FreeHeader * block)
+{
+	FreeHeader* const prev = block->left, *const next = block->right;
+	if (next)
+	{
+		next->left = prev;
+	}
+	if (prev)
+	{
+		prev->right = next;
+		return;
+	}
+
+	// It was the head, so the list may be empty now.
+	unsigned int firstLevel, secondLevel;
+	mapToTlsfList(calcSize(block), firstLevel, secondLevel);
+	tlsfLists[firstLevel][secondLevel] = next;
+	if (!next)
+	{
+		tlsfSecondLevelBitmaps[firstLevel] &= ~(1u << secondLevel);
+		if (!tlsfSecondLevelBitmaps[firstLevel])
+		{
+			tlsfFirstLevelBitmap &= ~((SizeType)1 << firstLevel);
+		}
+	}
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::FreeHeader * BasicRBTMemoryAllocator<Config>::findTlsfList(unsigned int firstLevel, unsigned int secondLevel) const
+{
+	if (secondLevel >= tlsfSecondLevelsCount)
+	{
+		++firstLevel;
+		secondLevel = 0;
+	}
+	if (firstLevel >= tlsfFirstLevelsCount)
+	{
+		return nullptr;
+	}
+
+	uint32_t secondLevelMap = tlsfSecondLevelBitmaps[firstLevel] & (~0u << secondLevel);
+	if (!secondLevelMap)
+	{
+		// The smallest list of the next first level that has any.
+		const SizeType firstLevelMap = tlsfFirstLevelBitmap & (~(SizeType)0 << (firstLevel + 1));
+		if (!firstLevelMap)
+		{
+			return nullptr;
+		}
+		firstLevel = findFirstSet(firstLevelMap);
+		secondLevelMap = tlsfSecondLevelBitmaps[firstLevel];
+	}
+
+	return tlsfLists[firstLevel][findFirstSet(secondLevelMap)];
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::FreeHeader * BasicRBTMemoryAllocator<Config>::findFittingBlockInTlsf(const SizeType size, const SizeType alignment, FittingBlockData& outputFittingBlock) const
+{
+	// The same bounds as for the tree: blocks of at least guaranteedSize always fit, smaller ones down to minBlockSize depend on their address.
+	const SizeType minBlockSize = getRequiredBlockSize(size), guaranteedSize = getGuaranteedFitSize(size, alignment);
+
+	// The list minBlockSize falls in holds smaller blocks too, so only a few of them are checked.
+	unsigned int firstLevel, secondLevel;
+	mapToTlsfList(minBlockSize, firstLevel, secondLevel);
+	unsigned int checked = 0;
+	for (FreeHeader* candidate = tlsfLists[firstLevel][secondLevel]; candidate && checked < tlsfListCandidates; candidate = candidate->right, ++checked)
+	{
+		if (isBlockFitting(candidate, size, alignment, outputFittingBlock))
+		{
+			return candidate;
+		}
+	}
+
+	// Every block of the lists above is big enough, but it may lack room for the padding. Every block past guaranteedSize's list has it.
+	FreeHeader* block = findTlsfList(firstLevel, secondLevel + 1);
+	if (block && !isBlockFitting(block, size, alignment, outputFittingBlock))
+	{
+		mapToTlsfList(guaranteedSize, firstLevel, secondLevel);
+		block = findTlsfList(firstLevel, secondLevel + 1);
+		if (block && !isBlockFitting(block, size, alignment, outputFittingBlock))
+		{
+			block = nullptr;
+		}
+	}
+
+	return block;
+}
+
+template<class Config>
+inline unsigned int BasicRBTMemoryAllocator<Config>::dbgCheckTlsfSanity() const
+{
+	uint64_t count = 0;
+
+	for (unsigned int firstLevel = 0; firstLevel < tlsfFirstLevelsCount; ++firstLevel)
+	{
+		for (unsigned int secondLevel = 0; secondLevel < tlsfSecondLevelsCount; ++secondLevel)
+		{
+			const FreeHeader* const head = tlsfLists[firstLevel][secondLevel];
+			if ((((tlsfSecondLevelBitmaps[firstLevel] >> secondLevel) & 1) != 0) != (head != nullptr))
+			{
+				return 12;
+			}
+			if (head && head->left)
+			{
+				return 11;
+			}
+
+			for (const FreeHeader* block = head; block; block = block->right)
+			{
+				unsigned int blockFirstLevel, blockSecondLevel;
+				mapToTlsfList(calcSize(block), blockFirstLevel, blockSecondLevel);
+				if (blockFirstLevel != firstLevel || blockSecondLevel != secondLevel || (block->right && block->right->left != block))
+				{
+					return 11;
+				}
+				++count;
+			}
+		}
+
+		if ((((tlsfFirstLevelBitmap >> firstLevel) & 1) != 0) != (tlsfSecondLevelBitmaps[firstLevel] != 0))
+		{
+			return 12;
+		}
+	}
+
+	return !Config::stats || count == freeBlocksCount ? 0 : 11;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::unlinkFromRBTree(FreeHeader * block)
+{
+	using std::swap;
+
+	// Same size blocks: unlink from the chain, or let the next one in the chain take the node's place.
+	if (isChained(block))
+	{
+		FreeHeader* const prevInChain = (FreeHeader*)cleanAddress(block->parent);
+		prevInChain->sameSize = block->sameSize;
+		if (block->sameSize)
+		{
+			block->sameSize->parent = setChained(prevInChain);
+		}
+		return;
+	}
+	if (block->sameSize)
+	{
+		FreeHeader* const replacement = block->sameSize;
+		if (replacement->sameSize)
+		{
+			replacement->sameSize->parent = setChained(replacement);
+		}
+
+		replacement->left = block->left;
+		replacement->right = block->right;
+		replacement->parent = block->parent; // Also the redness.
+		if (replacement->left)
+		{
+			replacement->left->parent = setRedness(replacement, checkRedness(replacement->left->parent));
+		}
+		if (replacement->right)
+		{
+			replacement->right->parent = setRedness(replacement, checkRedness(replacement->right->parent));
+		}
+
+		FreeHeader* const parent = (FreeHeader*)cleanAddress(block->parent);
+		if (parent)
+		{
+			(parent->left == block ? parent->left : parent->right) = replacement;
+		}
+		else
+		{
+			freeMemory = replacement;
+		}
+		return;
+	}
+
+	bool childRed = true, toRemoveRed = checkRedness(block->parent);
+	FreeHeader* replacement = nullptr, *replaceParent = nullptr;
+
+	if (block->left && block->right)
+	{
+		// Two children.
+		FreeHeader* succ = block->right;
+
+		while (succ->left)
+		{
+			succ = succ->left;
+		}
+
+		Link<FreeHeader> tempGarbage = nullptr;
+		Link<FreeHeader>& toRemoveInParent = cleanAddress(block->parent) ? (((FreeHeader*)cleanAddress(block->parent))->left == block ? ((FreeHeader*)cleanAddress(block->parent))->left : ((FreeHeader*)cleanAddress(block->parent))->right) : tempGarbage;
+
+		if (succ == block->right)
+		{
+			succ->left = block->left;
+			block->left->parent = setRedness(succ, checkRedness(block->left->parent));
+			block->left = nullptr;
+
+			const bool tempRed = checkRedness(succ->parent);
+			succ->parent = block->parent;
+			toRemoveInParent = succ;
+			block->parent = setRedness(succ, tempRed);
+
+			block->right = succ->right;
+			succ->right = block;
+			if (block->right)
+			{
+				block->right->parent = setRedness(block, checkRedness(block->right->parent));
+			}
+		}
+		else
+		{
+			Link<FreeHeader>& succInParent = ((FreeHeader*)cleanAddress(succ->parent))->left == succ ? ((FreeHeader*)cleanAddress(succ->parent))->left : ((FreeHeader*)cleanAddress(succ->parent))->right;
+
+			block->left->parent = setRedness(succ, checkRedness(block->left->parent));
+			block->right->parent = setRedness(succ, checkRedness(block->right->parent));
+			if (succ->right)
+			{
+				succ->right->parent = setRedness(block, checkRedness(succ->right->parent));
+			}
+
+			swap(block->left, succ->left);
+			swap(block->right, succ->right);
+			swap(block->parent, succ->parent); // Also the reddness is swaped.
+
+			toRemoveInParent = succ;
+			succInParent = block;
+		}
+
+		if (block == freeMemory)
+		{
+			freeMemory = succ;
+		}
+
+		unlinkFromRBTree(block);
+		return;
+	}
+	else
+		if (block->left || block->right)
+		{
+			// One child.
+			FreeHeader* child = block->left ? block->left : block->right;
+			replacement = child;
+
+			if (block == freeMemory)
+			{
+				// No parent.
+				freeMemory = child;
+			}
+			else
+			{
+				Link<FreeHeader>& toRemoveInParent = ((FreeHeader*)cleanAddress(block->parent))->left == block ? ((FreeHeader*)cleanAddress(block->parent))->left : ((FreeHeader*)cleanAddress(block->parent))->right;
+				toRemoveInParent = child;
+			}
+
+			child->parent = setRedness(block->parent, checkRedness(child->parent));
+		}
+		else
+		{
+			// An orphan.
+			if (block == freeMemory)
+			{
+				freeMemory = nullptr;
+				return;
+			}
+			else
+			{
+				Link<FreeHeader>& toRemoveInParent = ((FreeHeader*)cleanAddress(block->parent))->left == block ? ((FreeHeader*)cleanAddress(block->parent))->left : ((FreeHeader*)cleanAddress(block->parent))->right;
+				toRemoveInParent = nullptr;
+			}
+		}
+
+	replaceParent = (FreeHeader*)cleanAddress(block->parent);
+	childRed = replacement ? checkRedness(replacement->parent) : false;
+
+	if (childRed || toRemoveRed)
+	{
+		if (replacement)
+		{
+			replacement->parent = setRedness(replacement->parent, false);
+		}
+	}
+	else
+	{
+		// Double black.
+		FreeHeader* doubleBlack = replacement, *dbParent = replaceParent, *sibling = doubleBlack;
+		Link<FreeHeader> tempGarbage = nullptr;
+
+		while (doubleBlack != freeMemory)
+		{
+			sibling = dbParent->left == doubleBlack ? dbParent->right : dbParent->left;
+
+			if (!getRed(sibling))
+			{
+				if (sibling && (getRed(sibling->left) || getRed(sibling->right)))
+				{
+					FreeHeader* redNode = getRed(sibling->left) ? sibling->left : sibling->right;
+					Link<FreeHeader>& dbParentInParent = cleanAddress(dbParent->parent) ? (((FreeHeader*)cleanAddress(dbParent->parent))->left == dbParent ? ((FreeHeader*)cleanAddress(dbParent->parent))->left : ((FreeHeader*)cleanAddress(dbParent->parent))->right) : tempGarbage;
+
+					// https://www.geeksforgeeks.org/red-black-tree-set-3-delete-2/
+					if (dbParent->left == sibling)
+					{
+						if (sibling->left == redNode)
+						{
+							// Left left.
+							// Mirror of right right.
+							dbParent->left = sibling->right;
+							if (sibling->right)
+							{
+								sibling->right->parent = setRedness(dbParent, checkRedness(sibling->right->parent));
+							}
+							sibling->right = dbParent;
+							const bool tempRed = checkRedness(sibling->parent);
+							sibling->parent = dbParent->parent;
+							dbParent->parent = setRedness(sibling, tempRed);
+							dbParentInParent = sibling;
+							sibling->left->parent = setRedness(sibling, false);
+
+							if (sibling->parent == nullptr)
+							{
+								freeMemory = sibling;
+							}
+						}
+						else
+						{
+							// Left right.
+							// First rotation.
+							FreeHeader* thing = sibling->right;
+							sibling->right = thing->left;
+							if (sibling->right)
+							{
+								sibling->right->parent = setRedness(sibling, checkRedness(sibling->right->parent));
+							}
+							thing->left = sibling;
+							thing->parent = setRedness(dbParent, false);
+							(dbParent->left == sibling ? dbParent->left : dbParent->right) = thing;
+							sibling->parent = setRedness(thing, false);
+
+							// Second rotation.
+							thing->parent = dbParent->parent;
+							dbParentInParent = thing;
+							dbParent->parent = setRedness(thing, false);
+							dbParent->left = thing->right;
+							if (dbParent->left)
+							{
+								dbParent->left->parent = setRedness(dbParent, checkRedness(dbParent->left->parent));
+							}
+							thing->right = dbParent;
+
+							if (thing->parent == nullptr)
+							{
+								freeMemory = thing;
+							}
+						}
+					}
+					else
+					{
+						if (sibling->right == redNode || getRed(sibling->right))
+						{
+							// Right right.
+							dbParent->right = sibling->left;
+							if (sibling->left)
+							{
+								sibling->left->parent = setRedness(dbParent, checkRedness(sibling->left->parent));
+							}
+							sibling->left = dbParent;
+							const bool tempRed = checkRedness(sibling->parent);
+							sibling->parent = dbParent->parent;
+							dbParent->parent = setRedness(sibling, tempRed);
+							dbParentInParent = sibling;
+							sibling->right->parent = setRedness(sibling, false);
+
+							if (sibling->parent == nullptr)
+							{
+								freeMemory = sibling;
+							}
+						}
+						else
+						{
+							// Right left.
+							// First rotation.
+							FreeHeader* thing = sibling->left;
+							sibling->left = thing->right;
+							if (sibling->left)
+							{
+								sibling->left->parent = setRedness(sibling, checkRedness(sibling->left->parent));
+							}
+							thing->right = sibling;
+							thing->parent = setRedness(dbParent, false);
+							(dbParent->left == sibling ? dbParent->left : dbParent->right) = thing;
+							sibling->parent = setRedness(thing, false);
+
+							// Second rotation.
+							thing->parent = dbParent->parent;
+							dbParentInParent = thing;
+							dbParent->parent = setRedness(thing, false);
+							dbParent->right = thing->left;
+							if (dbParent->right)
+							{
+								dbParent->right->parent = setRedness(dbParent, checkRedness(dbParent->right->parent));
+							}
+							thing->left = dbParent;
+
+							if (thing->parent == nullptr)
+							{
+								freeMemory = thing;
+							}
+						}
+					}
+
+					// Restructurization done, no two consecutive reds principle restored.
+					break;
+				}
+				else
+				{
+					// Both are black.
+					if (sibling)
+					{
+						sibling->parent = setRedness(sibling->parent, true);
+					}
+					if (checkRedness(dbParent->parent))
+					{
+						// We can color red parent to black, and therefore, stop the recursion.
+						dbParent->parent = setRedness(dbParent->parent, false);
+						break;
+					}
+					doubleBlack = dbParent;
+					dbParent = (FreeHeader*)cleanAddress(doubleBlack->parent);
+				}
+			}
+			else
+			{
+				Link<FreeHeader>& dbParentInParent = cleanAddress(dbParent->parent) ? ((FreeHeader*)cleanAddress(dbParent->parent))->left == dbParent ? ((FreeHeader*)cleanAddress(dbParent->parent))->left : ((FreeHeader*)cleanAddress(dbParent->parent))->right : tempGarbage;
+
+				// Sibling is red.
+				if (((FreeHeader*)cleanAddress(sibling->parent))->right == sibling)
+				{
+					// Right rotate.
+					dbParent->right = sibling->left;
+					if (sibling->left)
+					{
+						sibling->left->parent = setRedness(dbParent, checkRedness(sibling->left->parent));
+					}
+					sibling->left = dbParent;
+					const bool tempRed = checkRedness(sibling->parent);
+					sibling->parent = dbParent->parent;
+					dbParent->parent = setRedness(sibling, tempRed);
+					dbParentInParent = sibling;
+					sibling->right->parent = setRedness(sibling, false);
+				}
+				else
+				{
+					// Left rotate.
+					dbParent->left = sibling->right;
+					if (sibling->right)
+					{
+						sibling->right->parent = setRedness(dbParent, checkRedness(sibling->right->parent));
+					}
+					sibling->right = dbParent;
+					const bool tempRed = checkRedness(sibling->parent);
+					sibling->parent = dbParent->parent;
+					dbParent->parent = setRedness(sibling, tempRed);
+					dbParentInParent = sibling;
+					sibling->left->parent = setRedness(sibling, false);
+				}
+
+				if (sibling->parent == nullptr)
+				{
+					freeMemory = sibling;
+				}
+			}
+		}
+	}
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::insertToRBTree(FreeHeader * block)
+{
+	block->left = block->right = block->sameSize = nullptr;
+
+	if (freeMemory == nullptr)
+	{
+		freeMemory = block;
+		freeMemory->parent = setRedness(nullptr, false);
+		return;
+	}
+
+	FreeHeader* ptr = freeMemory;
+	const SizeType blockSize = calcSize(block);
+
+	while (true)
+	{
+		const SizeType ptrSize = calcSize(ptr);
+		if (blockSize == ptrSize)
+		{
+			// The size is already in the tree, just chain the block after its node.
+			block->sameSize = ptr->sameSize;
+			if (block->sameSize)
+			{
+				block->sameSize->parent = setChained(block);
+			}
+			block->parent = setChained(ptr);
+			ptr->sameSize = block;
+			return;
+		}
+		else
+		if (blockSize < ptrSize)
+		{
+			if (ptr->left)
+			{
+				ptr = ptr->left;
+			}
+			else
+			{
+				ptr->left = block;
+				block->parent = setRedness(ptr, true);
+				ptr = block;
+				break;
+			}
+		}
+		else
+		{
+			if (ptr->right)
+			{
+				ptr = ptr->right;
+			}
+			else
+			{
+				ptr->right = block;
+				block->parent = setRedness(ptr, true);
+				ptr = block;
+				break;
+			}
+		}
+	}
+
+	while (true)
+	{
+		if (ptr == freeMemory)
+		{
+			ptr->parent = setRedness(ptr->parent, false);
+		}
+		else
+			if (getRed((FreeHeader*)cleanAddress(ptr->parent)))
+			{
+				// Recolor the tree.
+				FreeHeader* parent = (FreeHeader*)cleanAddress(ptr->parent), *grandparent = (FreeHeader*)cleanAddress(parent->parent);
+
+				if (!grandparent)
+				{
+					break;;
+				}
+
+				FreeHeader* uncle = grandparent->left == parent ? grandparent->right : grandparent->left;
+
+				if (getRed(uncle))
+				{
+					parent->parent = setRedness(parent->parent, false);
+					uncle->parent = setRedness(uncle->parent, false);
+					grandparent->parent = setRedness(grandparent->parent, true);
+
+					ptr = grandparent;
+					continue;
+				}
+				else
+				{
+					auto leftLeft = [this](FreeHeader* ptr, FreeHeader* parent, FreeHeader* grandparent)
+					{
+						grandparent->left = parent->right;
+						if (grandparent->left)
+						{
+							grandparent->left->parent = setRedness(grandparent, checkRedness(grandparent->left->parent));
+						}
+
+						const bool tempRed = checkRedness(parent->parent);
+						parent->parent = grandparent->parent;
+						if (cleanAddress(parent->parent))
+						{
+							(((FreeHeader*)cleanAddress(parent->parent))->left == grandparent ? ((FreeHeader*)cleanAddress(parent->parent))->left : ((FreeHeader*)cleanAddress(parent->parent))->right) = parent;
+						}
+						else
+						{
+							freeMemory = parent;
+						}
+						grandparent->parent = setRedness(parent, tempRed);
+
+						parent->right = grandparent;
+					};
+					auto rightRight = [this](FreeHeader* ptr, FreeHeader* parent, FreeHeader* grandparent)
+					{
+						grandparent->right = parent->left;
+						if (grandparent->right)
+						{
+							grandparent->right->parent = setRedness(grandparent, checkRedness(grandparent->right->parent));
+						}
+
+						const bool tempRed = checkRedness(parent->parent);
+						parent->parent = grandparent->parent;
+						if (cleanAddress(parent->parent))
+						{
+							(((FreeHeader*)cleanAddress(parent->parent))->left == grandparent ? ((FreeHeader*)cleanAddress(parent->parent))->left : ((FreeHeader*)cleanAddress(parent->parent))->right) = parent;
+						}
+						else
+						{
+							freeMemory = parent;
+						}
+						grandparent->parent = setRedness(parent, tempRed);
+
+						parent->left = grandparent;
+					};
+
+					if (grandparent && parent == grandparent->left)
+					{
+						if (ptr == parent->left)
+						{
+							// Left left.
+							leftLeft(ptr, parent, grandparent);
+						}
+						else
+						{
+							// Left right.
+							parent->right = ptr->left;
+							if (parent->right)
+							{
+								parent->right->parent = setRedness(parent, checkRedness(parent->right->parent));
+							}
+							ptr->left = parent;
+							ptr->parent = setRedness(grandparent, checkRedness(ptr->parent));
+							parent->parent = setRedness(ptr, checkRedness(parent->parent));
+							(grandparent->left == parent ? grandparent->left : grandparent->right) = ptr;
+							leftLeft(parent, ptr, grandparent);
+						}
+					}
+					else
+					{
+						if (ptr == parent->left)
+						{
+							// Right left.
+							parent->left = ptr->right;
+							if (parent->left)
+							{
+								parent->left->parent = setRedness(parent, checkRedness(parent->left->parent));
+							}
+							ptr->right = parent;
+							ptr->parent = setRedness(grandparent, checkRedness(ptr->parent));
+							parent->parent = setRedness(ptr, checkRedness(parent->parent));
+							if (grandparent)
+							{
+								(grandparent->left == parent ? grandparent->left : grandparent->right) = ptr;
+							}
+							rightRight(parent, ptr, grandparent);
+						}
+						else
+						{
+							// Right right.
+							rightRight(ptr, parent, grandparent);
+						}
+					}
+
+					// Restructurization complete.
+				}
+			}
+		break;
+	}
+}
+
+template<class Config>
+inline bool BasicRBTMemoryAllocator<Config>::isBlockFitting(FreeHeader * block, const SizeType reqSize, const SizeType alignment, FittingBlockData& outputData, TaggedBlocks) const
+{
+	// The block before a free one is always claimed and can't be found without prev links, so any padding in front has to become a free block.
+	const SizeType blockSize = getRequiredBlockSize(reqSize), space = calcSize(block);
+	const uintptr_t payload = ((uintptr_t)block) + sizeof(ClaimedHeader);
+	SizeType adjustment = (alignment - (payload % alignment)) % alignment;
+	if (adjustment != 0 && adjustment < minFreeBlockSize)
+	{
+		adjustment += (minFreeBlockSize - adjustment + alignment - 1) / alignment * alignment;
+	}
+	if (adjustment > space || blockSize > space - adjustment)
+	{
+		return false;
+	}
+
+	outputData.adjustment = adjustment;
+	outputData.usableMemory = (ClaimedHeader*)addPointers(block, adjustment);
+	outputData.remainingMemory = space - adjustment - blockSize;
+	outputData.usedMemory = blockSize - sizeof(ClaimedHeader);
+
+	return true;
+}
+
+template<class Config>
+inline bool BasicRBTMemoryAllocator<Config>::isBlockFitting(FreeHeader * block, const SizeType reqSize, const SizeType alignment, FittingBlockData& outputData, LinkedBlocks) const
+{
+	void* ptr = addPointers(block, sizeof(ClaimedHeader));
+	SizeType space = calcSize(block) - sizeof(ClaimedHeader);
+	const SizeType startingSpace = space;
+	FittingBlockData& result = outputData;
+
+	const SizeType requiredSize = ((reqSize % usedAlignment) == 0) ? reqSize : reqSize + (usedAlignment - (reqSize % usedAlignment));
+
+	// We don't check if it's possible to attach any remaining memory to existing block. Also we don't check if it's possible to create new free block out of remaining memory.
+	// That's because remaining memory, assuming we're unable to allocate new free blocks out of it, is attached to already existing claimed blocks.
+	// There is only one case to check - whether prev is nullptr.
+	if (block->prev == nullptr)
+	{
+		if (space >= sizeof(FreeHeader))
+		{
+			space -= sizeof(FreeHeader);
+			ptr = addPointers(ptr, sizeof(FreeHeader));
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	if (!std::align(alignment, requiredSize, ptr, space))
+	{
+		return false;
+	}
+
+	result.adjustment = ((SizeType)subPointers(ptr, block)) - sizeof(ClaimedHeader);
+	result.usableMemory = (ClaimedHeader*)subPointers(ptr, sizeof(ClaimedHeader));
+	result.remainingMemory = startingSpace - result.adjustment - requiredSize;
+	result.usedMemory = requiredSize;
+
+	return true;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::FreeHeader * BasicRBTMemoryAllocator<Config>::findLowerBound(const SizeType blockSize) const
+{
+	FreeHeader* searchNode = freeMemory, *result = nullptr;
+
+	// Equal sizes go to the right, so this finds the first of them in order.
+	while (searchNode)
+	{
+		if (calcSize(searchNode) >= blockSize)
+		{
+			result = searchNode;
+			searchNode = searchNode->left;
+		}
+		else
+		{
+			searchNode = searchNode->right;
+		}
+	}
+
+	return result;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::FreeHeader * BasicRBTMemoryAllocator<Config>::getSuccessor(FreeHeader * block)
+{
+	if (block->right)
+	{
+		block = block->right;
+		while (block->left)
+		{
+			block = block->left;
+		}
+		return block;
+	}
+
+	FreeHeader* parent = (FreeHeader*)cleanAddress(block->parent);
+	while (parent && parent->right == block)
+	{
+		block = parent;
+		parent = (FreeHeader*)cleanAddress(block->parent);
+	}
+
+	return parent;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::FreeHeader * BasicRBTMemoryAllocator<Config>::findFittingBlockInRBTree(const SizeType size, const SizeType alignment, FittingBlockData& outputFittingBlock) const
+{
+	// Blocks smaller than minBlockSize can't fit. Blocks of at least guaranteedSize always fit.
+	// Whether the blocks in between fit depends on their addresses, so they're checked smallest first, and the first one that fits is the best.
+	// At most rbtreeChainCandidates blocks of each size are checked, and there are at most alignment / usedAlignment sizes in between, so the
+	// search takes O(log n + alignment / usedAlignment * rbtreeChainCandidates). It misses the best fit only if more blocks of its size come first
+	// that don't fit. Without extra alignment only the first block of a region can fail, so the first or second candidate is usually taken.
+	const SizeType minBlockSize = getRequiredBlockSize(size), guaranteedSize = getGuaranteedFitSize(size, alignment);
+
+	FreeHeader* node = findLowerBound(minBlockSize);
+	while (node && calcSize(node) < guaranteedSize)
+	{
+		unsigned int checked = 0;
+		for (FreeHeader* candidate = node; candidate && checked < rbtreeChainCandidates; candidate = candidate->sameSize, ++checked)
+		{
+			if (isBlockFitting(candidate, size, alignment, outputFittingBlock))
+			{
+				return candidate;
+			}
+		}
+
+		node = getSuccessor(node);
+	}
+
+	if (node && isBlockFitting(node, size, alignment, outputFittingBlock))
+	{
+		return node;
+	}
+
+	return nullptr;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::FreeHeader * BasicRBTMemoryAllocator<Config>::findFittingBlock(const SizeType size, const SizeType alignment, FittingBlockData& outputFittingBlock) const
+{
+	return freeIndex == FreeIndex::Tlsf ? findFittingBlockInTlsf(size, alignment, outputFittingBlock) : findFittingBlockInRBTree(size, alignment, outputFittingBlock);
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::dbgGetFittingBlockSize(_In_ const SizeType howMany, _In_opt_ const SizeType alignment) const
+{
+	FittingBlockData data;
+	const FreeHeader* block = findFittingBlock(howMany >= sizeof(FreeHeader) - sizeof(ClaimedHeader) ? howMany : sizeof(FreeHeader) - sizeof(ClaimedHeader), alignment, data);
+	return block ? calcSize(block) : 0;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::dbgGetBestFittingBlockSize(_In_ const SizeType howMany, _In_opt_ const SizeType alignment) const
+{
+	const SizeType size = howMany >= sizeof(FreeHeader) - sizeof(ClaimedHeader) ? howMany : sizeof(FreeHeader) - sizeof(ClaimedHeader);
+	SizeType result = 0;
+	FittingBlockData data;
+
+	for (Region* region = regions.load(std::memory_order_acquire); region; region = region->next)
+	{
+		for (ClaimedHeader* search = region->begin; search != region->end; search = getNextBlock(search))
+		{
+			if (isBlockFree(search) && (result == 0 || calcSize(search) < result) && isBlockFitting((FreeHeader*)search, size, alignment, data))
+			{
+				result = calcSize(search);
+			}
+		}
+	}
+
+	return result;
+}
+
+template<class Config>
+inline unsigned int BasicRBTMemoryAllocator<Config>::dbgCheckFittingBlock(const FreeHeader * block, const SizeType size, const SizeType alignment) const
+{
+	// The tree returns the best fit, unless more than rbtreeChainCandidates blocks have its size. TLSF may skip blocks that fit only at some addresses,
+	// but not the smallest one that surely fits: it returns a block of that one's list or of a lower one. Either may do the same when the tree
+	// skips part of a chain. Blocks are ranked the way the index orders them: by size, or by list for TLSF.
+	const bool isTlsf = freeIndex == FreeIndex::Tlsf;
+	const auto getRank = [isTlsf](const SizeType blockSize) -> SizeType
+	{
+		if (!isTlsf)
+		{
+			return blockSize;
+		}
+		unsigned int firstLevel, secondLevel;
+		mapToTlsfList(blockSize, firstLevel, secondLevel);
+		return ((SizeType)firstLevel) * tlsfSecondLevelsCount + secondLevel;
+	};
+	const SizeType guaranteedSize = getGuaranteedFitSize(size, alignment), guaranteedRank = getRank(guaranteedSize);
+	SizeType bestFitSize = 0, surelyFittingRank = (SizeType)-1;
+	FittingBlockData data;
+
+	for (Region* region = regions.load(std::memory_order_acquire); region; region = region->next)
+	{
+		for (ClaimedHeader* search = region->begin; search != region->end; search = getNextBlock(search))
+		{
+			if (!isBlockFree(search))
+			{
+				continue;
+			}
+
+			const SizeType blockSize = calcSize(search), rank = getRank(blockSize);
+			if ((bestFitSize == 0 || blockSize < bestFitSize) && isBlockFitting((FreeHeader*)search, size, alignment, data))
+			{
+				bestFitSize = blockSize;
+			}
+			const bool isSurelyTaken = isTlsf ? rank > guaranteedRank : blockSize >= guaranteedSize; // The lists past guaranteedSize's one are the ones TLSF jumps to.
+			if (isSurelyTaken && rank < surelyFittingRank)
+			{
+				surelyFittingRank = rank;
+			}
+		}
+	}
+
+	// The tree can only miss the best fit if its chain is longer than the search goes.
+	const auto isChainCut = [this, bestFitSize]()
+	{
+		unsigned int count = 0;
+		for (Region* region = regions.load(std::memory_order_acquire); region; region = region->next)
+		{
+			for (ClaimedHeader* search = region->begin; search != region->end; search = getNextBlock(search))
+			{
+				count += isBlockFree(search) && calcSize(search) == bestFitSize ? 1 : 0;
+			}
+		}
+		return count > rbtreeChainCandidates;
+	};
+	const bool isGoodFit = isTlsf || (bestFitSize != 0 && (!block || calcSize(block) != bestFitSize) && isChainCut());
+	if (!block)
+	{
+		return (isGoodFit ? surelyFittingRank == (SizeType)-1 : bestFitSize == 0) ? 0 : 13;
+	}
+	if (!isBlockFitting((FreeHeader*)block, size, alignment, data) || calcSize(block) < bestFitSize || (isGoodFit ? getRank(calcSize(block)) > surelyFittingRank : calcSize(block) != bestFitSize))
+	{
+		return 13;
+	}
+
+	return 0;
+}
+
+template<class Config>
+inline unsigned int BasicRBTMemoryAllocator<Config>::dbgCheckRBTreeSanity() const
+{
+	unsigned int e = 0, count = 0;
+
+	Function<void(FreeHeader*, const Function<void(FreeHeader*)>&)> traverseBlock;
+	traverseBlock = [&e, &traverseBlock](FreeHeader* block, const Function<void(FreeHeader*)>& func)
+	{
+		if (!block)
+		{
+			return;
+		}
+
+		if (block->left == block)
+		{
+			e = 1;
+			throw 0;
+		}
+		if (block->right == block)
+		{
+			e = 2;
+			throw 0;
+		}
+		traverseBlock(block->left, func);
+		func(block);
+		traverseBlock(block->right, func);
+	};
+
+	if (getRed(freeMemory))
+	{
+		return 7;
+	}
+
+	if (freeMemory && (freeMemory->parent != nullptr))
+	{
+		return 8;
+	}
+
+	try
+	{
+		traverseBlock(freeMemory, [this, &e, &count](FreeHeader* block)
+		{
+			if (block->left)
+			{
+				if (cleanAddress(block->left->parent) != block)
+				{
+					e = 3;
+					throw 0;
+				}
+			}
+
+			if (block->right)
+			{
+				if (cleanAddress(block->right->parent) != block)
+				{
+					e = 4;
+					throw 0;
+				}
+			}
+
+			for (FreeHeader* chained = block->sameSize, *prevInChain = block; chained; prevInChain = chained, chained = chained->sameSize)
+			{
+				if (!isChained(chained) || cleanAddress(chained->parent) != prevInChain || calcSize(chained) != calcSize(block))
+				{
+					e = 9;
+					throw 0;
+				}
+			}
+
+			if (checkRedness(block->parent))
+			{
+				if (getRed(block->left) || getRed(block->right))
+				{
+					e = 5;
+					throw 0;
+				}
+			}
+
+			if ((block->left && !(block->right)) || (block->right && !(block->left)) || (!(block->left) && !(block->right)))
+			{
+				if (count != 0)
+				{
+					if (dbgGetBlackHeight(block) != count)
+					{
+						std::cout << "block's height: " << dbgGetBlackHeight(block) << " count: " << count << std::endl;
+						e = 6;
+						throw 0;
+					}
+				}
+				else
+				{
+					count = dbgGetBlackHeight(block);
+				}
+			}
+		});
+	}
+	catch (...)
+	{
+	}
+
+	return e;
+}
+
+template<class Config>
+inline unsigned int BasicRBTMemoryAllocator<Config>::getTreeHeight(const FreeHeader * const head)
+{
+	if (!head)
+	{
+		return 0;
+	}
+
+	const unsigned int left = getTreeHeight(head->left), right = getTreeHeight(head->right);
+	return (left > right ? left : right) + 1;
+}
+
+template<class Config>
+inline unsigned int BasicRBTMemoryAllocator<Config>::dbgGetBlackHeight(FreeHeader * const head) const
+{
+	FreeHeader* search = head;
+	unsigned int counter = 1;
+
+	while (search->parent)
+	{
+		if (!checkRedness(search->parent))
+		{
+			++counter;
+		}
+		search = (FreeHeader*)cleanAddress(search->parent);
+	}
+
+	return counter;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::dbgWriteAllBlocks() const
+{
+	std::cout << "Blocks dump:" << std::endl;
+
+	HeapWalker walker(*this);
+	BlockInfo block;
+	while (walker.next(block))
+	{
+		if (block.isFirstInRegion)
+		{
+			std::cout << "Region:" << std::endl;
+		}
+
+		if (block.isFree)
+		{
+			std::cout << "FreeHeader: ";
+		}
+		else
+		{
+			std::cout << "ClaimedHeader: ";
+		}
+		std::cout << block.size << std::endl;
+	}
+
+	std::cout << std::endl;
+}
+
+template<class Config>
+inline bool BasicRBTMemoryAllocator<Config>::dbgCheckListIntegrity() const
+{
+	for (Region* region = regions.load(std::memory_order_acquire); region; region = region->next)
+	{
+		ClaimedHeader* search = region->begin;
+
+		while (search != region->end)
+		{
+			if (!dbgCheckBlockLinks(search, region, Layout()))
+			{
+				return false;
+			}
+			search = getNextBlock(search);
+		}
+	}
+
+	return true;
+}
+
+template<class Config>
+inline bool BasicRBTMemoryAllocator<Config>::dbgCheckBlockLinks(const ClaimedHeader * block, const Region * region, TaggedBlocks) const
+{
+	// Sizes must lead exactly to the sentinel, free blocks need matching footers and can't be neighbours.
+	const ClaimedHeader* const next = getNextBlock(block);
+	if (calcSize(block) == 0 || next > region->end || isPrevBlockFree(next) != isBlockFree(block))
+	{
+		return false;
+	}
+	return !isBlockFree(block) || (!isBlockFree(next) && ((const SizeType*)next)[-1] == calcSize(block));
+}
+
+template<class Config>
+inline bool BasicRBTMemoryAllocator<Config>::dbgCheckBlockLinks(const ClaimedHeader * block, const Region *, LinkedBlocks) const
+{
+	return cleanAddress(cleanAddress(block->next)->prev) == block;
+}
+
+template<class Config>
+inline BasicRBTMemoryAllocator<Config>::BasicRBTMemoryAllocator(_In_ const SizeType memorySize)
+	: BasicRBTMemoryAllocator(getDefaultRegionSource(), memorySize)
+{
+}
+
+template<class Config>
+inline BasicRBTMemoryAllocator<Config>::BasicRBTMemoryAllocator(_In_ const RegionSource& source, _In_opt_ const SizeType memorySize)
+	: regions(nullptr), regionSource(source), growthSize(memorySize), totalMemory(0), usedMemory(0), dirtyMemory(0), purgeThreshold(0), allocations(0), failedAllocations(0), splits(0), coalesces(0), freeBlocksCount(0), freeBlocksMemory(0), largestFreeBlock(0), slabPages(), deferredFrees(), deferredFreesCount(0), deferredFreesCapacity(0), traceRecorder(nullptr)
+{
+	if (!grow(0, usedAlignment))
+	{
+		throw std::bad_alloc();
+	}
+}
+
+template<class Config>
+inline BasicRBTMemoryAllocator<Config>::BasicRBTMemoryAllocator(_In_ void* memoryToUse, _In_ const SizeType memorySize, _In_opt_ const bool isOwning)
+	: regions(nullptr), growthSize(0), totalMemory(0), usedMemory(0), dirtyMemory(0), purgeThreshold(0), allocations(0), failedAllocations(0), splits(0), coalesces(0), freeBlocksCount(0), freeBlocksMemory(0), largestFreeBlock(0), slabPages(), deferredFrees(), deferredFreesCount(0), deferredFreesCapacity(0), traceRecorder(nullptr)
+{
+	if (isOwning)
+	{
+		regionSource.release = getDefaultRegionSource().release;
+	}
+
+	if (!addRegion(memoryToUse, memorySize, isOwning))
+	{
+		throw std::bad_alloc();
+	}
+}
+
+template<class Config>
+inline BasicRBTMemoryAllocator<Config>::~BasicRBTMemoryAllocator()
+{
+	drainRemoteBlocks();
+	if (allocations > 0)
+	{
+		std::exit(1);
+	}
+
+	Region* region = regions.load(std::memory_order_acquire);
+	while (region)
+	{
+		// The header lives in the region, so it has to be read before the region goes away.
+		Region* const next = region->next;
+		if (region->isOwning && regionSource.release)
+		{
+			regionSource.release(region->memory, region->size);
+		}
+		region = next;
+	}
+}
+
+template<class Config>
+BasicRBTMemoryAllocator<Config> BasicRBTMemoryAllocator<Config>::instance;
+
+template<class Config>
+inline BasicRBTMemoryAllocator<Config> & BasicRBTMemoryAllocator<Config>::getProcessHeap()
+{
+	// Placement new into static storage: no destructor runs at exit, and nothing is left to allocate the heap itself.
+	// The mapped region source keeps no state, so constructing it allocates nothing either.
+	alignas(BasicRBTMemoryAllocator) static unsigned char storage[sizeof(BasicRBTMemoryAllocator)];
+	static BasicRBTMemoryAllocator* const heap = new (storage) BasicRBTMemoryAllocator(getMappedRegionSource(), 8 * MegaByte);
+	return *heap;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::getRegionPageSize(_In_ const void * ptr) const
+{
+	const Region* region = findRegion(ptr);
+	if (!region)
+	{
+		return 0;
+	}
+
+	return region->isOwning && regionSource.pageSize ? regionSource.pageSize(region->memory, region->size) : getPageSize();
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::trim()
+{
+	std::lock_guard<Lock> lock(callLock);
+	return purgeRegions();
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::purgeRegions()
+{
+	drainRemoteBlocks();
+	flushDeferredFrees();
+
+	// The empty pages kept for the next slot go too, so their pages can be purged. Releasing one may trim on its own, so every list is read again from its head.
+	for (SizeType sizeClass = 0; sizeClass < slabClassesCount; ++sizeClass)
+	{
+		for (SlabPage* page = slabPages[sizeClass]; page;)
+		{
+			if (page->usedSlots == 0)
+			{
+				releaseSlabPage(page);
+				page = slabPages[sizeClass];
+			}
+			else
+			{
+				page = page->next;
+			}
+		}
+	}
+	dirtyMemory = 0;
+
+	if (!regionSource.purge)
+	{
+		return 0;
+	}
+
+	SizeType result = purgeFreeBlocks(freeMemory);
+	for (const auto& lists : tlsfLists)
+	{
+		for (FreeHeader* list : lists)
+		{
+			for (FreeHeader* block = list; block; block = block->right)
+			{
+				result += purgeFreeBlock(block);
+			}
+		}
+	}
+
+	return result;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::addDirtyMemory(const SizeType bytes)
+{
+	dirtyMemory += bytes;
+	if (purgeThreshold && dirtyMemory >= purgeThreshold)
+	{
+		purgeRegions();
+	}
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::setPurgeThreshold(_In_ const SizeType dirtyBytes)
+{
+	purgeThreshold = dirtyBytes;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::getPurgeThreshold() const
+{
+	return purgeThreshold;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::purgeFreeBlock(FreeHeader * const block)
+{
+	const SizeType pageSize = regionSource.purgeGranularity ? regionSource.purgeGranularity : getPageSize();
+
+	// Only the interior pages go, the header has to stay intact.
+	const uintptr_t begin = (((uintptr_t)block) + sizeof(FreeHeader) + pageSize - 1) & ~((uintptr_t)pageSize - 1);
+	const uintptr_t end = (((uintptr_t)block) + calcSize(block) - (Config::boundaryTags ? sizeof(SizeType) : 0)) & ~((uintptr_t)pageSize - 1); // And so does the footer of boundary tags.
+
+	if (end > begin && findRegion(block)->isOwning)
+	{
+		regionSource.purge((void*)begin, end - begin);
+		return end - begin;
+	}
+
+	return 0;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::purgeFreeBlocks(FreeHeader * const head)
+{
+	if (!head)
+	{
+		return 0;
+	}
+
+	SizeType result = purgeFreeBlocks(head->left) + purgeFreeBlocks(head->right);
+	for (FreeHeader* block = head; block; block = block->sameSize)
+	{
+		result += purgeFreeBlock(block);
+	}
+
+	return result;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::setRegionSource(_In_ const RegionSource & source, _In_ const SizeType minRegionSize)
+{
+	regionSource = source;
+	growthSize = minRegionSize;
+}
+
+template<class Config>
+inline unsigned int BasicRBTMemoryAllocator<Config>::getRegionsCount() const
+{
+	unsigned int result = 0;
+
+	for (Region* region = regions.load(std::memory_order_acquire); region; region = region->next)
+	{
+		++result;
+	}
+
+	return result;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::Region * BasicRBTMemoryAllocator<Config>::addRegion(void * memoryToUse, const SizeType memorySize, const bool isOwning)
+{
+	// Layout: region header, slab page map, blocks, end sentinel.
+	void* ptr = memoryToUse;
+	SizeType space = memorySize;
+	if (!std::align(alignof(Region), sizeof(Region), ptr, space))
+	{
+		return nullptr;
+	}
+
+	const uintptr_t regionBegin = (uintptr_t)ptr, regionEnd = ((uintptr_t)memoryToUse) + memorySize;
+	if (Config::compactLinks)
+	{
+		// Links between blocks are 32-bit, so every region has to be in reach of all the others.
+		uintptr_t lowest = regionBegin, highest = regionEnd;
+		for (Region* region = regions.load(std::memory_order_relaxed); region; region = region->next)
+		{
+			const uintptr_t begin = (uintptr_t)region->begin, end = ((uintptr_t)region->end) + sizeof(ClaimedHeader);
+			lowest = begin < lowest ? begin : lowest;
+			highest = end > highest ? end : highest;
+		}
+		if (highest - lowest > compactLinksRange)
+		{
+			return nullptr;
+		}
+	}
+	const uintptr_t mapBegin = regionBegin & ~((uintptr_t)slabPageSize - 1);
+	const SizeType mapSize = (regionEnd - mapBegin + slabPageSize - 1) / slabPageSize;
+	// With boundary tags, headers sit right before usedAlignment boundaries.
+	const uintptr_t headerOffset = Config::boundaryTags ? sizeof(ClaimedHeader) : 0;
+	const uintptr_t endAddress = ((regionEnd - sizeof(ClaimedHeader) - headerOffset) & ~((uintptr_t)usedAlignment - 1)) + (Config::boundaryTags ? usedAlignment - headerOffset : 0);
+	const uintptr_t firstBlock = ((regionBegin + sizeof(Region) + mapSize + headerOffset + usedAlignment - 1) & ~((uintptr_t)usedAlignment - 1)) - headerOffset;
+
+	if (space < sizeof(Region) + mapSize + minFreeBlockSize + 2 * sizeof(ClaimedHeader) + 2 * usedAlignment || endAddress < firstBlock + minFreeBlockSize)
+	{
+		return nullptr;
+	}
+
+	Region* region = new (ptr) Region;
+	region->memory = memoryToUse;
+	region->size = memorySize;
+	region->isOwning = isOwning;
+	region->slabPageMap = (unsigned char*)addPointers(region, sizeof(Region));
+	region->slabPageMapBegin = mapBegin;
+	region->slabPageMapSize = mapSize;
+	std::memset(region->slabPageMap, 0, mapSize);
+
+	ClaimedHeader* end = new ((void*)endAddress) ClaimedHeader;
+	FreeHeader* block = new ((void*)firstBlock) FreeHeader;
+	linkRegionBlocks(block, end, Layout());
+	region->begin = block;
+	region->end = end;
+
+	insertFreeBlock(block);
+	totalMemory += calcSize(block);
+
+	region->next = regions.load(std::memory_order_relaxed);
+	regions.store(region, std::memory_order_release);
+
+	return region;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::linkRegionBlocks(FreeHeader * block, ClaimedHeader * end, TaggedBlocks)
+{
+	setFreeBlock(block, ((uintptr_t)end) - ((uintptr_t)block));
+	end->sizeAndFlags = prevBlockFreeFlag;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::linkRegionBlocks(FreeHeader * block, ClaimedHeader * end, LinkedBlocks)
+{
+	block->prev = nullptr;
+	block->next = end;
+	end->prev = setIsFreeHeader(block, true);
+	end->next = end;
+}
+
+template<class Config>
+inline bool BasicRBTMemoryAllocator<Config>::grow(const SizeType howMany, const SizeType alignment)
+{
+	if (!regionSource.acquire || growthSize == 0)
+	{
+		return false;
+	}
+
+	// Room for the region's bookkeeping, the free block which always stays at the front and the worst case padding.
+	SizeType size = howMany + sizeof(Region) + 3 * minFreeBlockSize + 2 * sizeof(ClaimedHeader) + alignment + 2 * usedAlignment;
+	size += size / slabPageSize + 1;
+	if (size < howMany)
+	{
+		return false;
+	}
+	if (size < growthSize)
+	{
+		size = growthSize;
+	}
+	if (size < totalMemory / 2)
+	{
+		// Grow geometrically, so the regions list (walked on every deallocation) stays short.
+		size = totalMemory / 2;
+	}
+
+	void* newMemory = regionSource.acquire(size);
+	if (!newMemory)
+	{
+		return false;
+	}
+
+	if (!addRegion(newMemory, size, true))
+	{
+		if (regionSource.release)
+		{
+			regionSource.release(newMemory, size);
+		}
+		return false;
+	}
+
+	return true;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::Region * BasicRBTMemoryAllocator<Config>::findRegion(const void * ptr) const
+{
+	for (Region* region = regions.load(std::memory_order_acquire); region; region = region->next)
+	{
+		if (((uintptr_t)ptr) > ((uintptr_t)region) && ((uintptr_t)ptr) < ((uintptr_t)region->end))
+		{
+			return region;
+		}
+	}
+
+	return nullptr;
+}
+
+template<class Config>
+inline void * BasicRBTMemoryAllocator<Config>::allocate(_In_ const SizeType howMany, _In_opt_ const SizeType alignment)
+{
+	std::lock_guard<Lock> lock(callLock);
+	drainRemoteBlocks();
+	void* const result = allocateBlock(howMany, alignment);
+	if (traceRecorder)
+	{
+		traceRecorder->record(TraceRecorder::Operation::Allocate, result, nullptr, howMany, alignment);
+	}
+	return result;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::deallocate(_In_ void* ptr)
+{
+	std::lock_guard<Lock> lock(callLock);
+	if (traceRecorder && ptr)
+	{
+		traceRecorder->record(TraceRecorder::Operation::Deallocate, ptr, nullptr, 0, 0);
+	}
+	deallocateBlock(ptr);
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::deallocate(_In_ void * ptr, _In_ const SizeType size, _In_opt_ const SizeType alignment)
+{
+	std::lock_guard<Lock> lock(callLock);
+	if (traceRecorder && ptr)
+	{
+		traceRecorder->record(TraceRecorder::Operation::Deallocate, ptr, nullptr, 0, 0);
+	}
+	deallocateSizedBlock(ptr, size, alignment);
+}
+
+template<class Config>
+inline void * BasicRBTMemoryAllocator<Config>::reallocate(_In_opt_ void * ptr, _In_ const SizeType newSize, _In_opt_ const SizeType alignment)
+{
+	std::lock_guard<Lock> lock(callLock);
+	void* const result = reallocateBlock(ptr, newSize, alignment);
+	if (traceRecorder)
+	{
+		traceRecorder->record(TraceRecorder::Operation::Reallocate, result, ptr, newSize, alignment);
+	}
+	return result;
+}
+
+template<class Config>
+inline void * BasicRBTMemoryAllocator<Config>::allocateBlock(const SizeType howMany, const SizeType alignment)
+{
+	void* result = nullptr;
+
+	if (howMany <= slabMaxSize && alignment <= usedAlignment && totalMemory >= 2 * slabPageSize)
+	{
+		result = allocateFromSlab(getSlabClass(howMany));
+	}
+	if (!result && !isRequestTooBig(howMany, alignment))
+	{
+		result = allocateFromTree(howMany, alignment);
+	}
+	if (result)
+	{
+		++allocations;
+	}
+	else
+	{
+		++failedAllocations;
+	}
+
+	return result;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::deallocateBlock(void* ptr)
+{
+	if (!ptr)
+	{
+		return;
+	}
+
+	SlabPage* page = findSlabPage(ptr);
+	if (page)
+	{
+		deallocateToSlab(page, ptr);
+	}
+	else
+	{
+		deallocateToTree(ptr);
+	}
+
+	--allocations;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::deallocateSizedBlock(void * ptr, const SizeType size, const SizeType alignment)
+{
+	if (!ptr)
+	{
+		return;
+	}
+
+	if (Config::checkSanity && (!isPointerInMemoryRange(ptr) || calcUsableSize(ptr) < size || ((uintptr_t)ptr) % alignment != 0))
+	{
+		throw RBTMemoryAllocatorError(10);
+	}
+
+	// Slots never hold more than slabMaxSize, even after a reallocate, so a bigger block is in the tree. Small ones may be in either.
+	SlabPage* page = size <= slabMaxSize ? findSlabPage(ptr) : nullptr;
+	if (page)
+	{
+		deallocateToSlab(page, ptr);
+	}
+	else
+	{
+		deallocateToTree(ptr);
+	}
+
+	--allocations;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::allocateBatch(_In_ const SizeType howMany, _In_ const SizeType count, _Out_ void ** output, _In_opt_ const SizeType alignment)
+{
+	std::lock_guard<Lock> lock(callLock);
+	drainRemoteBlocks();
+	SizeType result = 0;
+
+	// Slab slots are carved in batches anyway and blocks with extra alignment can't simply follow each other, so only the rest goes in runs.
+	if (!(howMany <= slabMaxSize && totalMemory >= 2 * slabPageSize) && alignment <= usedAlignment && !isRequestTooBig(howMany, alignment))
+	{
+		const SizeType blockSize = getRequiredBlockSize(howMany);
+		SizeType run = count < ((SizeType)-1) / 2 / blockSize ? count : ((SizeType)-1) / 2 / blockSize;
+
+		// Halve the run whenever no free block can hold it.
+		while (result < count && run > 1)
+		{
+			run = run < count - result ? run : count - result;
+			const SizeType allocated = allocateRunFromTree(blockSize, run, output + result);
+			if (allocated)
+			{
+				result += allocated;
+				allocations += (uint64_t)allocated;
+			}
+			else
+			{
+				run /= 2;
+			}
+		}
+	}
+
+	for (; result < count; ++result)
+	{
+		output[result] = allocateBlock(howMany, alignment);
+		if (!output[result])
+		{
+			break;
+		}
+	}
+
+	if (traceRecorder)
+	{
+		// Recorded as separate calls; a shortfall shows up as one failed allocation.
+		for (SizeType i = 0; i < result; ++i)
+		{
+			traceRecorder->record(TraceRecorder::Operation::Allocate, output[i], nullptr, howMany, alignment);
+		}
+		if (result < count)
+		{
+			traceRecorder->record(TraceRecorder::Operation::Allocate, nullptr, nullptr, howMany, alignment);
+		}
+	}
+
+	return result;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::deallocateBatch(_In_ void ** ptrs, _In_ const SizeType count)
+{
+	std::lock_guard<Lock> lock(callLock);
+	deallocateBlocks(ptrs, count);
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::deallocateBlocks(void ** ptrs, const SizeType count)
+{
+	if (traceRecorder)
+	{
+		for (SizeType i = 0; i < count; ++i)
+		{
+			if (ptrs[i])
+			{
+				traceRecorder->record(TraceRecorder::Operation::Deallocate, ptrs[i], nullptr, 0, 0);
+			}
+		}
+	}
+
+	// Neighbours in memory end up next to each other.
+	std::sort(ptrs, ptrs + count, std::less<void*>());
+
+	for (SizeType i = 0; i < count;)
+	{
+		void* const ptr = ptrs[i++];
+		if (!ptr)
+		{
+			continue;
+		}
+
+		--allocations;
+		SlabPage* page = findSlabPage(ptr);
+		if (page)
+		{
+			deallocateToSlab(page, ptr);
+			continue;
+		}
+
+		// Join the run of claimed blocks starting here, so the tree is touched once for all of them.
+		ClaimedHeader* const first = (ClaimedHeader*)subPointers(ptr, sizeof(ClaimedHeader));
+		ClaimedHeader* last = first;
+		while (i < count && ptrs[i] == addPointers(getNextBlock(last), sizeof(ClaimedHeader)) && !findSlabPage(ptrs[i]))
+		{
+			last = getNextBlock(last);
+			--allocations;
+			++coalesces;
+			++i;
+		}
+
+		if (last != first)
+		{
+			joinBlocks(first, last, Layout());
+		}
+		deallocateToTree(ptr);
+	}
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::deallocateRemote(_In_ void * ptr)
+{
+	if (!ptr)
+	{
+		return;
+	}
+
+	RemoteFree* const block = (RemoteFree*)ptr;
+	RemoteFree* head = remoteFrees.load(std::memory_order_relaxed);
+	do
+	{
+		block->next = head;
+	} while (!remoteFrees.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::drainRemoteFrees()
+{
+	std::lock_guard<Lock> lock(callLock);
+	return drainRemoteBlocks();
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::drainRemoteBlocks()
+{
+	// A plain load first, so allocations don't pay for an exchange while nothing is queued.
+	if (isDrainingRemoteFrees || !remoteFrees.load(std::memory_order_relaxed))
+	{
+		return 0;
+	}
+
+	// Taking the whole queue at once leaves pushers nothing to race with. What they push meanwhile waits for the next call.
+	RemoteFree* block = remoteFrees.exchange(nullptr, std::memory_order_acquire);
+	SizeType result = 0;
+	void* batch[remoteFreesBatchSize];
+	isDrainingRemoteFrees = true;
+	while (block)
+	{
+		SizeType count = 0;
+		for (; block && count < remoteFreesBatchSize; block = block->next)
+		{
+			batch[count++] = block;
+		}
+		deallocateBlocks(batch, count);
+		result += count;
+	}
+	isDrainingRemoteFrees = false;
+
+	return result;
+}
+
+template<class Config>
+inline void * BasicRBTMemoryAllocator<Config>::reallocateBlock(void * ptr, const SizeType newSize, const SizeType alignment)
+{
+	if (!ptr)
+	{
+		return allocateBlock(newSize, alignment);
+	}
+	if (newSize == 0)
+	{
+		deallocateBlock(ptr);
+		return nullptr;
+	}
+	if (isRequestTooBig(newSize, alignment))
+	{
+		++failedAllocations;
+		return nullptr;
+	}
+
+	const SizeType oldSize = calcUsableSize(ptr);
+
+	if ((((uintptr_t)ptr) % alignment) == 0)
+	{
+		if (findSlabPage(ptr))
+		{
+			if (newSize <= oldSize)
+			{
+				return ptr;
+			}
+		}
+		else
+		{
+			ClaimedHeader* const claimedBlock = (ClaimedHeader*)subPointers(ptr, sizeof(ClaimedHeader));
+			const SizeType blockSize = getRequiredBlockSize(newSize);
+
+			if (blockSize <= calcSize(claimedBlock) || growClaimedBlock(claimedBlock, blockSize))
+			{
+				shrinkClaimedBlock(claimedBlock, blockSize, Layout());
+				if (Config::checkSanity)
+				{
+					dbgCheckSanity();
+					if (!dbgCheckListIntegrity())
+					{
+						throw RBTMemoryAllocatorError(14);
+					}
+				}
+				return ptr;
+			}
+		}
+	}
+
+	void* result = allocateBlock(newSize, alignment);
+	if (!result)
+	{
+		return nullptr;
+	}
+
+	std::memcpy(result, ptr, oldSize < newSize ? oldSize : newSize);
+	deallocateBlock(ptr);
+
+	return result;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::shrinkClaimedBlock(ClaimedHeader * block, const SizeType blockSize, TaggedBlocks)
+{
+	ClaimedHeader* next = getNextBlock(block);
+	FreeHeader* const tail = (FreeHeader*)addPointers(block, blockSize);
+
+	if (tail == next)
+	{
+		return;
+	}
+
+	const SizeType released = ((uintptr_t)next) - ((uintptr_t)tail);
+	if (isBlockFree(next))
+	{
+		// Merge the tail with the next block.
+		removeFreeBlock((FreeHeader*)next);
+		next = getNextBlock(next);
+		++coalesces;
+	}
+	else
+		if (released < minFreeBlockSize)
+		{
+			return;
+		}
+
+	usedMemory -= released;
+
+	block->sizeAndFlags = blockSize | (block->sizeAndFlags & blockFlagsMask);
+	new (tail) FreeHeader;
+	setFreeBlock(tail, ((uintptr_t)next) - ((uintptr_t)tail));
+	setPrevBlockFree(next, true);
+	insertFreeBlock(tail);
+	++splits;
+	addDirtyMemory(released);
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::shrinkClaimedBlock(ClaimedHeader * block, const SizeType blockSize, LinkedBlocks)
+{
+	ClaimedHeader* const next = cleanAddress(block->next);
+	FreeHeader* const tail = (FreeHeader*)addPointers(block, blockSize);
+	ClaimedHeader* tailNext = block->next;
+
+	if (tail == next)
+	{
+		return;
+	}
+
+	if (isFreeHeader(block->next))
+	{
+		// Merge the tail with the next block. Its header gets overwritten, so remember where it ends.
+		removeFreeBlock((FreeHeader*)next);
+		tailNext = next->next;
+		++coalesces;
+	}
+	else
+		if (((uintptr_t)next) - ((uintptr_t)tail) < sizeof(FreeHeader))
+		{
+			return;
+		}
+
+	const SizeType released = ((uintptr_t)next) - ((uintptr_t)tail);
+	usedMemory -= released;
+
+	new (tail) FreeHeader;
+	tail->next = tailNext;
+	tail->prev = setIsFreeHeader(block, false);
+	block->next = setIsFreeHeader(tail, true);
+	cleanAddress(tail->next)->prev = setIsFreeHeader(tail, true);
+	insertFreeBlock(tail);
+	++splits;
+	addDirtyMemory(released);
+}
+
+template<class Config>
+inline bool BasicRBTMemoryAllocator<Config>::growClaimedBlock(ClaimedHeader * block, const SizeType blockSize)
+{
+	if (!isNextBlockFree(block, Layout()))
+	{
+		return false;
+	}
+
+	FreeHeader* const next = (FreeHeader*)getNextBlock(block);
+	if (blockSize > calcSize(block) + calcSize(next))
+	{
+		return false;
+	}
+
+	// Swallow the whole next block, the caller gives back what's not needed. The block after a free one is always claimed.
+	removeFreeBlock(next);
+	usedMemory += calcSize(next);
+	++coalesces;
+	joinBlocks(block, next, Layout());
+
+	return true;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::joinBlocks(ClaimedHeader * first, ClaimedHeader * last, TaggedBlocks)
+{
+	first->sizeAndFlags += ((uintptr_t)getNextBlock(last)) - ((uintptr_t)getNextBlock(first));
+	setPrevBlockFree(getNextBlock(first), false);
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::joinBlocks(ClaimedHeader * first, ClaimedHeader * last, LinkedBlocks)
+{
+	first->next = last->next;
+	cleanAddress(first->next)->prev = setIsFreeHeader(first, false);
+}
+
+template<class Config>
+inline void * BasicRBTMemoryAllocator<Config>::allocateFromTree(const SizeType howMany, const SizeType alignment)
+{
+	// Assumption: two free blocks cannot be next to each other.
+
+	if (Config::checkSanity && !dbgCheckListIntegrity())
+	{
+		throw RBTMemoryAllocatorError(14);
+	}
+
+	FittingBlockData fittingBlockData;
+	const SizeType requiredSize = howMany >= sizeof(FreeHeader) - sizeof(ClaimedHeader) ? howMany : sizeof(FreeHeader) - sizeof(ClaimedHeader);
+	if (deferredFreesCount > 0)
+	{
+		void* const deferred = takeDeferredFree(requiredSize, alignment);
+		if (deferred)
+		{
+			return deferred;
+		}
+	}
+	FreeHeader* fittingBlock = findFittingBlock(requiredSize, alignment, fittingBlockData);
+
+	if (!fittingBlock && flushDeferredFrees())
+	{
+		fittingBlock = findFittingBlock(requiredSize, alignment, fittingBlockData);
+	}
+	if (Config::checkSanity && dbgCheckFittingBlock(fittingBlock, requiredSize, alignment))
+	{
+		throw RBTMemoryAllocatorError(13);
+	}
+	if (!fittingBlock)
+	{
+		if (!grow(requiredSize, alignment))
+		{
+			return nullptr;
+		}
+
+		fittingBlock = findFittingBlock(requiredSize, alignment, fittingBlockData);
+		if (!fittingBlock)
+		{
+			return nullptr;
+		}
+	}
+
+	removeFreeBlock(fittingBlock);
+	if (Config::checkSanity)
+	{
+		dbgCheckSanity();
+	}
+
+	ClaimedHeader* const claimedBlock = claimFittingBlock(fittingBlock, fittingBlockData, Layout());
+
+	usedMemory += calcSize(claimedBlock);
+
+	if (Config::checkSanity && !dbgCheckListIntegrity())
+	{
+		throw RBTMemoryAllocatorError(14);
+	}
+
+	//dbgWriteAllBlocks();
+	return addPointers(claimedBlock, sizeof(ClaimedHeader));
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::ClaimedHeader * BasicRBTMemoryAllocator<Config>::claimFittingBlock(FreeHeader * fittingBlock, const FittingBlockData & fittingBlockData, TaggedBlocks)
+{
+	ClaimedHeader* const next = getNextBlock(fittingBlock);
+	ClaimedHeader* const claimedBlock = fittingBlockData.usableMemory;
+	const SizeType adjustment = fittingBlockData.adjustment, remainingMemory = fittingBlockData.remainingMemory;
+	SizeType claimedSize = sizeof(ClaimedHeader) + fittingBlockData.usedMemory;
+
+	// First we take care of back memory.
+	if (remainingMemory >= minFreeBlockSize)
+	{
+		// Create new free block. The next block already knows its predecessor is free.
+		FreeHeader* newBlock = new (addPointers(claimedBlock, claimedSize)) FreeHeader;
+		setFreeBlock(newBlock, remainingMemory);
+		insertFreeBlock(newBlock);
+		++splits;
+		if (Config::checkSanity)
+		{
+			dbgCheckSanity();
+		}
+	}
+	else
+	{
+		// Add the remaining memory to the claimed block.
+		claimedSize += remainingMemory;
+		setPrevBlockFree(next, false);
+	}
+
+	// Take care of forward memory. isBlockFitting leaves either none or enough for a free block.
+	if (adjustment != 0)
+	{
+		FreeHeader* newBlock = new (fittingBlock) FreeHeader;
+		setFreeBlock(newBlock, adjustment);
+		insertFreeBlock(newBlock);
+		++splits;
+		if (Config::checkSanity)
+		{
+			dbgCheckSanity();
+		}
+		claimedBlock->sizeAndFlags = claimedSize | prevBlockFreeFlag;
+	}
+	else
+	{
+		claimedBlock->sizeAndFlags = claimedSize;
+	}
+
+	return claimedBlock;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::ClaimedHeader * BasicRBTMemoryAllocator<Config>::claimFittingBlock(FreeHeader * fittingBlock, const FittingBlockData & fittingBlockData, LinkedBlocks)
+{
+	const BlockLinks headInfo = { fittingBlock->prev, fittingBlock->next };
+	ClaimedHeader* const claimedBlock = new (fittingBlockData.usableMemory) ClaimedHeader;
+
+	// Check the adjustment and remaining memory size.
+	const SizeType adjustment = fittingBlockData.adjustment, remainingMemory = fittingBlockData.remainingMemory;
+
+	// First we take care of back memory.
+	if (remainingMemory >= sizeof(FreeHeader))
+	{
+		// Create new free block.
+		//FreeHeader* newBlock = new (subPointers(cleanAddress(headInfo.next), remainingMemory)) FreeHeader;
+		FreeHeader* newBlock = new (addPointers(claimedBlock, sizeof(ClaimedHeader) + fittingBlockData.usedMemory)) FreeHeader;
+		newBlock->next = headInfo.next;
+		cleanAddress(headInfo.next)->prev = setIsFreeHeader(newBlock, true);
+		newBlock->prev = setIsFreeHeader(claimedBlock, false);
+		claimedBlock->next = setIsFreeHeader(newBlock, true);
+		insertFreeBlock(newBlock);
+		++splits;
+		if (Config::checkSanity)
+		{
+			dbgCheckSanity();
+		}
+	}
+	else
+	{
+		// Add the remaining memory to the claimed block.
+		claimedBlock->next = headInfo.next;
+		cleanAddress(headInfo.next)->prev = setIsFreeHeader(claimedBlock, false);
+	}
+
+	// Take care of forward memory.
+	if (adjustment >= sizeof(FreeHeader))
+	{
+		// Create new free block.
+		FreeHeader* newBlock = new (fittingBlock) FreeHeader;
+		newBlock->next = setIsFreeHeader(claimedBlock, false);
+		newBlock->prev = headInfo.prev;
+		claimedBlock->prev = setIsFreeHeader(newBlock, true);
+		if (headInfo.prev)
+		{
+			cleanAddress(headInfo.prev)->next = setIsFreeHeader(newBlock, true);
+		}
+		insertFreeBlock(newBlock);
+		++splits;
+		if (Config::checkSanity)
+		{
+			dbgCheckSanity();
+		}
+	}
+	else
+	{
+		// Add the remaining memory to previous block.
+		claimedBlock->prev = headInfo.prev;
+		if (headInfo.prev)
+		{
+			cleanAddress(headInfo.prev)->next = setIsFreeHeader(claimedBlock, false);
+		}
+	}
+
+	return claimedBlock;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::allocateRunFromTree(const SizeType blockSize, const SizeType count, void ** output)
+{
+	// One claimed block for the whole run: a single search, a single removal and a single reinsertion of the remainder.
+	void* const memory = allocateFromTree(blockSize * count - sizeof(ClaimedHeader), usedAlignment);
+	if (!memory)
+	{
+		return 0;
+	}
+
+	// Then split it. The last block keeps whatever the big one absorbed.
+	ClaimedHeader* const first = (ClaimedHeader*)subPointers(memory, sizeof(ClaimedHeader));
+	splitRun(first, blockSize, count, output, Layout());
+
+	if (Config::checkSanity && !dbgCheckListIntegrity())
+	{
+		throw RBTMemoryAllocatorError(14);
+	}
+
+	return count;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::splitRun(ClaimedHeader * first, const SizeType blockSize, const SizeType count, void ** output, TaggedBlocks)
+{
+	const SizeType lastSize = calcSize(first) - (count - 1) * blockSize;
+	ClaimedHeader* block = first;
+	block->sizeAndFlags = (count > 1 ? blockSize : lastSize) | (first->sizeAndFlags & prevBlockFreeFlag);
+	output[0] = addPointers(first, sizeof(ClaimedHeader));
+	for (SizeType i = 1; i < count; ++i)
+	{
+		block = addPointers(block, blockSize);
+		block->sizeAndFlags = i + 1 < count ? blockSize : lastSize;
+		output[i] = addPointers(block, sizeof(ClaimedHeader));
+	}
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::splitRun(ClaimedHeader * first, const SizeType blockSize, const SizeType count, void ** output, LinkedBlocks)
+{
+	ClaimedHeader* const tail = first->next;
+	ClaimedHeader* block = first;
+	output[0] = addPointers(first, sizeof(ClaimedHeader));
+	for (SizeType i = 1; i < count; ++i)
+	{
+		ClaimedHeader* const next = addPointers(block, blockSize);
+		block->next = setIsFreeHeader(next, false);
+		next->prev = setIsFreeHeader(block, false);
+		output[i] = addPointers(next, sizeof(ClaimedHeader));
+		block = next;
+	}
+	block->next = tail;
+	cleanAddress(tail)->prev = setIsFreeHeader(block, false);
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::deallocateToTree(void* ptr)
+{
+	ClaimedHeader* const claimedBlock = (ClaimedHeader*)subPointers(ptr, sizeof(ClaimedHeader));
+	usedMemory -= calcSize(claimedBlock);
+
+	if (deferredFreesCapacity == 0)
+	{
+		mergeToTree(claimedBlock);
+		return;
+	}
+
+	// Keep the block claimed for now, a request of the same size may take it back without touching the tree.
+	if (deferredFreesCount == deferredFreesCapacity)
+	{
+		flushDeferredFrees();
+	}
+	deferredFrees[deferredFreesCount++] = claimedBlock;
+}
+
+template<class Config>
+inline void * BasicRBTMemoryAllocator<Config>::takeDeferredFree(const SizeType howMany, const SizeType alignment)
+{
+	const SizeType blockSize = getRequiredBlockSize(howMany);
+
+	// Newest first, it's the most likely to be in the cache.
+	for (unsigned int i = deferredFreesCount; i-- > 0;)
+	{
+		ClaimedHeader* const block = deferredFrees[i];
+		const SizeType size = calcSize(block);
+
+		// Exact fits only: anything a split would have cut off is too small for a free block anyway.
+		if (size >= blockSize && size - blockSize < minFreeBlockSize && (((uintptr_t)block) + sizeof(ClaimedHeader)) % alignment == 0)
+		{
+			deferredFrees[i] = deferredFrees[--deferredFreesCount];
+			usedMemory += size;
+			return addPointers(block, sizeof(ClaimedHeader));
+		}
+	}
+
+	return nullptr;
+}
+
+template<class Config>
+inline bool BasicRBTMemoryAllocator<Config>::flushDeferredFrees()
+{
+	const bool result = deferredFreesCount > 0;
+
+	// The count drops before every merge, since a merge may trim and trim flushes too.
+	while (deferredFreesCount > 0)
+	{
+		mergeToTree(deferredFrees[--deferredFreesCount]);
+	}
+
+	return result;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::setDeferredFreesCapacity(_In_ const unsigned int capacity)
+{
+	std::lock_guard<Lock> lock(callLock);
+	flushDeferredFrees();
+	deferredFreesCapacity = capacity < maxDeferredFrees ? capacity : maxDeferredFrees;
+}
+
+template<class Config>
+inline unsigned int BasicRBTMemoryAllocator<Config>::getDeferredFreesCapacity() const
+{
+	return deferredFreesCapacity;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::setTraceRecorder(_In_opt_ TraceRecorder* recorder)
+{
+	traceRecorder = recorder;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::TraceRecorder * BasicRBTMemoryAllocator<Config>::getTraceRecorder() const
+{
+	return traceRecorder;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::mergeToTree(ClaimedHeader* claimedBlock)
+{
+	if (Config::checkSanity && !dbgCheckListIntegrity())
+	{
+		throw RBTMemoryAllocatorError(14);
+	}
+
+	const SizeType freedSize = calcSize(claimedBlock);
+	FreeHeader* const newBlock = mergeWithNeighbours(claimedBlock, Layout());
+
+	newBlock->left = newBlock->right = newBlock->parent = nullptr;
+	insertFreeBlock(newBlock);
+	if (Config::checkSanity)
+	{
+		dbgCheckSanity();
+	}
+
+	if (Config::checkSanity && !dbgCheckListIntegrity())
+	{
+		throw RBTMemoryAllocatorError(14);
+	}
+
+	addDirtyMemory(freedSize);
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::FreeHeader * BasicRBTMemoryAllocator<Config>::mergeWithNeighbours(ClaimedHeader * claimedBlock, TaggedBlocks)
+{
+	FreeHeader* newBlock = (FreeHeader*)claimedBlock;
+	ClaimedHeader* next = getNextBlock(claimedBlock);
+	SizeType newSize = calcSize(claimedBlock);
+
+	// Merge adjacent blocks if possible and add the new block to the RB tree.
+	// Prevoius block (the one on left). Its footer tells where it starts.
+	if (isPrevBlockFree(claimedBlock))
+	{
+		newBlock = getPrevFreeBlock(claimedBlock);
+		removeFreeBlock(newBlock);
+		++coalesces;
+		if (Config::checkSanity)
+		{
+			dbgCheckSanity();
+		}
+		newSize += calcSize(newBlock);
+	}
+
+	// Next block (the one on right).
+	if (isBlockFree(next)) // The region's end sentinel is always claimed.
+	{
+		removeFreeBlock((FreeHeader*)next);
+		++coalesces;
+		if (Config::checkSanity)
+		{
+			dbgCheckSanity();
+		}
+		newSize += calcSize(next);
+		next = getNextBlock(next);
+	}
+
+	setFreeBlock(newBlock, newSize);
+	setPrevBlockFree(next, true);
+	// Merging complete.
+
+	return newBlock;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::FreeHeader * BasicRBTMemoryAllocator<Config>::mergeWithNeighbours(ClaimedHeader * claimedBlock, LinkedBlocks)
+{
+	FreeHeader* newBlock = (FreeHeader*)claimedBlock;
+	const BlockLinks headInfo = { claimedBlock->prev, claimedBlock->next };
+
+	// Merge adjacent blocks if possible and add the new block to the RB tree.
+	// Prevoius block (the one on left).
+	if (isFreeHeader(headInfo.prev)) // If it doesn't work then try adding "&& cleanAddress(headInfo.prev) != nullptr".
+	{
+		newBlock = (FreeHeader*)cleanAddress(headInfo.prev);
+		removeFreeBlock(newBlock);
+		++coalesces;
+		if (Config::checkSanity)
+		{
+			dbgCheckSanity();
+		}
+		newBlock->next = headInfo.next;
+	}
+
+	// Next block (the one on right).
+	if (isFreeHeader(headInfo.next)) // The region's end sentinel is always claimed.
+	{
+		FreeHeader* tempHead = (FreeHeader*)cleanAddress(headInfo.next);
+		removeFreeBlock(tempHead);
+		++coalesces;
+		if (Config::checkSanity)
+		{
+			dbgCheckSanity();
+		}
+		newBlock->next = cleanAddress(headInfo.next)->next;
+	}
+
+	if (newBlock->prev)
+	{
+		cleanAddress(newBlock->prev)->next = setIsFreeHeader(newBlock, true);
+	}
+	cleanAddress(newBlock->next)->prev = setIsFreeHeader(newBlock, true);
+	// Merging complete.
+
+	return newBlock;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SlabPage * BasicRBTMemoryAllocator<Config>::findSlabPage(const void * ptr) const
+{
+	const Region* region = findRegion(ptr);
+	if (!region)
+	{
+		return nullptr;
+	}
+
+	const SizeType index = (((uintptr_t)ptr) - region->slabPageMapBegin) / slabPageSize;
+	if (index >= region->slabPageMapSize || region->slabPageMap[index] == 0)
+	{
+		return nullptr;
+	}
+
+	return (SlabPage*)(region->slabPageMapBegin + index * slabPageSize);
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SlabPage * BasicRBTMemoryAllocator<Config>::createSlabPage(const SizeType sizeClass)
+{
+	SlabPage* page = (SlabPage*)allocateFromTree(slabPageSize, slabPageSize);
+	if (!page)
+	{
+		return nullptr;
+	}
+
+	page->prev = nullptr;
+	page->next = slabPages[sizeClass];
+	if (page->next)
+	{
+		page->next->prev = page;
+	}
+	page->freeSlots = nullptr;
+	page->untouchedSlots = addPointers(page, sizeof(SlabPage));
+	page->sizeClass = sizeClass;
+	page->usedSlots = 0;
+	slabPages[sizeClass] = page;
+	usedMemory -= getSlabPageBlockSize(page); // Counted again once a slot is taken.
+
+	Region* region = findRegion(page);
+	region->slabPageMap[(((uintptr_t)page) - region->slabPageMapBegin) / slabPageSize] = (unsigned char)(sizeClass + 1);
+
+	return page;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::SizeType BasicRBTMemoryAllocator<Config>::getSlabPageBlockSize(const SlabPage * page) const
+{
+	return calcSize((const ClaimedHeader*)subPointers(page, sizeof(ClaimedHeader)));
+}
+
+template<class Config>
+inline void * BasicRBTMemoryAllocator<Config>::allocateFromSlab(const SizeType sizeClass)
+{
+	SlabPage* page = slabPages[sizeClass];
+	if (!page)
+	{
+		page = createSlabPage(sizeClass);
+		if (!page)
+		{
+			return nullptr;
+		}
+	}
+
+	const SizeType slotSize = getSlabClassSize(sizeClass);
+	void* result = page->freeSlots;
+	if (result)
+	{
+		page->freeSlots = *(void**)result;
+	}
+	else
+	{
+		result = page->untouchedSlots;
+		page->untouchedSlots = addPointers(result, slotSize);
+	}
+	if (page->usedSlots++ == 0)
+	{
+		usedMemory += getSlabPageBlockSize(page);
+	}
+
+	// Full pages leave the list until one of their slots is released.
+	if (!page->freeSlots && ((uintptr_t)page->untouchedSlots) + slotSize > ((uintptr_t)page) + slabPageSize)
+	{
+		slabPages[sizeClass] = page->next;
+		if (page->next)
+		{
+			page->next->prev = nullptr;
+		}
+		page->next = page->prev = nullptr;
+	}
+
+	return result;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::deallocateToSlab(SlabPage * page, void * ptr)
+{
+	const SizeType sizeClass = page->sizeClass;
+	const bool isListed = page->prev || page->next || slabPages[sizeClass] == page;
+
+	*(void**)ptr = page->freeSlots;
+	page->freeSlots = ptr;
+	--page->usedSlots;
+
+	if (!isListed)
+	{
+		page->next = slabPages[sizeClass];
+		if (page->next)
+		{
+			page->next->prev = page;
+		}
+		slabPages[sizeClass] = page;
+	}
+
+	if (page->usedSlots > 0)
+	{
+		return;
+	}
+
+	// Keep one empty page per class around, so a single slot being allocated and freed doesn't claim and release whole pages.
+	// It's not in use, so it leaves usedMemory either way.
+	usedMemory -= getSlabPageBlockSize(page);
+	if (page->prev || page->next)
+	{
+		releaseSlabPage(page);
+	}
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::releaseSlabPage(SlabPage * page)
+{
+	(page->prev ? page->prev->next : slabPages[page->sizeClass]) = page->next;
+	if (page->next)
+	{
+		page->next->prev = page->prev;
+	}
+
+	Region* region = findRegion(page);
+	region->slabPageMap[(((uintptr_t)page) - region->slabPageMapBegin) / slabPageSize] = 0;
+	mergeToTree((ClaimedHeader*)subPointers(page, sizeof(ClaimedHeader))); // Straight to the tree: an empty page is no longer in usedMemory, and is rarely asked for again at its exact size.
+}
+
+template<class Config>
+inline BasicRBTMemoryAllocator<Config>::ThreadCache::ThreadCache(_In_opt_ BasicRBTMemoryAllocator& allocatorToUse, _In_opt_ const unsigned int capacityPerClass)
+	: allocator(allocatorToUse), capacity(capacityPerClass > 0 ? capacityPerClass : 1)
+{
+}
+
+template<class Config>
+inline BasicRBTMemoryAllocator<Config>::ThreadCache::~ThreadCache()
+{
+	flush();
+}
+
+template<class Config>
+inline bool BasicRBTMemoryAllocator<Config>::ThreadCache::refill(const SizeType sizeClass)
+{
+	SizeClass& list = sizeClasses[sizeClass];
+	const unsigned int batchSize = capacity > 1 ? capacity / 2 : 1;
+
+	std::lock_guard<std::mutex> lock(allocator.mutex);
+	for (unsigned int i = 0; i < batchSize; ++i)
+	{
+		CachedBlock* block = (CachedBlock*)allocator.allocate(getSizeClassSize(sizeClass));
+		if (!block)
+		{
+			break;
+		}
+		block->next = list.head;
+		list.head = block;
+		++list.count;
+	}
+
+	return list.head != nullptr;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::ThreadCache::release(const SizeType sizeClass, unsigned int howMany)
+{
+	SizeClass& list = sizeClasses[sizeClass];
+	if (howMany > list.count)
+	{
+		howMany = list.count;
+	}
+	if (howMany == 0)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(allocator.mutex);
+	for (; howMany > 0; --howMany)
+	{
+		CachedBlock* block = list.head;
+		list.head = block->next;
+		--list.count;
+		allocator.deallocate(block);
+	}
+}
+
+template<class Config>
+inline void * BasicRBTMemoryAllocator<Config>::ThreadCache::allocate(_In_ const SizeType howMany, _In_opt_ const SizeType alignment)
+{
+	if (howMany <= maxCachedSize && alignment <= usedAlignment)
+	{
+		const SizeType sizeClass = howMany > 0 ? (howMany - 1) / sizeClassGranularity : 0;
+		SizeClass& list = sizeClasses[sizeClass];
+
+		if (!list.head && !refill(sizeClass))
+		{
+			return nullptr;
+		}
+
+		CachedBlock* block = list.head;
+		list.head = block->next;
+		--list.count;
+		return block;
+	}
+
+	std::lock_guard<std::mutex> lock(allocator.mutex);
+	return allocator.allocate(howMany, alignment);
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::ThreadCache::deallocate(_In_ void * ptr)
+{
+	if (!ptr)
+	{
+		return;
+	}
+
+	// Only slab slots are cached. Their class can be read without the lock, unlike tree block headers, which other threads rewrite when retagging neighbours.
+	const SlabPage* page = allocator.findSlabPage(ptr);
+	if (!page)
+	{
+		std::lock_guard<std::mutex> lock(allocator.mutex);
+		allocator.deallocate(ptr);
+		return;
+	}
+
+	const SizeType sizeClass = page->sizeClass;
+	SizeClass& list = sizeClasses[sizeClass];
+	CachedBlock* block = (CachedBlock*)ptr;
+	block->next = list.head;
+	list.head = block;
+	++list.count;
+
+	if (list.count > capacity)
+	{
+		release(sizeClass, list.count - capacity / 2);
+	}
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::ThreadCache::deallocate(_In_ void * ptr, _In_ const SizeType size, _In_opt_ const SizeType alignment)
+{
+	if (!ptr)
+	{
+		return;
+	}
+
+	const SlabPage* page = size <= maxCachedSize ? allocator.findSlabPage(ptr) : nullptr;
+	if (!page)
+	{
+		std::lock_guard<std::mutex> lock(allocator.mutex);
+		allocator.deallocate(ptr, size, alignment);
+		return;
+	}
+
+	// The slot may belong to a bigger class if it was shrunk by reallocate. Listing it under the smaller one is still safe.
+	const SizeType sizeClass = size > 0 ? (size - 1) / sizeClassGranularity : 0;
+	if (Config::checkSanity && (page->sizeClass < sizeClass || ((uintptr_t)ptr) % alignment != 0))
+	{
+		throw RBTMemoryAllocatorError(10);
+	}
+
+	SizeClass& list = sizeClasses[sizeClass];
+	CachedBlock* block = (CachedBlock*)ptr;
+	block->next = list.head;
+	list.head = block;
+	++list.count;
+
+	if (list.count > capacity)
+	{
+		release(sizeClass, list.count - capacity / 2);
+	}
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::ThreadCache::flush()
+{
+	for (SizeType i = 0; i < sizeClassesCount; ++i)
+	{
+		release(i, sizeClasses[i].count);
+	}
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::ThreadCache::setCapacity(_In_ const unsigned int capacityPerClass)
+{
+	capacity = capacityPerClass > 0 ? capacityPerClass : 1;
+
+	for (SizeType i = 0; i < sizeClassesCount; ++i)
+	{
+		if (sizeClasses[i].count > capacity)
+		{
+			release(i, sizeClasses[i].count - capacity);
+		}
+	}
+}
+
+template<class Config>
+inline unsigned int BasicRBTMemoryAllocator<Config>::ThreadCache::getCapacity() const
+{
+	return capacity;
+}
+
+template<class Config>
+inline unsigned int BasicRBTMemoryAllocator<Config>::ThreadCache::getCachedBlocksCount() const
+{
+	unsigned int result = 0;
+
+	for (const SizeClass& list : sizeClasses)
+	{
+		result += list.count;
+	}
+
+	return result;
+}
+
+template<class Config>
+inline BasicRBTMemoryAllocator<Config> & BasicRBTMemoryAllocator<Config>::ThreadCache::getAllocator() const
+{
+	return allocator;
+}
+
+template<class Config>
+inline typename BasicRBTMemoryAllocator<Config>::ThreadCache & BasicRBTMemoryAllocator<Config>::ThreadCache::local()
+{
+	thread_local ThreadCache cache;
+	return cache;
+}
+
+template<class Config>
+inline BasicRBTMemoryAllocator<Config>::HeapWalker::HeapWalker(_In_ const BasicRBTMemoryAllocator & allocatorToWalk)
+	: allocator(allocatorToWalk)
+{
+	reset();
+}
+
+template<class Config>
+inline const typename BasicRBTMemoryAllocator<Config>::Region * BasicRBTMemoryAllocator<Config>::HeapWalker::findNextRegion(const Region * const after) const
+{
+	// Regions are listed newest first, but there are few of them.
+	const Region* result = nullptr;
+	for (const Region* candidate = allocator.regions.load(std::memory_order_acquire); candidate; candidate = candidate->next)
+	{
+		if ((!after || candidate > after) && (!result || candidate < result))
+		{
+			result = candidate;
+		}
+	}
+	return result;
+}
+
+template<class Config>
+inline bool BasicRBTMemoryAllocator<Config>::HeapWalker::next(_Out_ BlockInfo & output)
+{
+	if (!region)
+	{
+		return false;
+	}
+
+	ClaimedHeader* const current = const_cast<ClaimedHeader*>(block);
+	output.address = current;
+	output.memory = addPointers(current, sizeof(ClaimedHeader));
+	output.size = calcSize(current);
+	output.isFree = isBlockFree(current);
+	output.isDeferred = false;
+	output.isSlabPage = false;
+	output.isFirstInRegion = current == region->begin;
+	if (!output.isFree)
+	{
+		output.isDeferred = std::find(allocator.deferredFrees, allocator.deferredFrees + allocator.deferredFreesCount, current) != allocator.deferredFrees + allocator.deferredFreesCount;
+		output.isSlabPage = allocator.findSlabPage(output.memory) == output.memory;
+	}
+
+	block = getNextBlock(current);
+	if (block == region->end)
+	{
+		region = findNextRegion(region);
+		block = region ? region->begin : nullptr;
+	}
+
+	return true;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::HeapWalker::reset()
+{
+	region = findNextRegion(nullptr);
+	block = region ? region->begin : nullptr;
+}
+
+template<class Config>
+inline BasicRBTMemoryAllocator<Config>::FreeTreeWalker::FreeTreeWalker(_In_ const BasicRBTMemoryAllocator & allocatorToWalk)
+	: allocator(allocatorToWalk)
+{
+	reset();
+}
+
+template<class Config>
+inline bool BasicRBTMemoryAllocator<Config>::FreeTreeWalker::next(_Out_ BlockInfo & output)
+{
+	if (!block)
+	{
+		return false;
+	}
+
+	output.address = block;
+	output.memory = addPointers(block, sizeof(ClaimedHeader));
+	output.size = calcSize(block);
+	output.isFree = true;
+	output.isDeferred = false;
+	output.isSlabPage = false;
+	output.isFirstInRegion = false;
+	for (const Region* region = allocator.regions.load(std::memory_order_acquire); region; region = region->next)
+	{
+		if (region->begin == block)
+		{
+			output.isFirstInRegion = true;
+			break;
+		}
+	}
+
+	if (allocator.freeIndex == FreeIndex::Tlsf)
+	{
+		block = block->right;
+		while (!block && ++list < tlsfFirstLevelsCount * tlsfSecondLevelsCount)
+		{
+			block = allocator.tlsfLists[list / tlsfSecondLevelsCount][list % tlsfSecondLevelsCount];
+		}
+	}
+	else
+	{
+		block = block->sameSize;
+		if (!block)
+		{
+			node = getSuccessor(node);
+			block = node;
+		}
+	}
+
+	return true;
+}
+
+template<class Config>
+inline void BasicRBTMemoryAllocator<Config>::FreeTreeWalker::reset()
+{
+	list = 0;
+	node = allocator.freeMemory;
+	if (allocator.freeIndex == FreeIndex::Tlsf)
+	{
+		block = allocator.tlsfLists[0][0];
+		while (!block && ++list < tlsfFirstLevelsCount * tlsfSecondLevelsCount)
+		{
+			block = allocator.tlsfLists[list / tlsfSecondLevelsCount][list % tlsfSecondLevelsCount];
+		}
+		return;
+	}
+
+	while (node && node->left)
+	{
+		node = node->left;
+	}
+	block = node;
+}
+
@@ -0,0 +1,248 @@
+// Replaces every global operator new and delete with RBTMemoryAllocator::getProcessHeap(). It's opt-in: compile this file into the
+// program (not into a library other programs link) and all new expressions, standard containers included, use the allocator.
+// The process heap doesn't allocate through operator new, so constructing it (and RBTMemoryAllocator::instance) can't recurse here.
+#include "RBTMemoryAllocator.h"
+
+#include <new>
+
+using SizeType = RBTMemoryAllocator::SizeType;
+
+// Small unaligned requests go through a per-thread cache. It's destroyed before the thread's (or for the main thread, the program's)
+// remaining destructors run, and these may still delete, so after that everything goes to the heap under its lock.
+static thread_local bool isCacheDestroyed = false;
+
+struct LocalCache
+{
+	RBTMemoryAllocator::ThreadCache cache{RBTMemoryAllocator::getProcessHeap()};
+
+	~LocalCache()
+	{
+		isCacheDestroyed = true; // The cache flushes right after.
+	}
+};
+
+static RBTMemoryAllocator::ThreadCache* getLocalCache()
+{
+	if (isCacheDestroyed)
+	{
+		return nullptr;
+	}
+	static thread_local LocalCache local;
+	return &local.cache;
+}
+
+static void* allocateFromHeap(const SizeType size, const SizeType alignment)
+{
+	RBTMemoryAllocator& heap = RBTMemoryAllocator::getProcessHeap();
+	std::lock_guard<std::mutex> lock(heap.getMutex());
+	return heap.allocate(size, alignment);
+}
+
+static void deallocateToHeap(void* ptr)
+{
+	RBTMemoryAllocator& heap = RBTMemoryAllocator::getProcessHeap();
+	std::lock_guard<std::mutex> lock(heap.getMutex());
+	heap.deallocate(ptr);
+}
+
+static void deallocateToHeap(void* ptr, const SizeType size, const SizeType alignment)
+{
+	RBTMemoryAllocator& heap = RBTMemoryAllocator::getProcessHeap();
+	std::lock_guard<std::mutex> lock(heap.getMutex());
+	heap.deallocate(ptr, size, alignment);
+}
+
+static void* allocateUnaligned(const SizeType size)
+{
+	RBTMemoryAllocator::ThreadCache* cache = getLocalCache();
+	return cache ? cache->allocate(size) : allocateFromHeap(size, RBTMemoryAllocator::usedAlignment);
+}
+
+static void deallocate(void* ptr)
+{
+	if (!ptr)
+	{
+		return;
+	}
+
+	RBTMemoryAllocator::ThreadCache* cache = getLocalCache();
+	if (cache)
+	{
+		cache->deallocate(ptr);
+	}
+	else
+	{
+		deallocateToHeap(ptr);
+	}
+}
+
+// The size the block was requested with, 0 became 1 on the way in.
+static void deallocate(void* ptr, const SizeType size, const SizeType alignment)
+{
+	if (!ptr)
+	{
+		return;
+	}
+
+	RBTMemoryAllocator::ThreadCache* cache = getLocalCache();
+	if (cache)
+	{
+		cache->deallocate(ptr, size > 0 ? size : 1, alignment);
+	}
+	else
+	{
+		deallocateToHeap(ptr, size > 0 ? size : 1, alignment);
+	}
+}
+
+// The new handler loop required of the throwing forms.
+template<class Allocate>
+static void* allocateOrThrow(const Allocate& allocate)
+{
+	for (;;)
+	{
+		void* const result = allocate();
+		if (result)
+		{
+			return result;
+		}
+
+		const std::new_handler handler = std::get_new_handler();
+		if (!handler)
+		{
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+static void* allocateUnalignedOrThrow(std::size_t size)
+{
+	return allocateOrThrow([size]() { return allocateUnaligned(size > 0 ? size : 1); });
+}
+
+void* operator new(std::size_t size)
+{
+	return allocateUnalignedOrThrow(size);
+}
+
+void* operator new[](std::size_t size)
+{
+	return allocateUnalignedOrThrow(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	try
+	{
+		return allocateUnalignedOrThrow(size);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	return operator new(size, std::nothrow);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	deallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept
+{
+	deallocate(ptr, size, RBTMemoryAllocator::usedAlignment);
+}
+
+void operator delete[](void* ptr, std::size_t size) noexcept
+{
+	deallocate(ptr, size, RBTMemoryAllocator::usedAlignment);
+}
+
+#ifdef __cpp_aligned_new
+// Over-aligned types skip the cache, whose blocks are only usedAlignment aligned, and are placed by the tree directly.
+static void* allocateAlignedOrThrow(std::size_t size, std::align_val_t alignment)
+{
+	if ((SizeType)alignment <= RBTMemoryAllocator::usedAlignment)
+	{
+		return allocateUnalignedOrThrow(size);
+	}
+	return allocateOrThrow([size, alignment]() { return allocateFromHeap(size > 0 ? size : 1, (SizeType)alignment); });
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	return allocateAlignedOrThrow(size, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return allocateAlignedOrThrow(size, alignment);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	try
+	{
+		return allocateAlignedOrThrow(size, alignment);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return operator new(size, alignment, std::nothrow);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+	deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size, std::align_val_t alignment) noexcept
+{
+	deallocate(ptr, size, (SizeType)alignment);
+}
+
+void operator delete[](void* ptr, std::size_t size, std::align_val_t alignment) noexcept
+{
+	deallocate(ptr, size, (SizeType)alignment);
+}
+#endif
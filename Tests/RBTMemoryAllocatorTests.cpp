@@ -0,0 +1,1039 @@
+// Checks of the allocator's contracts that are easy to break without noticing. Prints every failed check and returns the number of them.
+// Build it like the benchmarks, with RBMEM_CHECKSANITY to also check the heap after every call. See the Tests section of README.md.
+#include "RBTMemoryAllocator.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+using SizeType = RBTMemoryAllocator::SizeType;
+using FreeIndex = RBTMemoryAllocator::FreeIndex;
+
+static unsigned int failures = 0;
+
+#define RBMEM_TEST_CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			std::printf("%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+			++failures; \
+		} \
+	} while (false)
+
+// Sizes near SIZE_MAX used to wrap in the block size calculation and return a tiny block.
+static void testHugeRequests()
+{
+	RBTMemoryAllocator allocator(RBTMemoryAllocator::MegaByte);
+	const SizeType maxSize = (SizeType)-1;
+	const SizeType offsets[] = { 0, 1, 7, 15, 16, 64, 4096, maxSize / 2 };
+
+	for (const SizeType offset : offsets)
+	{
+		RBMEM_TEST_CHECK(allocator.allocate(maxSize - offset) == nullptr);
+		RBMEM_TEST_CHECK(allocator.allocate(maxSize - offset, 4096) == nullptr);
+	}
+	RBMEM_TEST_CHECK(allocator.allocate(64, maxSize / 2 + 1) == nullptr);
+
+	void* const block = allocator.allocate(100);
+	RBMEM_TEST_CHECK(block != nullptr);
+	RBMEM_TEST_CHECK(allocator.reallocate(block, maxSize) == nullptr);
+	RBMEM_TEST_CHECK(allocator.reallocate(block, maxSize - 15) == nullptr);
+	RBMEM_TEST_CHECK(allocator.getUsableSize(block) >= 100);
+
+	void* batch[4];
+	RBMEM_TEST_CHECK(allocator.allocateBatch(maxSize - 15, 4, batch) == 0);
+
+	allocator.deallocate(block);
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0);
+}
+
+struct RedBlackTreeTestConfig
+	: public RBTMemoryAllocatorConfig
+{
+	static constexpr FreeIndex freeIndex = FreeIndex::RedBlackTree;
+};
+struct TlsfTestConfig
+	: public RBTMemoryAllocatorConfig
+{
+	static constexpr FreeIndex freeIndex = FreeIndex::Tlsf;
+};
+
+struct CheckedRedBlackTreeTestConfig
+	: public RBTCheckedMemoryAllocatorConfig
+{
+	static constexpr FreeIndex freeIndex = FreeIndex::RedBlackTree;
+	static constexpr bool stats = true;
+};
+
+// Free blocks of one size share a tree node. Taking the node's block hands the node over to the next one of the chain, and a block merged
+// away from the middle of the chain leaves the rest linked. The checked config verifies the tree and the chains after every call.
+static void testSameSizeChain()
+{
+	using Allocator = BasicRBTMemoryAllocator<CheckedRedBlackTreeTestConfig>;
+	Allocator allocator(RBTMemoryAllocator::MegaByte);
+	void* const front = allocator.allocate(1000); // The first block of a region may not be handed out whole, keep the chain off it.
+	std::vector<void*> blocks, guards;
+	for (unsigned int i = 0; i < 20; ++i)
+	{
+		blocks.push_back(allocator.allocate(1000));
+		guards.push_back(allocator.allocate(1000)); // Keeps the blocks from merging.
+	}
+	for (void* const block : blocks)
+	{
+		allocator.deallocate(block);
+	}
+	const auto countChainedBlocks = [&allocator]()
+	{
+		Allocator::FreeTreeWalker walker(allocator);
+		RBTMemoryAllocator::BlockInfo info;
+		unsigned int count = 0;
+		while (walker.next(info))
+		{
+			count += info.size >= 1000 && info.size < 2000 ? 1 : 0;
+		}
+		return count;
+	};
+	RBMEM_TEST_CHECK(countChainedBlocks() == 20 && allocator.getHeapStats().treeHeight <= 3); // A node for the chain, the rest of the region and maybe a sliver in front.
+
+	allocator.deallocate(guards[10]); // Merges blocks 10 and 11 with it, out of the chain.
+	RBMEM_TEST_CHECK(countChainedBlocks() == 18);
+	for (unsigned int i = 0; i < 18; ++i)
+	{
+		void* const block = allocator.allocate(1000); // Each takes the chain's node.
+		RBMEM_TEST_CHECK(block != nullptr);
+		blocks[i] = block;
+	}
+	RBMEM_TEST_CHECK(countChainedBlocks() == 0);
+
+	for (unsigned int i = 0; i < 18; ++i)
+	{
+		allocator.deallocate(blocks[i]);
+	}
+	for (unsigned int i = 0; i < 20; ++i)
+	{
+		if (i != 10)
+		{
+			allocator.deallocate(guards[i]);
+		}
+	}
+	allocator.deallocate(front);
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0 && allocator.getStats().freeBlocks == 1);
+}
+
+// The tree search has to find the same block size as a scan of the whole heap, whatever the alignment. It may only miss it when it stops
+// partway through the blocks of the best size, and then it still has to find a fitting block that's no smaller.
+static void testBestFit()
+{
+	using Allocator = BasicRBTMemoryAllocator<RedBlackTreeTestConfig>;
+	Allocator allocator(RBTMemoryAllocator::MegaByte);
+	const auto countFreeBlocks = [&allocator](const SizeType size)
+	{
+		Allocator::FreeTreeWalker walker(allocator);
+		RBTMemoryAllocator::BlockInfo info;
+		unsigned int count = 0;
+		while (walker.next(info))
+		{
+			count += info.size == size ? 1 : 0;
+		}
+		return count;
+	};
+	const SizeType alignments[] = { RBTMemoryAllocator::usedAlignment, 32, 64, 256, 4096 };
+	std::mt19937_64 random(1);
+	std::vector<void*> live;
+
+	for (unsigned int step = 0; step < 4000; ++step)
+	{
+		if (live.empty() || random() % 3 != 0)
+		{
+			void* const block = allocator.allocate(RBTMemoryAllocator::slabMaxSize + 1 + random() % 4096, alignments[random() % 4]);
+			if (block)
+			{
+				live.push_back(block);
+			}
+		}
+		else
+		{
+			const size_t index = (size_t)(random() % live.size());
+			allocator.deallocate(live[index]);
+			live[index] = live.back();
+			live.pop_back();
+		}
+
+		const SizeType howMany = 1 + random() % 8192, alignment = alignments[random() % (sizeof(alignments) / sizeof(alignments[0]))];
+		const SizeType fitting = allocator.dbgGetFittingBlockSize(howMany, alignment), best = allocator.dbgGetBestFittingBlockSize(howMany, alignment);
+		RBMEM_TEST_CHECK(fitting == best || ((fitting == 0 || fitting > best) && countFreeBlocks(best) > Allocator::rbtreeChainCandidates));
+	}
+
+	for (void* const block : live)
+	{
+		allocator.deallocate(block);
+	}
+}
+
+// With the TLSF index, the cached largest free block has to follow the blocks being claimed, not only the ones being freed.
+static void testTlsfLargestFreeBlock()
+{
+	alignas(RBTMemoryAllocator::usedAlignment) static unsigned char memory[256 * RBTMemoryAllocator::KiloByte];
+	BasicRBTMemoryAllocator<TlsfTestConfig> allocator(memory, sizeof(memory));
+
+	// Two free blocks of one list, with everything else claimed.
+	void* const first = allocator.allocate(40000);
+	void* const firstGuard = allocator.allocate(1000);
+	void* const second = allocator.allocate(40500);
+	void* const secondGuard = allocator.allocate(1000);
+	std::vector<void*> rest;
+	for (const SizeType size : { 8000, 1000, 300 })
+	{
+		for (void* block = allocator.allocate(size); block; block = allocator.allocate(size))
+		{
+			rest.push_back(block);
+		}
+	}
+	RBMEM_TEST_CHECK(first && firstGuard && second && secondGuard);
+	allocator.deallocate(first);
+	allocator.deallocate(second);
+
+	const auto isTight = [&allocator]()
+	{
+		const SizeType cached = allocator.getStats().largestFreeBlock, exact = allocator.getHeapStats().largestFreeBlock;
+		return cached == 0 || (cached >= exact && cached - exact <= exact / 16);
+	};
+	RBMEM_TEST_CHECK(isTight());
+	void* const large = allocator.allocate(40400); // Only the second block fits.
+	RBMEM_TEST_CHECK(large && isTight());
+	void* const small = allocator.allocate(30000); // Takes the first one, leaving a small tail.
+	RBMEM_TEST_CHECK(small && isTight());
+
+	allocator.deallocate(small);
+	allocator.deallocate(large);
+	allocator.deallocate(firstGuard);
+	allocator.deallocate(secondGuard);
+	for (void* const block : rest)
+	{
+		allocator.deallocate(block);
+	}
+	RBMEM_TEST_CHECK(isTight());
+}
+
+static unsigned int countSlabPages(const RBTMemoryAllocator& allocator)
+{
+	RBTMemoryAllocator::HeapWalker walker(allocator);
+	RBTMemoryAllocator::BlockInfo info;
+	unsigned int count = 0;
+	while (walker.next(info))
+	{
+		count += info.isSlabPage ? 1 : 0;
+	}
+	return count;
+}
+
+// Small requests share slab pages. A released slot is the next one handed out, emptied pages go back to the tree except one per class,
+// and that one isn't counted as used.
+static void testSlabPages()
+{
+	RBTMemoryAllocator allocator(RBTMemoryAllocator::MegaByte);
+	void* const first = allocator.allocate(32);
+	void* const second = allocator.allocate(32);
+	RBMEM_TEST_CHECK(first && second && first != second && countSlabPages(allocator) == 1);
+	allocator.deallocate(first);
+	RBMEM_TEST_CHECK(allocator.allocate(32) == first);
+	allocator.deallocate(first);
+	allocator.deallocate(second);
+	RBMEM_TEST_CHECK(countSlabPages(allocator) == 1 && allocator.getUsedMemory() == 0);
+
+	std::vector<void*> blocks;
+	for (unsigned int i = 0; i < 4 * RBTMemoryAllocator::slabPageSize / 32; ++i)
+	{
+		blocks.push_back(allocator.allocate(32));
+	}
+	RBMEM_TEST_CHECK(countSlabPages(allocator) > 4 && allocator.getUsedMemory() > 4 * RBTMemoryAllocator::slabPageSize);
+	for (void* const block : blocks)
+	{
+		allocator.deallocate(block);
+	}
+	RBMEM_TEST_CHECK(countSlabPages(allocator) == 1 && allocator.getUsedMemory() == 0 && allocator.getAllocationsCount() == 0);
+}
+
+// Counts what the allocator purges instead of giving pages back, so tests can see when it trims.
+static SizeType purgedBytes = 0;
+
+static RBTMemoryAllocator::RegionSource getCountingRegionSource()
+{
+	RBTMemoryAllocator::RegionSource source;
+	source.acquire = [](SizeType size) { return std::malloc(size); };
+	source.release = [](void* memory, SizeType) { std::free(memory); };
+	source.purge = [](void*, SizeType size) { purgedBytes += size; };
+	return source;
+}
+
+// Memory a shrinking reallocate gives back counts towards the purge threshold like freed blocks do, and trim releases the empty slab pages.
+static void testPurging()
+{
+	RBTMemoryAllocator allocator(getCountingRegionSource(), RBTMemoryAllocator::MegaByte);
+	allocator.setPurgeThreshold(256 * RBTMemoryAllocator::KiloByte);
+	void* const guard = allocator.allocate(1000);
+	void* const block = allocator.allocate(512 * RBTMemoryAllocator::KiloByte);
+	void* const after = allocator.allocate(1000); // Keeps the tail from merging with the free rest of the region.
+	RBMEM_TEST_CHECK(guard && block && after);
+
+	purgedBytes = 0;
+	RBMEM_TEST_CHECK(allocator.reallocate(block, 4096) == block);
+	RBMEM_TEST_CHECK(purgedBytes > 0);
+
+	allocator.deallocate(allocator.allocate(32));
+	RBMEM_TEST_CHECK(countSlabPages(allocator) == 1);
+	allocator.trim();
+	RBMEM_TEST_CHECK(countSlabPages(allocator) == 0);
+
+	allocator.deallocate(after);
+	allocator.deallocate(block);
+	allocator.deallocate(guard);
+	RBMEM_TEST_CHECK(allocator.getUsedMemory() == 0);
+}
+
+// Containers give their memory back to the allocator it came from: allocators are equal only over the same heap, and follow the contents on assignment.
+static void testStdAllocator()
+{
+	RBTMemoryAllocator first(RBTMemoryAllocator::MegaByte), second(RBTMemoryAllocator::MegaByte);
+	RBMEM_TEST_CHECK(StdAllocator<int>(first) == StdAllocator<double>(first) && StdAllocator<int>(first) != StdAllocator<int>(second));
+	RBMEM_TEST_CHECK(StdAllocator<int>() == StdAllocator<int>(RBTMemoryAllocator::instance));
+
+	{
+		std::vector<int, StdAllocator<int>> fromFirst(1000, 1, StdAllocator<int>(first)), fromSecond{ StdAllocator<int>(second) };
+		RBMEM_TEST_CHECK(first.getAllocationsCount() == 1 && second.getAllocationsCount() == 0);
+		fromSecond = std::move(fromFirst);
+		RBMEM_TEST_CHECK(fromSecond.get_allocator() == StdAllocator<int>(first) && fromSecond.size() == 1000);
+		fromSecond.push_back(2); // Grows in the first heap, where the contents came from.
+		RBMEM_TEST_CHECK(second.getAllocationsCount() == 0);
+	}
+	RBMEM_TEST_CHECK(first.getAllocationsCount() == 0);
+
+#ifdef RBMEM_HAS_MEMORY_RESOURCE
+	RBTMemoryResource firstResource(first), sameResource(first), secondResource(second);
+	RBMEM_TEST_CHECK(firstResource.is_equal(sameResource) && !firstResource.is_equal(secondResource) && &firstResource.getAllocator() == &first);
+	{
+		std::pmr::vector<int> values(100, 1, &firstResource);
+		RBMEM_TEST_CHECK(first.getAllocationsCount() == 1);
+	}
+	RBMEM_TEST_CHECK(first.getAllocationsCount() == 0);
+	void* block = &first;
+	try
+	{
+		block = firstResource.allocate(((SizeType)-1) / 4);
+	}
+	catch (const std::bad_alloc&)
+	{
+		block = nullptr;
+	}
+	RBMEM_TEST_CHECK(block == nullptr);
+#endif
+}
+
+// A block goes back to the arena owning it, whichever thread frees it. If that arena is busy, it waits in the arena's remote queue,
+// still counted as used, until the arena is locked again. The arenas never grow, so the allocator fails once all of them are full.
+static void testShardedAllocator()
+{
+	RBTShardedMemoryAllocator allocator(4 * RBTMemoryAllocator::MegaByte, 4);
+	RBMEM_TEST_CHECK(allocator.getArenasCount() == 4);
+
+	void* const crossFreed = allocator.allocate(1000);
+	std::thread([&allocator, crossFreed]() { allocator.deallocate(crossFreed); }).join();
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0);
+
+	void* const queued = allocator.allocate(1000);
+	void* const other = allocator.allocate(1000);
+	RBTMemoryAllocator& arena = allocator.getArena(allocator.getArenaIndex(queued));
+	RBMEM_TEST_CHECK(allocator.getArenaIndex(other) == allocator.getArenaIndex(queued));
+	arena.getMutex().lock();
+	std::thread([&allocator, queued]() { allocator.deallocate(queued); }).join();
+	arena.getMutex().unlock();
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 2);
+	allocator.deallocate(other); // Takes the lock, so it frees the queued block too.
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0 && allocator.getUsedMemory() == 0);
+
+	std::vector<void*> blocks;
+	std::vector<bool> isArenaUsed(allocator.getArenasCount(), false);
+	for (void* block = allocator.allocate(64 * RBTMemoryAllocator::KiloByte); block; block = allocator.allocate(64 * RBTMemoryAllocator::KiloByte))
+	{
+		isArenaUsed[allocator.getArenaIndex(block)] = true;
+		blocks.push_back(block);
+	}
+	RBMEM_TEST_CHECK(blocks.size() > 40 && blocks.size() < 64);
+	for (const bool isUsed : isArenaUsed)
+	{
+		RBMEM_TEST_CHECK(isUsed);
+	}
+	for (void* const block : blocks)
+	{
+		allocator.deallocate(block);
+	}
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0);
+}
+
+// A thread cache refills an empty class with half its capacity at once, never holds more than its capacity, and gives everything back on flush.
+// Requests it doesn't cache go to the allocator directly.
+static void testThreadCache()
+{
+	RBTMemoryAllocator allocator(RBTMemoryAllocator::MegaByte);
+	RBTMemoryAllocator::ThreadCache cache(allocator, 8);
+	std::vector<void*> blocks;
+	blocks.push_back(cache.allocate(32));
+	RBMEM_TEST_CHECK(blocks[0] && cache.getCachedBlocksCount() == 3 && allocator.getAllocationsCount() == 4);
+	for (unsigned int i = 0; i < 31; ++i)
+	{
+		blocks.push_back(cache.allocate(32));
+	}
+	for (void* const block : blocks)
+	{
+		cache.deallocate(block);
+		RBMEM_TEST_CHECK(cache.getCachedBlocksCount() <= 8);
+	}
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == cache.getCachedBlocksCount());
+
+	cache.setCapacity(2);
+	RBMEM_TEST_CHECK(cache.getCachedBlocksCount() <= 2 && allocator.getAllocationsCount() == cache.getCachedBlocksCount());
+	void* const large = cache.allocate(1000);
+	RBMEM_TEST_CHECK(large && allocator.getAllocationsCount() == cache.getCachedBlocksCount() + 1);
+	cache.deallocate(large);
+
+	cache.flush();
+	RBMEM_TEST_CHECK(cache.getCachedBlocksCount() == 0 && allocator.getAllocationsCount() == 0 && allocator.getUsedMemory() == 0);
+}
+
+// reallocate grows into a free neighbour and shrinks without moving, moves only when the neighbour is taken, and keeps the block as it was when it fails.
+static void testReallocate()
+{
+	RBTMemoryAllocator allocator(RBTMemoryAllocator::MegaByte);
+	unsigned char* const block = (unsigned char*)allocator.allocate(1000);
+	void* const next = allocator.allocate(1000);
+	void* const guard = allocator.allocate(1000);
+	RBMEM_TEST_CHECK(block && next && guard);
+	for (unsigned int i = 0; i < 1000; ++i)
+	{
+		block[i] = (unsigned char)i;
+	}
+	const auto isIntact = [block](const unsigned int size)
+	{
+		for (unsigned int i = 0; i < size; ++i)
+		{
+			if (block[i] != (unsigned char)i)
+			{
+				return false;
+			}
+		}
+		return true;
+	};
+
+	allocator.deallocate(next);
+	RBMEM_TEST_CHECK(allocator.reallocate(block, 1900) == block && allocator.getUsableSize(block) >= 1900 && isIntact(1000));
+	RBMEM_TEST_CHECK(allocator.reallocate(block, 600) == block && isIntact(600));
+	RBMEM_TEST_CHECK(allocator.reallocate(block, ((SizeType)-1) / 4) == nullptr && allocator.getUsableSize(block) >= 600 && isIntact(600));
+
+	unsigned char* const moved = (unsigned char*)allocator.reallocate(block, 3000); // The guard is in the way.
+	RBMEM_TEST_CHECK(moved && moved != block);
+	for (unsigned int i = 0; moved && i < 600; ++i)
+	{
+		RBMEM_TEST_CHECK(moved[i] == (unsigned char)i);
+	}
+	allocator.deallocate(moved);
+	allocator.deallocate(guard);
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0);
+
+	// Out of memory: a heap that can't grow has no room for the moved copy.
+	alignas(RBTMemoryAllocator::usedAlignment) static unsigned char memory[64 * RBTMemoryAllocator::KiloByte];
+	RBTMemoryAllocator fixed(memory, sizeof(memory));
+	unsigned char* const small = (unsigned char*)fixed.allocate(1000);
+	void* const blocker = fixed.allocate(1000);
+	RBMEM_TEST_CHECK(small && blocker);
+	std::memset(small, 7, 1000);
+	RBMEM_TEST_CHECK(fixed.reallocate(small, 63 * RBTMemoryAllocator::KiloByte) == nullptr && fixed.getUsableSize(small) >= 1000);
+	RBMEM_TEST_CHECK(small[0] == 7 && small[999] == 7 && fixed.dbgCheckListIntegrity());
+	fixed.deallocate(blocker);
+	fixed.deallocate(small);
+	RBMEM_TEST_CHECK(fixed.getAllocationsCount() == 0);
+}
+
+// A batch is carved from one free block, so its blocks follow each other. Freeing them in any order merges them all back before the tree sees them.
+static void testBatches()
+{
+	BasicRBTMemoryAllocator<CheckedRedBlackTreeTestConfig> allocator(RBTMemoryAllocator::MegaByte);
+	void* const front = allocator.allocate(1000);
+	RBMEM_TEST_CHECK(front != nullptr);
+	const RBTMemoryAllocator::Stats before = allocator.getStats();
+	void* blocks[101];
+	RBMEM_TEST_CHECK(allocator.allocateBatch(1000, 100, blocks) == 100);
+	RBMEM_TEST_CHECK(allocator.getStats().splits - before.splits <= 1 && allocator.getAllocationsCount() == 101);
+	const ptrdiff_t stride = (char*)blocks[1] - (char*)blocks[0];
+	for (unsigned int i = 1; i < 100; ++i)
+	{
+		RBMEM_TEST_CHECK((char*)blocks[i] - (char*)blocks[i - 1] == stride && allocator.getUsableSize(blocks[i]) >= 1000);
+	}
+
+	std::mt19937_64 random(3);
+	std::shuffle(blocks, blocks + 100, random);
+	blocks[100] = blocks[50];
+	blocks[50] = nullptr; // Skipped.
+	allocator.deallocateBatch(blocks, 101);
+	const RBTMemoryAllocator::Stats after = allocator.getStats();
+	RBMEM_TEST_CHECK(after.allocations == 1 && after.freeBlocks == before.freeBlocks && after.freeMemory == before.freeMemory);
+
+	allocator.deallocate(front);
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0 && allocator.getStats().freeBlocks == 1);
+}
+
+// A deferred free stays claimed until a request of its size takes it back, or until the buffer overflows, a search fails or the heap is trimmed.
+static void testDeferredFrees()
+{
+	using Allocator = BasicRBTMemoryAllocator<CheckedRedBlackTreeTestConfig>;
+	alignas(RBTMemoryAllocator::usedAlignment) static unsigned char memory[64 * RBTMemoryAllocator::KiloByte];
+	Allocator allocator(memory, sizeof(memory));
+	allocator.setDeferredFreesCapacity(1000);
+	RBMEM_TEST_CHECK(allocator.getDeferredFreesCapacity() == RBTMemoryAllocator::maxDeferredFrees);
+	allocator.setDeferredFreesCapacity(4);
+
+	auto countDeferred = [&allocator]()
+	{
+		unsigned int result = 0;
+		Allocator::HeapWalker walker(allocator);
+		RBTMemoryAllocator::BlockInfo block;
+		while (walker.next(block))
+		{
+			result += block.isDeferred;
+		}
+		return result;
+	};
+
+	std::vector<void*> blocks;
+	while (void* const block = allocator.allocate(1000))
+	{
+		blocks.push_back(block);
+	}
+	RBMEM_TEST_CHECK(blocks.size() > 40);
+	const uint64_t coalesces = allocator.getStats().coalesces;
+
+	// Taken back by a request of the same size, without a merge.
+	allocator.deallocate(blocks[10]);
+	RBMEM_TEST_CHECK(countDeferred() == 1 && allocator.getAllocationsCount() == blocks.size() - 1);
+	RBMEM_TEST_CHECK(allocator.allocate(1000) == blocks[10] && countDeferred() == 0 && allocator.getStats().coalesces == coalesces);
+
+	// The fifth free merges the four before it.
+	for (unsigned int i = 20; i < 25; ++i)
+	{
+		allocator.deallocate(blocks[i]);
+	}
+	RBMEM_TEST_CHECK(countDeferred() == 1 && allocator.getStats().coalesces > coalesces);
+	RBMEM_TEST_CHECK(allocator.allocate(4000) == blocks[20]);
+	blocks[21] = blocks[22] = blocks[23] = blocks[24] = nullptr;
+
+	// No free block fits until the deferred neighbours are merged. The fifth one is still deferred too.
+	for (unsigned int i = 30; i < 33; ++i)
+	{
+		allocator.deallocate(blocks[i]);
+	}
+	RBMEM_TEST_CHECK(countDeferred() == 4);
+	RBMEM_TEST_CHECK(allocator.allocate(2500) == blocks[30] && countDeferred() == 0);
+	blocks[31] = blocks[32] = nullptr;
+
+	allocator.deallocate(blocks[40]);
+	allocator.trim();
+	RBMEM_TEST_CHECK(countDeferred() == 0 && allocator.getStats().freeBlocks > 0);
+	blocks[40] = nullptr;
+
+	for (void* block : blocks)
+	{
+		allocator.deallocate(block);
+	}
+	allocator.trim();
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0 && countDeferred() == 0 && allocator.getStats().freeBlocks == 1);
+}
+
+// The counters follow every split, merge and failure, and the heap walk agrees with them.
+static void testStats()
+{
+	using Allocator = BasicRBTMemoryAllocator<CheckedRedBlackTreeTestConfig>;
+	alignas(RBTMemoryAllocator::usedAlignment) static unsigned char memory[64 * RBTMemoryAllocator::KiloByte];
+	Allocator allocator(memory, sizeof(memory));
+	void* const front = allocator.allocate(1500); // May leave a sliver in front of the region, counted from here on.
+	const RBTMemoryAllocator::Stats before = allocator.getStats();
+	RBMEM_TEST_CHECK(front && before.allocations == 1 && before.freeBlocks >= 1 && before.totalMemory > sizeof(memory) / 2 && before.totalMemory <= sizeof(memory));
+
+	void* const first = allocator.allocate(1000);
+	void* const firstGuard = allocator.allocate(1500);
+	void* const second = allocator.allocate(3000);
+	void* const secondGuard = allocator.allocate(1500);
+	RBMEM_TEST_CHECK(first && firstGuard && second && secondGuard);
+	RBMEM_TEST_CHECK(allocator.getStats().splits == before.splits + 4 && allocator.getStats().allocations == 5);
+
+	allocator.deallocate(first);
+	allocator.deallocate(second);
+	RBTMemoryAllocator::Stats stats = allocator.getStats();
+	RBMEM_TEST_CHECK(stats.freeBlocks == before.freeBlocks + 2 && stats.coalesces == before.coalesces && stats.largestFreeBlock < before.largestFreeBlock);
+	RBMEM_TEST_CHECK(stats.fragmentation > 0 && stats.fragmentation == 1.0 - (double)stats.largestFreeBlock / stats.freeMemory);
+	RBMEM_TEST_CHECK(stats.freeMemory + stats.usedMemory <= stats.totalMemory && stats.usedMemory >= 1500 * 3);
+
+	const RBTMemoryAllocator::HeapStats heapStats = allocator.getHeapStats();
+	uint64_t liveBlocks = 0, freeBlocks = 0;
+	for (unsigned int i = 0; i < RBTMemoryAllocator::histogramClassesCount; ++i)
+	{
+		liveBlocks += heapStats.liveHistogram[i];
+		freeBlocks += heapStats.freeHistogram[i];
+	}
+	RBMEM_TEST_CHECK(liveBlocks == 3 && heapStats.liveHistogram[10] == 3);
+	RBMEM_TEST_CHECK(freeBlocks == stats.freeBlocks && heapStats.freeHistogram[11] == 1); // 1024 to 2047 and 2048 to 4095 bytes, header included.
+	RBMEM_TEST_CHECK(heapStats.largestFreeBlock == stats.largestFreeBlock && heapStats.treeHeight >= 2 && heapStats.treeHeight <= 3);
+
+	RBMEM_TEST_CHECK(allocator.allocate(RBTMemoryAllocator::MegaByte) == nullptr && allocator.getStats().failedAllocations == before.failedAllocations + 1);
+
+	// Both freed blocks and the guard between them become one.
+	allocator.deallocate(firstGuard);
+	stats = allocator.getStats();
+	RBMEM_TEST_CHECK(stats.coalesces == before.coalesces + 2 && stats.freeBlocks == before.freeBlocks + 1);
+
+	allocator.deallocate(secondGuard);
+	stats = allocator.getStats();
+	RBMEM_TEST_CHECK(stats.coalesces == before.coalesces + 4 && stats.freeBlocks == before.freeBlocks);
+	RBMEM_TEST_CHECK(stats.freeMemory == before.freeMemory && stats.largestFreeBlock == before.largestFreeBlock && stats.allocations == 1);
+
+	allocator.deallocate(front);
+	stats = allocator.getStats();
+	RBMEM_TEST_CHECK(stats.freeBlocks == 1 && stats.fragmentation == 0 && stats.usedMemory == 0 && stats.freeMemory == stats.largestFreeBlock);
+}
+
+// The heap walk goes up the addresses over all regions, each block starting where the previous one ends, and reports every live block.
+// The free tree walk reports the same free blocks, from the smallest list to the largest.
+template<class Config>
+static void testWalkers()
+{
+	using Allocator = BasicRBTMemoryAllocator<Config>;
+	Allocator allocator(getCountingRegionSource(), 64 * RBTMemoryAllocator::KiloByte);
+	std::mt19937_64 random(17);
+	std::vector<void*> blocks;
+	for (unsigned int i = 0; i < 300; ++i)
+	{
+		blocks.push_back(allocator.allocate(i % 10 == 0 ? 64 : 300 + random() % 3000));
+		RBMEM_TEST_CHECK(blocks.back() != nullptr);
+	}
+	for (unsigned int i = 0; i < blocks.size(); i += 3)
+	{
+		allocator.deallocate(blocks[i]);
+		blocks[i] = nullptr;
+	}
+	RBMEM_TEST_CHECK(allocator.getRegionsCount() > 2);
+
+	std::vector<const void*> freeBlocks, claimedBlocks;
+	unsigned int regions = 0, slabPages = 0;
+	typename Allocator::HeapWalker walker(allocator);
+	RBTMemoryAllocator::BlockInfo block, previous = {};
+	while (walker.next(block))
+	{
+		RBMEM_TEST_CHECK(previous.address < block.address && block.size > 0);
+		RBMEM_TEST_CHECK(block.isFirstInRegion || (const char*)previous.address + previous.size == block.address);
+		regions += block.isFirstInRegion;
+		slabPages += block.isSlabPage;
+		if (block.isFree)
+		{
+			freeBlocks.push_back(block.address);
+		}
+		else
+			if (!block.isSlabPage)
+			{
+				claimedBlocks.push_back(block.memory);
+			}
+		previous = block;
+	}
+	RBMEM_TEST_CHECK(regions == allocator.getRegionsCount() && slabPages > 0);
+
+	walker.reset();
+	RBMEM_TEST_CHECK(walker.next(block) && block.isFirstInRegion);
+
+	for (void* const live : blocks)
+	{
+		RBMEM_TEST_CHECK(live == nullptr || allocator.getUsableSize(live) <= Allocator::slabMaxSize || std::find(claimedBlocks.begin(), claimedBlocks.end(), live) != claimedBlocks.end());
+	}
+
+	std::vector<const void*> treeBlocks;
+	typename Allocator::FreeTreeWalker treeWalker(allocator);
+	SizeType previousSize = 0;
+	while (treeWalker.next(block)) // A TLSF list spans sizes up to 1/16 apart, in no order.
+	{
+		RBMEM_TEST_CHECK(block.isFree && (Config::freeIndex == FreeIndex::Tlsf ? block.size * 17 >= previousSize * 16 : block.size >= previousSize));
+		previousSize = block.size;
+		treeBlocks.push_back(block.address);
+	}
+	std::sort(freeBlocks.begin(), freeBlocks.end());
+	std::sort(treeBlocks.begin(), treeBlocks.end());
+	RBMEM_TEST_CHECK(!treeBlocks.empty() && treeBlocks == freeBlocks);
+
+	for (void* const live : blocks)
+	{
+		allocator.deallocate(live);
+	}
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0);
+}
+
+// A sized free takes slots and blocks back whatever the path: slab classes, big and aligned blocks, reallocated ones, the thread cache and the arenas.
+static void testSizedFree()
+{
+	RBTMemoryAllocator allocator(RBTMemoryAllocator::MegaByte);
+	const SizeType sizes[] = { 8, 24, 200, RBTMemoryAllocator::slabMaxSize, RBTMemoryAllocator::slabMaxSize + 1, 1000, 5000 };
+	std::vector<void*> blocks;
+	for (const SizeType size : sizes)
+	{
+		blocks.push_back(allocator.allocate(size));
+	}
+	void* const aligned = allocator.allocate(1000, 256);
+	void* shrunkSlot = allocator.allocate(200);
+	void* shrunkBlock = allocator.allocate(5000);
+	shrunkSlot = allocator.reallocate(shrunkSlot, 40);
+	shrunkBlock = allocator.reallocate(shrunkBlock, 2000);
+	RBMEM_TEST_CHECK(aligned && shrunkSlot && shrunkBlock && allocator.getAllocationsCount() == 10);
+
+	for (unsigned int i = 0; i < blocks.size(); ++i)
+	{
+		allocator.deallocate(blocks[i], sizes[i]);
+	}
+	allocator.deallocate(aligned, 1000, 256);
+	allocator.deallocate(shrunkSlot, 40);
+	allocator.deallocate(shrunkBlock, 2000);
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0 && allocator.getUsedMemory() == 0);
+
+	{
+		RBTMemoryAllocator::ThreadCache cache(allocator, 8);
+		void* const slot = cache.allocate(100);
+		void* const block = cache.allocate(1000);
+		const unsigned int cached = cache.getCachedBlocksCount();
+		cache.deallocate(slot, 100);
+		RBMEM_TEST_CHECK(cache.getCachedBlocksCount() == cached + 1 && cache.allocate(100) == slot);
+		cache.deallocate(block, 1000);
+		cache.deallocate(slot, 100);
+		RBMEM_TEST_CHECK(cache.getCachedBlocksCount() == cached + 1);
+	}
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0);
+
+	RBTShardedMemoryAllocator sharded(4 * RBTMemoryAllocator::MegaByte, 4);
+	void* const slot = sharded.allocate(100);
+	void* const block = sharded.allocate(1000);
+	std::thread([&sharded, slot, block]() { sharded.deallocate(slot, 100); sharded.deallocate(block, 1000); }).join();
+	RBMEM_TEST_CHECK(sharded.getAllocationsCount() == 0);
+}
+
+// Blocks freed remotely by any thread stay counted until the owner drains them, explicitly or on its next allocate or trim.
+static void testRemoteFrees()
+{
+	RBTMemoryAllocator allocator(RBTMemoryAllocator::MegaByte);
+	const unsigned int threadsCount = 4, blocksPerThread = 100; // More than remoteFreesBatchSize in all.
+	std::vector<void*> blocks;
+	for (unsigned int i = 0; i < threadsCount * blocksPerThread; ++i)
+	{
+		blocks.push_back(allocator.allocate(i % 2 == 0 ? 48 : 1000 + i));
+		RBMEM_TEST_CHECK(blocks.back() != nullptr);
+	}
+
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < threadsCount; ++i)
+	{
+		threads.emplace_back([&allocator, &blocks, i]()
+		{
+			for (unsigned int j = i; j < blocks.size(); j += threadsCount)
+			{
+				allocator.deallocateRemote(blocks[j]);
+			}
+		});
+	}
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == blocks.size());
+	RBMEM_TEST_CHECK(allocator.drainRemoteFrees() == blocks.size() && allocator.getAllocationsCount() == 0 && allocator.getUsedMemory() == 0);
+	RBMEM_TEST_CHECK(allocator.drainRemoteFrees() == 0);
+
+	// Drained on the next allocate.
+	void* const queued = allocator.allocate(1000);
+	allocator.deallocateRemote(queued);
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 1);
+	void* const next = allocator.allocate(1000);
+	RBMEM_TEST_CHECK(next && allocator.getAllocationsCount() == 1);
+
+	// And on trim.
+	allocator.deallocateRemote(next);
+	allocator.trim();
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0 && allocator.drainRemoteFrees() == 0);
+}
+
+// The checked configuration reports a wrong size passed to deallocate with its own exception, and keeps the block.
+static void testCheckedConfig()
+{
+	BasicRBTMemoryAllocator<RBTCheckedMemoryAllocatorConfig> allocator;
+	void* const block = allocator.allocate(100);
+	RBMEM_TEST_CHECK(block != nullptr);
+
+	unsigned int error = 0;
+	try
+	{
+		allocator.deallocate(block, 100000);
+	}
+	catch (const RBTMemoryAllocatorError& exception)
+	{
+		error = exception.getError();
+	}
+	RBMEM_TEST_CHECK(error == 10);
+
+	// A slot freed with the size of a bigger class, and a block with an alignment it doesn't have.
+	void* const slot = allocator.allocate(32);
+	void* const misaligned = allocator.allocate(1000);
+	const SizeType wrongAlignment = ((uintptr_t)misaligned & (0 - (uintptr_t)misaligned)) * 2;
+	error = 0;
+	try
+	{
+		allocator.deallocate(slot, 200);
+	}
+	catch (const RBTMemoryAllocatorError& exception)
+	{
+		error = exception.getError();
+	}
+	RBMEM_TEST_CHECK(error == 10);
+	error = 0;
+	try
+	{
+		allocator.deallocate(misaligned, 1000, wrongAlignment);
+	}
+	catch (const RBTMemoryAllocatorError& exception)
+	{
+		error = exception.getError();
+	}
+	RBMEM_TEST_CHECK(error == 10);
+
+	allocator.deallocate(block, 100);
+	allocator.deallocate(slot, 32);
+	allocator.deallocate(misaligned, 1000);
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0);
+}
+
+// Every layout and counter setting is a Config member, so allocators of all of them can live in one program, whatever the macros say.
+struct TaggedTestConfig
+	: public RBTCheckedMemoryAllocatorConfig
+{
+	static constexpr bool boundaryTags = true;
+	static constexpr bool compactLinks = false;
+	static constexpr bool stats = true;
+};
+struct CompactTestConfig
+	: public RBTCheckedMemoryAllocatorConfig
+{
+	static constexpr bool boundaryTags = false;
+	static constexpr bool compactLinks = true;
+	static constexpr bool stats = false;
+};
+struct LinkedTestConfig
+	: public RBTCheckedMemoryAllocatorConfig
+{
+	static constexpr bool boundaryTags = false;
+	static constexpr bool compactLinks = false;
+	static constexpr bool stats = true;
+};
+
+// Distance between two blocks allocated one after the other: the request rounded up plus a header.
+template<class Config>
+static SizeType getBlockStride(const SizeType size)
+{
+	BasicRBTMemoryAllocator<Config> allocator(RBTMemoryAllocator::MegaByte);
+	void* const front = allocator.allocate(size); // The region's first block may be placed differently.
+	unsigned char* const first = (unsigned char*)allocator.allocate(size);
+	unsigned char* const second = (unsigned char*)allocator.allocate(size);
+	const SizeType result = first && second && second > first ? (SizeType)(second - first) : 0;
+	allocator.deallocate(second);
+	allocator.deallocate(first);
+	allocator.deallocate(front);
+	return result;
+}
+
+// A claimed block's header is one word with boundary tags, instead of two links, and freeing still merges both neighbours at once.
+template<class Config>
+static void testCoalescing()
+{
+	BasicRBTMemoryAllocator<Config> allocator(RBTMemoryAllocator::MegaByte);
+	void* const front = allocator.allocate(1000);
+	void* const left = allocator.allocate(1000);
+	void* const middle = allocator.allocate(1000);
+	void* const right = allocator.allocate(1000);
+	void* const guard = allocator.allocate(1000);
+	allocator.deallocate(left);
+	allocator.deallocate(right);
+	const uint64_t freeBlocks = allocator.getStats().freeBlocks, coalesces = allocator.getStats().coalesces;
+	allocator.deallocate(middle);
+	RBMEM_TEST_CHECK(allocator.getStats().freeBlocks == freeBlocks - 1 && allocator.getStats().coalesces == coalesces + 2);
+	RBMEM_TEST_CHECK(allocator.allocate(3000) == left); // The three blocks are one now.
+	allocator.deallocate(left);
+	allocator.deallocate(guard);
+	allocator.deallocate(front);
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0 && allocator.getStats().freeBlocks == 1);
+}
+
+// Compact links reach 4 GiB, so the heap grows by regions in reach of the others and refuses the rest like a failed acquire.
+// The first region comes from static storage, the others from malloc, which maps big blocks far from it on most 64-bit systems.
+static void testCompactLinks()
+{
+	alignas(RBTMemoryAllocator::usedAlignment) static unsigned char memory[256 * RBTMemoryAllocator::KiloByte];
+	static bool isStaticUsed;
+	isStaticUsed = false;
+	RBTMemoryAllocator::RegionSource source;
+	source.acquire = [](SizeType size) -> void*
+	{
+		if (!isStaticUsed && size <= sizeof(memory))
+		{
+			isStaticUsed = true;
+			return memory;
+		}
+		return std::malloc(size);
+	};
+	source.release = [](void* region, SizeType) { if (region != memory) std::free(region); };
+
+	BasicRBTMemoryAllocator<CompactTestConfig> allocator(source, sizeof(memory));
+	void* const near = allocator.allocate(1000);
+	RBMEM_TEST_CHECK(near >= (void*)memory && near < (void*)(memory + sizeof(memory)));
+
+	void* const probe = std::malloc(4 * RBTMemoryAllocator::MegaByte);
+	const uintptr_t distance = (uintptr_t)probe > (uintptr_t)memory ? (uintptr_t)probe - (uintptr_t)memory : (uintptr_t)memory - (uintptr_t)probe;
+	std::free(probe);
+	void* const far = allocator.allocate(512 * RBTMemoryAllocator::KiloByte); // Doesn't fit the first region.
+	if (sizeof(void*) == 8 && distance > 8ull * 1024 * RBTMemoryAllocator::MegaByte)
+	{
+		RBMEM_TEST_CHECK(far == nullptr && allocator.getRegionsCount() == 1);
+	}
+	allocator.deallocate(far);
+	allocator.deallocate(near);
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0);
+
+	// Regions in reach of each other are linked like one.
+	BasicRBTMemoryAllocator<CompactTestConfig> growing(getCountingRegionSource(), 256 * RBTMemoryAllocator::KiloByte);
+	std::vector<void*> blocks;
+	for (unsigned int i = 0; i < 16; ++i)
+	{
+		blocks.push_back(growing.allocate(100 * RBTMemoryAllocator::KiloByte));
+		RBMEM_TEST_CHECK(blocks.back() != nullptr);
+	}
+	RBMEM_TEST_CHECK(growing.getRegionsCount() > 1);
+	for (void* const block : blocks)
+	{
+		growing.deallocate(block);
+	}
+	RBMEM_TEST_CHECK(growing.getAllocationsCount() == 0 && growing.dbgCheckListIntegrity());
+}
+
+static void testBoundaryTags()
+{
+	const SizeType linkedStride = getBlockStride<LinkedTestConfig>(1000), taggedStride = getBlockStride<TaggedTestConfig>(1000);
+	RBMEM_TEST_CHECK(linkedStride >= 1000 + 2 * sizeof(void*) && taggedStride >= 1000 + sizeof(SizeType) && taggedStride < linkedStride);
+	testCoalescing<LinkedTestConfig>();
+	testCoalescing<TaggedTestConfig>();
+}
+
+template<class Config>
+static void testConfiguration()
+{
+	BasicRBTMemoryAllocator<Config> allocator(RBTMemoryAllocator::MegaByte);
+	std::mt19937_64 random(2);
+	std::vector<std::pair<unsigned char*, SizeType>> live;
+
+	for (unsigned int step = 0; step < 3000; ++step)
+	{
+		if (live.empty() || random() % 3 != 0)
+		{
+			const SizeType size = 1 + random() % 2000;
+			unsigned char* const block = (unsigned char*)allocator.allocate(size, random() % 4 == 0 ? 64 : allocator.usedAlignment);
+			if (block)
+			{
+				RBMEM_TEST_CHECK(allocator.getUsableSize(block) >= size);
+				block[0] = block[size - 1] = (unsigned char)size;
+				live.emplace_back(block, size);
+			}
+		}
+		else
+		{
+			const size_t index = (size_t)(random() % live.size());
+			RBMEM_TEST_CHECK(live[index].first[0] == (unsigned char)live[index].second && live[index].first[live[index].second - 1] == (unsigned char)live[index].second);
+			allocator.deallocate(live[index].first);
+			live[index] = live.back();
+			live.pop_back();
+		}
+	}
+
+	for (const auto& block : live)
+	{
+		allocator.deallocate(block.first);
+	}
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0 && allocator.dbgCheckListIntegrity());
+	RBMEM_TEST_CHECK(Config::stats == (allocator.getStats().freeBlocks > 0));
+}
+
+// A block list that doesn't add up is reported with its own error. Flips a bit of the second block's header that only the list check reads:
+// the previous block's free flag with boundary tags, the link to the previous block otherwise. Assumes a little-endian machine.
+template<class Config>
+static void testBrokenBlockList()
+{
+	BasicRBTMemoryAllocator<Config> allocator(RBTMemoryAllocator::MegaByte);
+	void* const first = allocator.allocate(1000);
+	unsigned char* const second = (unsigned char*)allocator.allocate(1000);
+	RBMEM_TEST_CHECK(first && second);
+
+	unsigned char* const header = Config::boundaryTags ? second - sizeof(SizeType) : second - allocator.usedAlignment;
+	const unsigned char flip = Config::boundaryTags ? 2 : 8;
+	*header ^= flip;
+	unsigned int error = 0;
+	try
+	{
+		allocator.allocate(2000);
+	}
+	catch (const RBTMemoryAllocatorError& exception)
+	{
+		error = exception.getError();
+	}
+	RBMEM_TEST_CHECK(error == 14);
+	*header ^= flip;
+
+	allocator.deallocate(second);
+	allocator.deallocate(first);
+	RBMEM_TEST_CHECK(allocator.getAllocationsCount() == 0);
+}
+
+int main()
+{
+	testHugeRequests();
+	testSameSizeChain();
+	testBestFit();
+	testTlsfLargestFreeBlock();
+	testThreadCache();
+	testReallocate();
+	testBatches();
+	testDeferredFrees();
+	testStats();
+	testWalkers<RedBlackTreeTestConfig>();
+	testWalkers<TlsfTestConfig>();
+	testSizedFree();
+	testRemoteFrees();
+	testSlabPages();
+	testPurging();
+	testStdAllocator();
+	testShardedAllocator();
+	testCheckedConfig();
+	testConfiguration<TaggedTestConfig>();
+	testConfiguration<CompactTestConfig>();
+	testBoundaryTags();
+	testCompactLinks();
+	testBrokenBlockList<RBTCheckedMemoryAllocatorConfig>();
+	testBrokenBlockList<TaggedTestConfig>();
+	testBrokenBlockList<CompactTestConfig>();
+
+	if (failures == 0)
+	{
+		std::printf("All tests passed\n");
+	}
+	return (int)failures;
+}